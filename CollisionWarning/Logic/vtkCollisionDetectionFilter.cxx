@@ -14,8 +14,9 @@
 
 =========================================================================*/
 #include "vtkCollisionDetectionFilter.h"
+#include "vtkCollisionHierarchy.h"
+#include "vtkCollisionTriangleKernel.h"
 #include "vtkObjectFactory.h"
-#include "vtkOBBTree.h"
 #include "vtkMatrix4x4.h"
 #include "vtkIdList.h"
 #include "vtkPolyData.h"
@@ -40,9 +41,108 @@
 #include "vtkTransform.h"
 #include "vtkSmartPointer.h"
 #include "vtkCellArray.h"
+#include "vtkSMPTools.h"
+#include "vtkSMPThreadLocal.h"
+#include "vtkAtomicInt.h"
+
+#include <algorithm>
+#include <vector>
+
+// The box tests of two pairs of nodes run in the two lanes of SSE2 registers where available
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VTK_COLLISION_USE_SSE2
+#endif
 
 vtkStandardNewMacro(vtkCollisionDetectionFilter);
 
+namespace
+{
+// A pair of nodes of the two hierarchies and their depths
+struct NodePair
+  {
+  vtkIdType A, B;
+  int DepthA, DepthB;
+  };
+
+// A pair of nodes where the traversal stopped, because their boxes are disjoint or because
+// both are leaves. Task is the task the pair was reached from.
+struct FrontPair
+  {
+  NodePair Pair;
+  vtkIdType Task;
+  int Disjoint;
+  bool operator<(const FrontPair &other) const {return this->Task < other.Task;}
+  };
+
+// A pair of nodes whose boxes have been tested
+struct TestedPair
+  {
+  NodePair Pair;
+  int Disjoint;
+  };
+
+// The box of a node of B in the coordinate system of input 0: its center and its half edge
+// vectors
+struct TransformedBox
+  {
+  double Center[3];
+  double Edges[3][3];
+  };
+}
+
+// State kept between updates
+class vtkCollisionDetectionFilter::vtkInternals
+{
+public:
+  vtkInternals()
+    {
+    for (int i = 0; i < 2; i++)
+      {
+      this->ContactCells[i] = vtkSmartPointer<vtkIdTypeArray>::New();
+      this->ContactCells[i]->SetName("ContactCells");
+      }
+    this->ContactPoints = vtkSmartPointer<vtkPoints>::New();
+    this->ContactSegments = vtkSmartPointer<vtkCellArray>::New();
+    this->Matrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    this->InverseMatrix0 = vtkSmartPointer<vtkMatrix4x4>::New();
+    for (int i = 0; i < 2; i++)
+      {
+      this->Scalars[i] = vtkSmartPointer<vtkUnsignedCharArray>::New();
+      this->Scalars[i]->SetNumberOfComponents(4);
+      }
+    this->ContactColors = vtkSmartPointer<vtkLookupTable>::New();
+    this->BlankAlpha = -1.0;
+    }
+
+  // Contacts of the last update: the ids of the pairs of contacting cells, and the points of
+  // the contacts in world coordinates (one or two per contact). They are cleared at each
+  // update, which keeps their memory.
+  std::vector<vtkIdType> ContactCellIds;
+  std::vector<double> ContactPointCoords;
+
+  // Contact cells arrays of outputs 0 and 1, and points and lines or vertices of output 2.
+  // They are filled from the contacts at each update and reused, so once they have grown to
+  // the number of contacts an update does not allocate them.
+  vtkSmartPointer<vtkIdTypeArray> ContactCells[2];
+  vtkSmartPointer<vtkPoints> ContactPoints;
+  vtkSmartPointer<vtkCellArray> ContactSegments;
+
+  // Cell scalars of outputs 0 and 1, the cells they color as contacts, the colors of the
+  // contacts and the alpha of the other cells
+  vtkSmartPointer<vtkUnsignedCharArray> Scalars[2];
+  std::vector<vtkIdType> ColoredCells[2];
+  vtkSmartPointer<vtkLookupTable> ContactColors;
+  float BlankAlpha;
+
+  // Transform from the coordinate system of input 1 to the one of input 0, and the inverse of
+  // the matrix of input 0
+  vtkSmartPointer<vtkMatrix4x4> Matrix;
+  vtkSmartPointer<vtkMatrix4x4> InverseMatrix0;
+  // Front of the traversal of the last update, in the order of a depth first traversal
+  std::vector<FrontPair> Front;
+};
+
 // Constructs with initial 0 values.
 vtkCollisionDetectionFilter::vtkCollisionDetectionFilter()
 {
@@ -58,26 +158,42 @@ vtkCollisionDetectionFilter::vtkCollisionDetectionFilter()
   this->Matrix[0] = NULL;
   this->Matrix[1] = NULL;
   this->NumberOfBoxTests = 0;
+  this->NumberOfContacts = 0;
+  this->PassInputs = 1;
+  this->GenerateContacts = 1;
   this->BoxTolerance = 0.0;
   this->CellTolerance = 0.0;
   this->NumberOfCellsPerNode = 2;
-  this->tree0 = vtkOBBTree::New();
-  this->tree1 = vtkOBBTree::New();
+  this->HierarchyType = vtkCollisionHierarchy::VTK_OBB_HIERARCHY;
+  this->tree0 = vtkCollisionHierarchy::New();
+  this->tree1 = vtkCollisionHierarchy::New();
+  this->ExternalHierarchy[0] = this->ExternalHierarchy[1] = 0;
   this->GenerateScalars = 0;
   this->CollisionMode = VTK_ALL_CONTACTS;
   this->Opacity = 1.0;
+  this->ParallelTraversal = 1;
+  this->InstructionSet = vtkCollisionTriangleKernel::GetSupportedInstructionSet();
+  this->MinimumDistance = -1.0;
+  this->ProximityDistance = 0.0;
+  this->MaximumDistance = VTK_DOUBLE_MAX;
+  this->TemporalCoherence = 1;
+  this->WitnessTriangles[0] = this->WitnessTriangles[1] = -1;
+  this->WitnessAxis = -1;
+  this->WitnessBuildTime[0] = this->WitnessBuildTime[1] = 0;
+  this->Internals = new vtkInternals;
 }
 
 // Destroy any allocated memory.
 vtkCollisionDetectionFilter::~vtkCollisionDetectionFilter()
 {
+  delete this->Internals;
   if (this->tree0 != NULL)
     {
-    this->tree0->Delete();
+    this->tree0->UnRegister(this);
     }
   if (this->tree1 != NULL)
     {
-    this->tree1->Delete();
+    this->tree1->UnRegister(this);
     }
 
   if (this->Matrix[0])
@@ -145,8 +261,7 @@ vtkIdTypeArray *vtkCollisionDetectionFilter::GetContactCells(int i)
     return NULL;
     }
 
-  return vtkIdTypeArray::SafeDownCast(
-    this->GetOutput(i)->GetFieldData()->GetArray("ContactCells"));
+  return this->Internals->ContactCells[i];
 
 }
 
@@ -186,6 +301,56 @@ void vtkCollisionDetectionFilter::SetTransform(int i, vtkLinearTransform *transf
   this->Modified();
 }
 
+//----------------------------------------------------------------------------
+void vtkCollisionDetectionFilter::SetHierarchy(int i, vtkCollisionHierarchy *hierarchy)
+{
+  if (i > 1 || i < 0)
+    {
+    vtkErrorMacro(<< "Index " << i
+      << " is out of range in SetHierarchy. Only two hierarchies allowed!");
+    return;
+    }
+
+  vtkCollisionHierarchy *&tree = (i == 0 ? this->tree0 : this->tree1);
+  if (hierarchy == tree && hierarchy != NULL)
+    {
+    return;
+    }
+
+  if (tree)
+    {
+    tree->UnRegister(this);
+    tree = NULL;
+    }
+
+  vtkDebugMacro(<< "Setting hierarchy: " << i << " to point to " << hierarchy << endl);
+
+  if (hierarchy)
+    {
+    tree = hierarchy;
+    hierarchy->Register(this);
+    }
+  else
+    {
+    // Back to a hierarchy of the filter's own
+    tree = vtkCollisionHierarchy::New();
+    }
+  this->ExternalHierarchy[i] = (hierarchy != NULL);
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+vtkCollisionHierarchy *vtkCollisionDetectionFilter::GetHierarchy(int i)
+{
+  if (i > 1 || i < 0)
+    {
+    vtkErrorMacro(<< "Index " << i
+      << " is out of range in GetHierarchy. Only two hierarchies allowed!");
+    return NULL;
+    }
+  return (i == 0 ? this->tree0 : this->tree1);
+}
+
 
 
 void vtkCollisionDetectionFilter::SetMatrix(int i, vtkMatrix4x4 *matrix)
@@ -239,361 +404,1678 @@ vtkMatrix4x4* vtkCollisionDetectionFilter::GetMatrix(int i)
   return this->Matrix[i];
 }
 
-static int ComputeCollisions(vtkOBBNode *nodeA, vtkOBBNode *nodeB, vtkMatrix4x4 *Xform, void *clientdata)
+//----------------------------------------------------------------------------
+void vtkCollisionDetectionFilter::SetInstructionSet(int instructionSet)
 {
-  // This is hard-coded for triangles but could be easily changed to allow for allow n-sided polygons
-  int numIdsA, numIdsB;
-  vtkIdList *IdsA, *IdsB, *pointIdsA, *pointIdsB;
-  vtkCellArray *cells;
-  vtkIdType cellPtIds[2];
-  vtkIdTypeArray *contactcells1, *contactcells2;
-  vtkPoints *contactpoints;
-  IdsA  = nodeA->Cells;
-  IdsB = nodeB->Cells;
-  numIdsA = IdsA->GetNumberOfIds();
-  numIdsB = IdsB->GetNumberOfIds();
-
-  // clientdata is a pointer to this object... need to cast it as such
-  vtkCollisionDetectionFilter* self = reinterpret_cast<vtkCollisionDetectionFilter *>( clientdata );
-
-  // Turn off debugging here if its on... otherwise there's squawks every update/box test
-  int DebugWasOn = 0;
-  int FirstContact = 0;
-  if (self->GetDebug())
+  instructionSet = vtkCollisionTriangleKernel::ClampInstructionSet(instructionSet);
+  if (this->InstructionSet != instructionSet)
     {
-    self->DebugOff();
-    DebugWasOn = 1;
+    this->InstructionSet = instructionSet;
+    this->Modified();
     }
-  vtkPolyData *inputA = vtkPolyData::SafeDownCast(self->GetInput(0));
-  vtkPolyData *inputB = vtkPolyData::SafeDownCast(self->GetInput(1));
-  contactcells1 = self->GetContactCells(0);
-  contactcells2 = self->GetContactCells(1);
-  contactpoints = self->GetOutput(2)->GetPoints();
+}
 
-  if (self->GetCollisionMode() == vtkCollisionDetectionFilter::VTK_ALL_CONTACTS)
-    {
-    cells = self->GetOutput(2)->GetLines();
-    }
-  else
+//----------------------------------------------------------------------------
+// Transform the box of nodeB from the coordinate system of input 1 to the one of input 0.
+// The transformed box may be scaled or sheared, so its edges are not assumed to be orthonormal.
+static inline void TransformBox(const vtkCollisionHierarchy::Node &nodeB,
+  const double XformBtoA[4][4], TransformedBox &box)
+{
+  for (int k = 0; k < 3; k++)
     {
-    cells = self->GetOutput(2)->GetVerts();
+    for (int j = 0; j < 3; j++)
+      {
+      box.Edges[j][k] = nodeB.HalfExtents[j] * (XformBtoA[k][0]*nodeB.Axes[j][0] +
+        XformBtoA[k][1]*nodeB.Axes[j][1] + XformBtoA[k][2]*nodeB.Axes[j][2]);
+      }
+    box.Center[k] = XformBtoA[k][0]*nodeB.Center[0] + XformBtoA[k][1]*nodeB.Center[1] +
+      XformBtoA[k][2]*nodeB.Center[2] + XformBtoA[k][3];
     }
+}
 
-  float Tolerance = self->GetCellTolerance();
-  if (self->GetCollisionMode() == vtkCollisionDetectionFilter::VTK_FIRST_CONTACT)
+// Express the transformed box of B in the axes of the box of nodeA. d is the vector between
+// the centers and the columns of R are the half edge vectors of B.
+static inline void RelativeBox(const vtkCollisionHierarchy::Node &nodeA,
+  const TransformedBox &boxB, double d[3], double R[3][3], double absR[3][3])
+{
+  double t[3] = {boxB.Center[0]-nodeA.Center[0], boxB.Center[1]-nodeA.Center[1],
+    boxB.Center[2]-nodeA.Center[2]};
+  for (int i = 0; i < 3; i++)
     {
-    FirstContact = 1;
+    d[i] = vtkMath::Dot(t, nodeA.Axes[i]);
+    for (int j = 0; j < 3; j++)
+      {
+      R[i][j] = vtkMath::Dot(nodeA.Axes[i], boxB.Edges[j]);
+      absR[i][j] = fabs(R[i][j]);
+      }
     }
+}
 
+// Express the box of nodeB (in the coordinate system of input 1) in the axes of the box of
+// nodeA (in the coordinate system of input 0). XformBtoA transforms from the coordinate system
+// of input 1 to the one of input 0.
+static inline void RelativeBox(const vtkCollisionHierarchy::Node &nodeA,
+  const vtkCollisionHierarchy::Node &nodeB, const double XformBtoA[4][4],
+  double d[3], double R[3][3], double absR[3][3])
+{
+  TransformedBox boxB;
+  TransformBox(nodeB, XformBtoA, boxB);
+  RelativeBox(nodeA, boxB, d, R, absR);
+}
 
-  vtkIdType cellIdA, cellIdB;
-
-  double x1[4], x2[4], xnew[4];
-  double ptsA[9], ptsB[9];
-  double boundsA[6], boundsB[6];
-  vtkIdType i,j,k,m,n,p,v;
-  double *point, in[4], out[4];
-
-  // Loop thru the cells/points in IdsA
-  for (i = 0; i < numIdsA; i++)
-   {
-    cellIdA = IdsA->GetId(i);
-    pointIdsA = inputA->GetCell(cellIdA)->GetPointIds();
-    inputA->GetCellBounds(cellIdA, boundsA);
+// Test the box of nodeA against the transformed box of B with the separating axis theorem,
+// the box of nodeA is enlarged by tolerance. Returns 1 if the boxes are disjoint, 0 if
+// they overlap.
+static int DisjointBoxes(const vtkCollisionHierarchy::Node &nodeA, const TransformedBox &boxB,
+  double tolerance)
+{
+  int i, j, k;
+  double d[3], a[3], R[3][3], absR[3][3];
+  RelativeBox(nodeA, boxB, d, R, absR);
+  for (i = 0; i < 3; i++)
+    {
+    a[i] = nodeA.HalfExtents[i] + tolerance;
+    }
 
-    // Initialize ptsA
-    // It might speed things up if ptsA and ptsB only had to be an
-    // array of pointers to the cell vertices, rather than allocating here.
-    for (j=0; j<3; j++)
+  // Face axes of A
+  for (i = 0; i < 3; i++)
+    {
+    if (fabs(d[i]) > a[i] + absR[i][0] + absR[i][1] + absR[i][2])
       {
-      for (k=0; k<3; k++)
-        {
-        ptsA[j*3+k] = inputA->GetPoints()->GetPoint(pointIdsA->GetId(j))[k];
-        }
+      return 1;
       }
+    }
 
-    // Loop thru each cell IdsB and test for collision
-    for (m = 0; m < numIdsB; m++)
+  // Edge directions of B
+  for (j = 0; j < 3; j++)
+    {
+    double proj = d[0]*R[0][j] + d[1]*R[1][j] + d[2]*R[2][j];
+    double radius = a[0]*absR[0][j] + a[1]*absR[1][j] + a[2]*absR[2][j];
+    for (k = 0; k < 3; k++)
       {
-      cellIdB = IdsB->GetId(m);
-      pointIdsB = inputB->GetCell(cellIdB)->GetPointIds();
-      inputB->GetCellBounds(cellIdB, boundsB);
+      radius += fabs(R[0][k]*R[0][j] + R[1][k]*R[1][j] + R[2][k]*R[2][j]);
+      }
+    if (fabs(proj) > radius)
+      {
+      return 1;
+      }
+    }
 
-      // Initialize ptsB
-      for (n=0; n<3; n++)
+  // Cross products of the axes of A and the edges of B
+  for (i = 0; i < 3; i++)
+    {
+    int i1 = (i+1)%3;
+    int i2 = (i+2)%3;
+    for (j = 0; j < 3; j++)
+      {
+      // Skip nearly parallel edges, the axis is not defined
+      double length2 = R[i1][j]*R[i1][j] + R[i2][j]*R[i2][j];
+      if (length2 <= 1e-12*(length2 + R[i][j]*R[i][j]))
         {
-        point = inputB->GetPoints()->GetPoint(pointIdsB->GetId(n));
-        // transform the vertex
-        in[0] = point[0]; in[1] = point[1]; in[2] = point[2]; in[3] = 1.0;
-        Xform->MultiplyPoint( in, out );
-        out[0] = out[0]/out[3];
-        out[1] = out[1]/out[3];
-        out[2] = out[2]/out[3];
-        for (p=0; p<3; p++)
-          {
-          ptsB[n*3+p] = out[p];
-          }
+        continue;
         }
-
-      //Calculate the bounds for the xformed cell
-      boundsB[0] = boundsB[2] = boundsB[4] =  VTK_FLOAT_MAX;
-      boundsB[1] = boundsB[3] = boundsB[5] = -VTK_FLOAT_MAX;
-      for (v=0; v < 9; v=v+3)
-        {
-        if (ptsB[v] < boundsB[0]) boundsB[0] = ptsB[v];
-        if (ptsB[v] > boundsB[1]) boundsB[1] = ptsB[v];
-        if (ptsB[v+1] < boundsB[2]) boundsB[2] = ptsB[v+1];
-        if (ptsB[v+1] > boundsB[3]) boundsB[3] = ptsB[v+1];
-        if (ptsB[v+2] < boundsB[4]) boundsB[4] = ptsB[v+2];
-        if (ptsB[v+2] > boundsB[5]) boundsB[5] = ptsB[v+2];
-        }
-
-      // Test for intersection
-      if (self->IntersectPolygonWithPolygon(3, ptsA, boundsA, 3, ptsB, boundsB,
-        Tolerance, x1, x2, self->GetCollisionMode()))
-        {
-        contactcells1->InsertNextValue(cellIdA);
-        contactcells2->InsertNextValue(cellIdB);
-        //transform x back to "world space"
-        // could speed this up by testing for identity matrix
-        // and skipping the next transform.
-        x1[3] = x2[3] = 1.0;
-        self->GetMatrix(0)->MultiplyPoint(x1,xnew);
-        xnew[0] = xnew[0]/xnew[3];
-        xnew[1] = xnew[1]/xnew[3];
-        xnew[2] = xnew[2]/xnew[3];
-        cellPtIds[0] = contactpoints->InsertNextPoint(xnew);
-        if (self->GetCollisionMode() == vtkCollisionDetectionFilter::VTK_ALL_CONTACTS)
-          {
-          self->GetMatrix(0)->MultiplyPoint(x2,xnew);
-          xnew[0] = xnew[0]/xnew[3];
-          xnew[1] = xnew[1]/xnew[3];
-          xnew[2] = xnew[2]/xnew[3];
-          cellPtIds[1] = contactpoints->InsertNextPoint(xnew);
-          // insert a new line
-          cells->InsertNextCell(2, cellPtIds);
-          }
-        else
-          {
-          // insert a new vert
-          cells->InsertNextCell(1, cellPtIds);
-          }
-
-
-        if (FirstContact)
+      double proj = d[i2]*R[i1][j] - d[i1]*R[i2][j];
+      double radius = a[i1]*absR[i2][j] + a[i2]*absR[i1][j];
+      for (k = 0; k < 3; k++)
+        {
+        if (k != j)
           {
-          // return the negative of the number of box tests to find first contact
-          // this will call a halt to the proceedings
-          if (DebugWasOn) self->DebugOn();
-          return (-1 - self->GetNumberOfBoxTests());
+          radius += fabs(R[i2][k]*R[i1][j] - R[i1][k]*R[i2][j]);
           }
         }
-
+      if (fabs(proj) > radius)
+        {
+        return 1;
+        }
       }
     }
-  if (DebugWasOn) self->DebugOn();
-  return 1;
+
+  return 0;
 }
 
-// Description:
-// Perform a collision detection
-int vtkCollisionDetectionFilter::RequestData(
-  vtkInformation *vtkNotUsed(request),
-  vtkInformationVector **inputVector,
-  vtkInformationVector *outputVector)
+// Test the box of nodeA, enlarged by tolerance, against the box of nodeB. Returns 1 if the
+// boxes are disjoint, 0 if they overlap.
+static inline int DisjointNodes(const vtkCollisionHierarchy::Node &nodeA,
+  const vtkCollisionHierarchy::Node &nodeB, const double XformBtoA[4][4], double tolerance)
 {
-  // get the info objects
-  vtkDebugMacro(<< "Beginning execution...");
+  TransformedBox boxB;
+  TransformBox(nodeB, XformBtoA, boxB);
+  return DisjointBoxes(nodeA, boxB, tolerance);
+}
 
-  // inputs and outputs
-  vtkPolyData *input[2];
-  vtkPolyData *output[3];
+// Test two pairs of boxes at once, as DisjointBoxes does: sets disjoint[n] to 1 if the box of
+// nodeA[n], enlarged by tolerance, and boxB[n] are disjoint. With SSE2 the two tests run in the
+// two lanes of the registers, with the same operations in the same order as DisjointBoxes.
+static inline void DisjointBoxPairs(const vtkCollisionHierarchy::Node *nodeA[2],
+  const TransformedBox *boxB[2], double tolerance, int disjoint[2])
+{
+#ifdef VTK_COLLISION_USE_SSE2
+  int i, j, k;
+  const __m128d signMask = _mm_set1_pd(-0.0);
 
-  // copy inputs to outputs
-  vtkInformation *inInfo, *outInfo;
-  for (int i=0; i<2; i++)
+  // Relative boxes, as RelativeBox computes them
+  __m128d axesA[3][3], edgesB[3][3], t[3];
+  for (i = 0; i < 3; i++)
     {
-    inInfo = inputVector[i]->GetInformationObject(0);
-    input[i] = vtkPolyData::SafeDownCast(
-      inInfo->Get(vtkDataObject::DATA_OBJECT()));
-
-    outInfo = outputVector->GetInformationObject(i);
-    output[i] = vtkPolyData::SafeDownCast(
-      outInfo->Get(vtkDataObject::DATA_OBJECT()));
-
-    output[i]->CopyStructure(input[i]);
-    output[i]->GetPointData()->PassData(input[i]->GetPointData());
-    output[i]->GetCellData()->PassData(input[i]->GetCellData());
-    output[i]->GetFieldData()->PassData(input[i]->GetFieldData());
-    }
-
-  // set up the contacts polydata output on port index 2
-  outInfo = outputVector->GetInformationObject(2);
-  output[2] = vtkPolyData::SafeDownCast(
-    outInfo->Get(vtkDataObject::DATA_OBJECT()));
-  vtkPoints *contactsPoints = vtkPoints::New();
-  output[2]->SetPoints(contactsPoints);
-  contactsPoints->Delete();
-
-  if (this->CollisionMode == vtkCollisionDetectionFilter::VTK_ALL_CONTACTS)
-    {//then create a lines cell array
-    vtkCellArray *lines = vtkCellArray::New();
-    output[2]->SetLines(lines);
-    lines->Delete();
+    t[i] = _mm_sub_pd(_mm_set_pd(boxB[1]->Center[i], boxB[0]->Center[i]),
+      _mm_set_pd(nodeA[1]->Center[i], nodeA[0]->Center[i]));
+    for (j = 0; j < 3; j++)
+      {
+      axesA[i][j] = _mm_set_pd(nodeA[1]->Axes[i][j], nodeA[0]->Axes[i][j]);
+      edgesB[i][j] = _mm_set_pd(boxB[1]->Edges[i][j], boxB[0]->Edges[i][j]);
+      }
     }
-  else
-    {//else create a verts cell array
-    vtkCellArray *verts = vtkCellArray::New();
-    output[2]->SetVerts(verts);
-    verts->Delete();
+  __m128d vd[3], va[3], vR[3][3], vabsR[3][3];
+  for (i = 0; i < 3; i++)
+    {
+    vd[i] = _mm_add_pd(_mm_add_pd(_mm_mul_pd(t[0], axesA[i][0]), _mm_mul_pd(t[1], axesA[i][1])),
+      _mm_mul_pd(t[2], axesA[i][2]));
+    va[i] = _mm_add_pd(_mm_set_pd(nodeA[1]->HalfExtents[i], nodeA[0]->HalfExtents[i]),
+      _mm_set1_pd(tolerance));
+    for (j = 0; j < 3; j++)
+      {
+      vR[i][j] = _mm_add_pd(_mm_add_pd(_mm_mul_pd(axesA[i][0], edgesB[j][0]),
+        _mm_mul_pd(axesA[i][1], edgesB[j][1])), _mm_mul_pd(axesA[i][2], edgesB[j][2]));
+      vabsR[i][j] = _mm_andnot_pd(signMask, vR[i][j]);
+      }
     }
+  __m128d separated = _mm_setzero_pd();
 
-  //Allocate arrays for the contact cells lists
-  vtkSmartPointer<vtkIdTypeArray> contactcells0 =
-    vtkSmartPointer<vtkIdTypeArray>::New();
-  contactcells0->SetName("ContactCells");
-  output[0]->GetFieldData()->AddArray(contactcells0);
-
-  vtkSmartPointer<vtkIdTypeArray> contactcells1 =
-    vtkSmartPointer<vtkIdTypeArray>::New();
-  contactcells1->SetName("ContactCells");
-  output[1]->GetFieldData()->AddArray(contactcells1);
+  // Face axes of A
+  for (i = 0; i < 3; i++)
+    {
+    __m128d radius = _mm_add_pd(_mm_add_pd(_mm_add_pd(va[i], vabsR[i][0]), vabsR[i][1]), vabsR[i][2]);
+    separated = _mm_or_pd(separated, _mm_cmpgt_pd(_mm_andnot_pd(signMask, vd[i]), radius));
+    }
 
-  // make sure input is available
-  if ( ! input[0] )
+  // Edge directions of B
+  for (j = 0; j < 3 && _mm_movemask_pd(separated) != 3; j++)
     {
-    vtkWarningMacro(<< "Input 1 hasn't been added... can't execute!");
-    return 1;
+    __m128d proj = _mm_add_pd(_mm_add_pd(_mm_mul_pd(vd[0], vR[0][j]), _mm_mul_pd(vd[1], vR[1][j])),
+      _mm_mul_pd(vd[2], vR[2][j]));
+    __m128d radius = _mm_add_pd(_mm_add_pd(_mm_mul_pd(va[0], vabsR[0][j]),
+      _mm_mul_pd(va[1], vabsR[1][j])), _mm_mul_pd(va[2], vabsR[2][j]));
+    for (k = 0; k < 3; k++)
+      {
+      __m128d dot = _mm_add_pd(_mm_add_pd(_mm_mul_pd(vR[0][k], vR[0][j]),
+        _mm_mul_pd(vR[1][k], vR[1][j])), _mm_mul_pd(vR[2][k], vR[2][j]));
+      radius = _mm_add_pd(radius, _mm_andnot_pd(signMask, dot));
+      }
+    separated = _mm_or_pd(separated, _mm_cmpgt_pd(_mm_andnot_pd(signMask, proj), radius));
     }
 
-  // make sure input is available
-  if ( ! input[1] )
+  // Cross products of the axes of A and the edges of B, skipping nearly parallel edges
+  const __m128d epsilon = _mm_set1_pd(1e-12);
+  for (i = 0; i < 3 && _mm_movemask_pd(separated) != 3; i++)
     {
-    vtkWarningMacro(<< "Input 2 hasn't been added... can't execute!");
-    return 1;
+    int i1 = (i+1)%3;
+    int i2 = (i+2)%3;
+    for (j = 0; j < 3; j++)
+      {
+      __m128d length2 = _mm_add_pd(_mm_mul_pd(vR[i1][j], vR[i1][j]), _mm_mul_pd(vR[i2][j], vR[i2][j]));
+      __m128d defined = _mm_cmpgt_pd(length2,
+        _mm_mul_pd(epsilon, _mm_add_pd(length2, _mm_mul_pd(vR[i][j], vR[i][j]))));
+      __m128d proj = _mm_sub_pd(_mm_mul_pd(vd[i2], vR[i1][j]), _mm_mul_pd(vd[i1], vR[i2][j]));
+      __m128d radius = _mm_add_pd(_mm_mul_pd(va[i1], vabsR[i2][j]), _mm_mul_pd(va[i2], vabsR[i1][j]));
+      for (k = 0; k < 3; k++)
+        {
+        if (k != j)
+          {
+          __m128d cross = _mm_sub_pd(_mm_mul_pd(vR[i2][k], vR[i1][j]), _mm_mul_pd(vR[i1][k], vR[i2][j]));
+          radius = _mm_add_pd(radius, _mm_andnot_pd(signMask, cross));
+          }
+        }
+      separated = _mm_or_pd(separated,
+        _mm_and_pd(defined, _mm_cmpgt_pd(_mm_andnot_pd(signMask, proj), radius)));
+      }
     }
 
-  // The transformations...
-  vtkMatrix4x4 *matrix = vtkMatrix4x4::New();
-  vtkMatrix4x4 *tmpMatrix = vtkMatrix4x4::New();
+  int mask = _mm_movemask_pd(separated);
+  disjoint[0] = mask & 1;
+  disjoint[1] = (mask >> 1) & 1;
+#else
+  disjoint[0] = DisjointBoxes(*nodeA[0], *boxB[0], tolerance);
+  disjoint[1] = DisjointBoxes(*nodeA[1], *boxB[1], tolerance);
+#endif
+}
 
-  if (this->Transform[0] != NULL || this->Transform[1] != NULL)
+// Test the boxes of the two pairs that SplitNodePair splits a pair into. The pairs share
+// their node of A or their node of B, and a shared node of B is only transformed once.
+static inline void DisjointChildPairs(const vtkCollisionHierarchy::Node *nodesA,
+  const vtkCollisionHierarchy::Node *nodesB, const NodePair children[2],
+  const double XformBtoA[4][4], double tolerance, int disjoint[2])
+{
+  TransformedBox transformed[2];
+  TransformBox(nodesB[children[0].B], XformBtoA, transformed[0]);
+  if (children[1].B != children[0].B)
     {
-    vtkMatrix4x4::Invert(this->Transform[0]->GetMatrix(), tmpMatrix);
-    // the sequence of multiplication is significant
-    vtkMatrix4x4::Multiply4x4(tmpMatrix, this->Transform[1]->GetMatrix(), matrix);
+    TransformBox(nodesB[children[1].B], XformBtoA, transformed[1]);
     }
-   else
+  const vtkCollisionHierarchy::Node *nodeA[2] = {&nodesA[children[0].A], &nodesA[children[1].A]};
+  const TransformedBox *boxB[2] = {&transformed[0],
+    (children[1].B != children[0].B ? &transformed[1] : &transformed[0])};
+  DisjointBoxPairs(nodeA, boxB, tolerance, disjoint);
+}
+
+// Lower bound of the distance between the boxes of nodeA and nodeB: the largest gap between
+// the projections of the boxes on the 15 axes of the separating axis test. Returns 0 if the
+// projections overlap on all the axes.
+static double NodeDistanceLowerBound(const vtkCollisionHierarchy::Node &nodeA,
+  const vtkCollisionHierarchy::Node &nodeB, const double XformBtoA[4][4])
+{
+  int i, j, k;
+  double d[3], R[3][3], absR[3][3];
+  const double *a = nodeA.HalfExtents;
+  RelativeBox(nodeA, nodeB, XformBtoA, d, R, absR);
+
+  // Face axes of A, they have unit length
+  double gap = 0.0;
+  for (i = 0; i < 3; i++)
     {
-     vtkWarningMacro(<< "Set two transforms or two matrices");
-     return 1;
+    gap = std::max(gap, fabs(d[i]) - (a[i] + absR[i][0] + absR[i][1] + absR[i][2]));
     }
 
-  this->InvokeEvent(vtkCommand::StartEvent, NULL);
-
-
-  // rebuild the obb trees... they do their own mtime checking with input data
-  tree0->SetDataSet(input[0]);
-  tree0->AutomaticOn();
-  tree0->SetNumberOfCellsPerNode(this->NumberOfCellsPerNode);
-  tree0->BuildLocator();
-
-  tree1->SetDataSet(input[1]);
-  tree1->AutomaticOn();
-  tree1->SetNumberOfCellsPerNode(this->NumberOfCellsPerNode);
-  tree1->BuildLocator();
-
-  // Set the Box Tolerance
-  tree0->SetTolerance(this->BoxTolerance);
-  tree1->SetTolerance(this->BoxTolerance);
-
-
-
-
-  // Do the collision detection...
-  vtkIdType BoxTests =
-    tree0->IntersectWithOBBTree(tree1,  matrix, ComputeCollisions, this);
-
-  matrix->Delete();
-  tmpMatrix->Delete();
-
-  vtkDebugMacro(<< "Collision detection finished");
-  this->NumberOfBoxTests = abs(BoxTests);
-
-  // Generate the scalars if needed
-  if (GenerateScalars)
+  // Edge directions of B
+  for (j = 0; j < 3; j++)
     {
-
-    for (int idx =0; idx < 2; idx++)
+    double length2 = R[0][j]*R[0][j] + R[1][j]*R[1][j] + R[2][j]*R[2][j];
+    if (length2 <= 0.0)
       {
+      continue;
+      }
+    double proj = d[0]*R[0][j] + d[1]*R[1][j] + d[2]*R[2][j];
+    double radius = a[0]*absR[0][j] + a[1]*absR[1][j] + a[2]*absR[2][j];
+    for (k = 0; k < 3; k++)
+      {
+      radius += fabs(R[0][k]*R[0][j] + R[1][k]*R[1][j] + R[2][k]*R[2][j]);
+      }
+    gap = std::max(gap, (fabs(proj) - radius) / sqrt(length2));
+    }
 
-      vtkUnsignedCharArray *scalars = vtkUnsignedCharArray::New();
-      output[idx]->GetCellData()->SetScalars(scalars);
-      vtkIdType numCells = input[idx]->GetNumberOfCells();
-      scalars->SetNumberOfComponents(4);
-      scalars->SetNumberOfTuples(numCells);
-      vtkIdTypeArray *contactcells = this->GetContactCells(idx);
-      vtkIdType numContacts = this->GetNumberOfContacts();
-
-      // Fill the array with blanks...
-      // Maybe this should change, to alpha set to Opacity
-      // regardless if there are contact or not.
-      float alpha;
-      if (numContacts > 0)
+  // Cross products of the axes of A and the edges of B
+  for (i = 0; i < 3; i++)
+    {
+    int i1 = (i+1)%3;
+    int i2 = (i+2)%3;
+    for (j = 0; j < 3; j++)
+      {
+      double length2 = R[i1][j]*R[i1][j] + R[i2][j]*R[i2][j];
+      if (length2 <= 1e-12*(length2 + R[i][j]*R[i][j]))
         {
-        alpha = this->Opacity*255.0;
+        continue;
         }
-      else
+      double proj = d[i2]*R[i1][j] - d[i1]*R[i2][j];
+      double radius = a[i1]*absR[i2][j] + a[i2]*absR[i1][j];
+      for (k = 0; k < 3; k++)
         {
-        alpha = 255.0;
+        if (k != j)
+          {
+          radius += fabs(R[i2][k]*R[i1][j] - R[i1][k]*R[i2][j]);
+          }
         }
-      float blank[4] = {255.0,255.0,255.0,alpha};
+      gap = std::max(gap, (fabs(proj) - radius) / sqrt(length2));
+      }
+    }
 
-      for (vtkIdType i = 0; i < numCells; i++)
+  return gap;
+}
+
+// Return the index (0 to 14) of an axis of the separating axis test on which the box of nodeA,
+// enlarged by tolerance, and the box of nodeB are disjoint, or -1 if they overlap. The axis
+// first is tested before the others, so the axis found by the last call is usually found at once.
+static int FindSeparatingAxis(const vtkCollisionHierarchy::Node &nodeA,
+  const vtkCollisionHierarchy::Node &nodeB, const double XformBtoA[4][4], double tolerance,
+  int first)
+{
+  int i, j, k;
+  double d[3], a[3], R[3][3], absR[3][3];
+  RelativeBox(nodeA, nodeB, XformBtoA, d, R, absR);
+  for (i = 0; i < 3; i++)
+    {
+    a[i] = nodeA.HalfExtents[i] + tolerance;
+    }
+
+  for (int n = -1; n < 15; n++)
+    {
+    int axis = (n < 0 ? first : n);
+    if (axis < 0 || (n >= 0 && axis == first))
+      {
+      continue;
+      }
+    double proj, radius = 0.0;
+    if (axis < 3)
+      {
+      // Face axis of A
+      i = axis;
+      proj = d[i];
+      radius = a[i] + absR[i][0] + absR[i][1] + absR[i][2];
+      }
+    else if (axis < 6)
+      {
+      // Edge direction of B
+      j = axis - 3;
+      proj = d[0]*R[0][j] + d[1]*R[1][j] + d[2]*R[2][j];
+      radius = a[0]*absR[0][j] + a[1]*absR[1][j] + a[2]*absR[2][j];
+      for (k = 0; k < 3; k++)
         {
-        scalars->SetTuple(i, blank);
+        radius += fabs(R[0][k]*R[0][j] + R[1][k]*R[1][j] + R[2][k]*R[2][j]);
         }
-
-      // Now color the intersecting cells
-      vtkLookupTable *lut = vtkLookupTable::New();
-      if (numContacts>0)
+      }
+    else
+      {
+      // Cross product of an axis of A and an edge of B
+      i = (axis - 6) / 3;
+      j = (axis - 6) % 3;
+      int i1 = (i+1)%3;
+      int i2 = (i+2)%3;
+      double length2 = R[i1][j]*R[i1][j] + R[i2][j]*R[i2][j];
+      if (length2 <= 1e-12*(length2 + R[i][j]*R[i][j]))
         {
-        if (this->CollisionMode == VTK_ALL_CONTACTS)
-          {
-          lut->SetTableRange(0, numContacts-1);
-          lut->SetNumberOfTableValues(numContacts);
-          }
-        else // VTK_FIRST_CONTACT
+        continue;
+        }
+      proj = d[i2]*R[i1][j] - d[i1]*R[i2][j];
+      radius = a[i1]*absR[i2][j] + a[i2]*absR[i1][j];
+      for (k = 0; k < 3; k++)
+        {
+        if (k != j)
           {
-          lut->SetTableRange(0, 1);
-          lut->SetNumberOfTableValues(numContacts+1);
+          radius += fabs(R[i2][k]*R[i1][j] - R[i1][k]*R[i2][j]);
           }
-        lut->Build();
         }
-      double *RGBA;
-      float RGB[4];
+      }
+    if (fabs(proj) > radius)
+      {
+      return axis;
+      }
+    }
 
-      for (vtkIdType id, i = 0; i < numContacts; i++)
-        {
-        id = contactcells->GetValue(i);
-        RGBA = lut->GetTableValue(i);
-        RGB[0] = 255.0*RGBA[0];
-        RGB[1] = 255.0*RGBA[1];
-        RGB[2] = 255.0*RGBA[2];
-        RGB[3] = 255.0;
-        scalars->SetTuple(id, RGB);
-        }
+  return -1;
+}
 
-      lut->Delete();
-      scalars->Delete();
-      vtkDebugMacro(<< "Created scalars on output " << idx);
-      }
+//----------------------------------------------------------------------------
+namespace
+{
+// State of one thread of the traversal: the contacts it has found and scratch space
+// for the leaf pair tests
+struct LeafPairData
+  {
+  int CollisionMode;
+  double CellTolerance;
+  double ProximityDistance;
+  int InstructionSet;
+  int BoxTests;
+
+  // Contacts found, in order. For each contact: the task it was found in, the cell ids
+  // in A and B, their indices in the triangle tables of the hierarchies, and the two contact
+  // points in the coordinate system of input 0.
+  vtkIdType Task;
+  std::vector<vtkIdType> ContactTasks;
+  std::vector<vtkIdType> ContactCells;
+  std::vector<vtkIdType> ContactTriangles;
+  std::vector<double> ContactPoints;
+
+  // Pairs where the traversal stopped, in order, if RecordFront is set
+  int RecordFront;
+  std::vector<FrontPair> Front;
+
+  // Triangles of the last tested leaf of B, transformed into the coordinate system of input 0
+  vtkIdType TransformedNodeB;
+  vtkCollisionHierarchy::TriangleTable TrianglesB;
+  std::vector<vtkIdType> Candidates;
+  };
+
+// Reference to a contact found by one of the threads, used to merge the contacts in task order
+struct ContactReference
+  {
+  vtkIdType Task;
+  LeafPairData *Data;
+  vtkIdType Index;
+  bool operator<(const ContactReference &other) const {return this->Task < other.Task;}
+  };
+}
+
+
+static int ComputeCollisions(vtkCollisionHierarchy *treeA, vtkIdType nodeIdA,
+  vtkCollisionHierarchy *treeB, vtkIdType nodeIdB, vtkMatrix4x4 *Xform, LeafPairData *data);
+
+// Split a pair of nodes into the two pairs to visit next, in children. The node with the smaller
+// depth is split first (the node of treeA if the depths are equal). Returns 0 if both nodes are
+// leaves.
+static inline int SplitNodePair(const vtkCollisionHierarchy::Node *nodesA,
+  const vtkCollisionHierarchy::Node *nodesB, const NodePair &pair, NodePair children[2])
+{
+  bool leafA = (nodesA[pair.A].Child < 0);
+  bool leafB = (nodesB[pair.B].Child < 0);
+  if (leafA && leafB)
+    {
+    return 0;
+    }
+  children[0] = children[1] = pair;
+  if (!leafA && (leafB || pair.DepthA <= pair.DepthB))
+    {
+    children[0].A = nodesA[pair.A].Child;
+    children[1].A = nodesA[pair.A].Child+1;
+    children[0].DepthA = children[1].DepthA = pair.DepthA+1;
+    }
+  else
+    {
+    children[0].B = nodesB[pair.B].Child;
+    children[1].B = nodesB[pair.B].Child+1;
+    children[0].DepthB = children[1].DepthB = pair.DepthB+1;
     }
+  return 1;
+}
 
-  this->InvokeEvent(vtkCommand::EndEvent, NULL);
+// Test the boxes of a pair of nodes. Returns 0 if they are disjoint, 1 if both nodes are leaves,
+// otherwise 2 and the two pairs to test next in children.
+static inline int ExpandNodePair(const vtkCollisionHierarchy::Node *nodesA,
+  const vtkCollisionHierarchy::Node *nodesB, const NodePair &pair, vtkMatrix4x4 *Xform,
+  double tolerance, NodePair children[2])
+{
+  if (DisjointNodes(nodesA[pair.A], nodesB[pair.B], Xform->Element, tolerance))
+    {
+    return 0;
+    }
+  return SplitNodePair(nodesA, nodesB, pair, children) ? 2 : 1;
+}
 
+// Find the pair of nodes that SplitNodePair splits into pair. The node of A was split last if
+// it is deeper than the node of B, otherwise the node of B was. Returns 0 for the roots.
+static inline int ParentNodePair(const vtkCollisionHierarchy::Node *nodesA,
+  const vtkCollisionHierarchy::Node *nodesB, const NodePair &pair, NodePair &parent)
+{
+  if (pair.DepthA == 0 && pair.DepthB == 0)
+    {
+    return 0;
+    }
+  parent = pair;
+  if (pair.DepthA > pair.DepthB)
+    {
+    parent.A = nodesA[pair.A].Parent;
+    parent.DepthA--;
+    }
+  else
+    {
+    parent.B = nodesB[pair.B].Parent;
+    parent.DepthB--;
+    }
   return 1;
+}
 
+// Append pair to a front in depth first order, then replace the last two pairs by their
+// parent as long as they are the two children of a pair whose boxes are disjoint, so that the
+// front moves up where the models have moved apart. Returns the number of box tests.
+static int AppendToFront(const vtkCollisionHierarchy::Node *nodesA,
+  const vtkCollisionHierarchy::Node *nodesB, const FrontPair &pair, vtkMatrix4x4 *Xform,
+  double tolerance, std::vector<FrontPair> &front)
+{
+  int boxTests = 0;
+  front.push_back(pair);
+  while (front.size() >= 2)
+    {
+    const FrontPair &second = front[front.size()-1];
+    const FrontPair &first = front[front.size()-2];
+    NodePair parent, otherParent;
+    if (!first.Disjoint || !second.Disjoint ||
+      !ParentNodePair(nodesA, nodesB, first.Pair, parent) ||
+      !ParentNodePair(nodesA, nodesB, second.Pair, otherParent) ||
+      parent.A != otherParent.A || parent.B != otherParent.B)
+      {
+      break;
+      }
+    boxTests++;
+    if (!DisjointNodes(nodesA[parent.A], nodesB[parent.B], Xform->Element, tolerance))
+      {
+      break;
+      }
+    FrontPair collapsed = {parent, first.Task, 1};
+    front.pop_back();
+    front.back() = collapsed;
+    }
+  return boxTests;
+}
+
+// Traverse the two hierarchies below start and test each pair of leaves whose boxes overlap.
+// The traversal stops when a leaf pair test returns a negative value, or when stop is set by
+// another thread. Returns -1 if the traversal was stopped, 0 otherwise.
+static int TraverseHierarchies(vtkCollisionHierarchy *treeA, vtkCollisionHierarchy *treeB,
+  const NodePair &start, vtkMatrix4x4 *Xform, double tolerance, LeafPairData *data,
+  vtkAtomicInt<int> *stop)
+{
+  const vtkCollisionHierarchy::Node *nodesA = treeA->GetNodes();
+  const vtkCollisionHierarchy::Node *nodesB = treeB->GetNodes();
+
+  // The pairs on the stack have been tested. The two pairs a pair is split into are tested
+  // together, and disjoint pairs are only pushed to be recorded in the front.
+  std::vector<TestedPair> stack;
+  stack.reserve(2*(treeA->GetLevel() + treeB->GetLevel() + 1));
+  data->BoxTests++;
+  TestedPair first = {start, DisjointNodes(nodesA[start.A], nodesB[start.B], Xform->Element, tolerance)};
+  stack.push_back(first);
+
+  NodePair children[2];
+  int disjoint[2];
+  while (!stack.empty())
+    {
+    if (stop != NULL && stop->Load())
+      {
+      return -1;
+      }
+    TestedPair tested = stack.back();
+    const NodePair &pair = tested.Pair;
+    stack.pop_back();
+
+    int result = 0;
+    if (!tested.Disjoint)
+      {
+      result = SplitNodePair(nodesA, nodesB, pair, children) ? 2 : 1;
+      }
+    if (data->RecordFront && result < 2)
+      {
+      FrontPair stopped = {pair, data->Task, (result == 0)};
+      data->Front.push_back(stopped);
+      }
+    if (result == 1)
+      {
+      if (ComputeCollisions(treeA, pair.A, treeB, pair.B, Xform, data) < 0)
+        {
+        if (stop != NULL)
+          {
+          stop->Store(1);
+          }
+        return -1;
+        }
+      }
+    else if (result == 2)
+      {
+      data->BoxTests += 2;
+      DisjointChildPairs(nodesA, nodesB, children, Xform->Element, tolerance, disjoint);
+      for (int c = 1; c >= 0; c--)
+        {
+        if (!disjoint[c] || data->RecordFront)
+          {
+          TestedPair child = {children[c], disjoint[c]};
+          stack.push_back(child);
+          }
+        }
+      }
+    }
+
+  return 0;
+}
+
+namespace
+{
+// Traverses the hierarchies below a range of the tasks, each thread with its own data
+class TraverseTasksFunctor
+{
+public:
+  TraverseTasksFunctor(vtkCollisionHierarchy *treeA, vtkCollisionHierarchy *treeB,
+    const std::vector<NodePair> &tasks, vtkMatrix4x4 *Xform, double tolerance,
+    const LeafPairData &exemplar)
+    : TreeA(treeA), TreeB(treeB), Tasks(tasks), Xform(Xform), Tolerance(tolerance),
+      Data(exemplar), Stop(0) {}
+
+  void operator()(vtkIdType begin, vtkIdType end)
+    {
+    LeafPairData &data = this->Data.Local();
+    for (vtkIdType task = begin; task < end; task++)
+      {
+      data.Task = task;
+      if (TraverseHierarchies(this->TreeA, this->TreeB, this->Tasks[task], this->Xform,
+        this->Tolerance, &data, &this->Stop) < 0)
+        {
+        return;
+        }
+      }
+    }
+
+  vtkCollisionHierarchy *TreeA;
+  vtkCollisionHierarchy *TreeB;
+  const std::vector<NodePair> &Tasks;
+  vtkMatrix4x4 *Xform;
+  double Tolerance;
+  vtkSMPThreadLocal<LeafPairData> Data;
+  vtkAtomicInt<int> Stop;
+};
+}
+
+// Split the traversal below tasks into at least numberOfTasks pairs of subtrees, if there are
+// enough overlapping nodes, by expanding the pair tree breadth first. The tasks are in the order
+// of a depth first traversal. Pairs of leaves are not tested, they are tasks of their own.
+// Disjoint pairs are dropped, unless keepDisjoint is set. Returns the number of box tests.
+static int SplitTraversal(vtkCollisionHierarchy *treeA, vtkCollisionHierarchy *treeB,
+  vtkMatrix4x4 *Xform, double tolerance, size_t numberOfTasks, bool keepDisjoint,
+  std::vector<NodePair> &tasks)
+{
+  const vtkCollisionHierarchy::Node *nodesA = treeA->GetNodes();
+  const vtkCollisionHierarchy::Node *nodesB = treeB->GetNodes();
+  int boxTests = 0;
+
+  std::vector<NodePair> next;
+  NodePair children[2];
+  bool expanded = true;
+  while (expanded && !tasks.empty() && tasks.size() < numberOfTasks)
+    {
+    expanded = false;
+    next.clear();
+    for (size_t i = 0; i < tasks.size(); i++)
+      {
+      const NodePair &pair = tasks[i];
+      if (nodesA[pair.A].Child < 0 && nodesB[pair.B].Child < 0)
+        {
+        next.push_back(pair);
+        continue;
+        }
+      boxTests++;
+      if (ExpandNodePair(nodesA, nodesB, pair, Xform, tolerance, children) == 2)
+        {
+        next.push_back(children[0]);
+        next.push_back(children[1]);
+        expanded = true;
+        }
+      else if (keepDisjoint)
+        {
+        next.push_back(pair);
+        }
+      }
+    tasks.swap(next);
+    }
+  return boxTests;
+}
+
+// Get the vertices and the plane of triangle t of table
+static inline void GetTableTriangle(const vtkCollisionHierarchy::TriangleTable &table,
+  vtkIdType t, double pts[9], double plane[4])
+{
+  for (int k = 0; k < 9; k++)
+    {
+    pts[k] = table.Points[k][t];
+    }
+  for (int k = 0; k < 4; k++)
+    {
+    plane[k] = table.Plane[k][t];
+    }
+}
+
+// Transform triangle t of table with M, and compute the plane of the transformed triangle
+static inline void TransformTriangle(const vtkCollisionHierarchy::TriangleTable &table,
+  vtkIdType t, const double M[4][4], double pts[9], double plane[4])
+{
+  for (int n = 0; n < 3; n++)
+    {
+    double x = table.Points[3*n][t];
+    double y = table.Points[3*n+1][t];
+    double z = table.Points[3*n+2][t];
+    double w = M[3][0]*x + M[3][1]*y + M[3][2]*z + M[3][3];
+    for (int p = 0; p < 3; p++)
+      {
+      pts[3*n+p] = (M[p][0]*x + M[p][1]*y + M[p][2]*z + M[p][3]) / w;
+      }
+    }
+  double dp0[3] = {pts[3]-pts[0], pts[4]-pts[1], pts[5]-pts[2]};
+  double dp1[3] = {pts[6]-pts[0], pts[7]-pts[1], pts[8]-pts[2]};
+  vtkMath::Cross(dp0, dp1, plane);
+  vtkMath::Normalize(plane);
+  plane[3] = -vtkMath::Dot(plane, pts);
+}
+
+// Transform the triangles of a leaf of B into the coordinate system of input 0
+static void TransformLeafTriangles(vtkCollisionHierarchy *treeB,
+  const vtkCollisionHierarchy::Node &nodeB, vtkMatrix4x4 *Xform, LeafPairData *data)
+{
+  const vtkCollisionHierarchy::TriangleTable &table = treeB->GetTriangles();
+  vtkCollisionHierarchy::TriangleTable &trianglesB = data->TrianglesB;
+  vtkIdType count = nodeB.Count;
+  for (int k = 0; k < 9; k++)
+    {
+    trianglesB.Points[k].resize(count);
+    }
+  for (int k = 0; k < 6; k++)
+    {
+    trianglesB.Bounds[k].resize(count);
+    }
+  for (int k = 0; k < 4; k++)
+    {
+    trianglesB.Plane[k].resize(count);
+    }
+  data->Candidates.resize(count);
+
+  double pts[9], plane[4];
+  for (vtkIdType m = 0; m < count; m++)
+    {
+    TransformTriangle(table, nodeB.First + m, Xform->Element, pts, plane);
+    for (int k = 0; k < 9; k++)
+      {
+      trianglesB.Points[k][m] = pts[k];
+      }
+    for (int p = 0; p < 3; p++)
+      {
+      trianglesB.Bounds[2*p][m] = std::min(pts[p], std::min(pts[p+3], pts[p+6]));
+      trianglesB.Bounds[2*p+1][m] = std::max(pts[p], std::max(pts[p+3], pts[p+6]));
+      }
+    for (int k = 0; k < 4; k++)
+      {
+      trianglesB.Plane[k][m] = plane[k];
+      }
+    }
+}
+
+// Test the pair of triangles of the last contact found, triangles are their indices in the
+// triangle tables of the hierarchies. Returns 1 and the two contact points if they are still
+// in contact (closer than the proximity distance in VTK_WITHIN_DISTANCE mode), 0 otherwise.
+static int TestWitnessTriangles(vtkCollisionHierarchy *treeA, vtkCollisionHierarchy *treeB,
+  const vtkIdType triangles[2], vtkMatrix4x4 *Xform, const LeafPairData &data,
+  double x1[3], double x2[3])
+{
+  double ptsA[9], planeA[4], ptsB[9], planeB[4];
+  GetTableTriangle(treeA->GetTriangles(), triangles[0], ptsA, planeA);
+  TransformTriangle(treeB->GetTriangles(), triangles[1], Xform->Element, ptsB, planeB);
+  if (data.CollisionMode == vtkCollisionDetectionFilter::VTK_WITHIN_DISTANCE)
+    {
+    return (vtkCollisionTriangleKernel::DistanceBetweenTriangles(ptsA, planeA, ptsB, planeB,
+      x1, x2) <= data.ProximityDistance);
+    }
+  return vtkCollisionTriangleKernel::IntersectTriangles(ptsA, planeA, ptsB, planeB,
+    data.CellTolerance, x1, x2);
+}
+
+//----------------------------------------------------------------------------
+static int ComputeCollisions(vtkCollisionHierarchy *treeA, vtkIdType nodeIdA,
+  vtkCollisionHierarchy *treeB, vtkIdType nodeIdB, vtkMatrix4x4 *Xform, LeafPairData *data)
+{
+  // This is hard-coded for triangles, the hierarchies only store the first three points of each cell
+  const vtkCollisionHierarchy::Node &nodeA = treeA->GetNodes()[nodeIdA];
+  const vtkCollisionHierarchy::Node &nodeB = treeB->GetNodes()[nodeIdB];
+  const vtkCollisionHierarchy::TriangleTable &tableA = treeA->GetTriangles();
+  const vtkCollisionHierarchy::TriangleTable &trianglesB = data->TrianglesB;
+  const vtkIdType *IdsA = treeA->GetCellIds();
+  const vtkIdType *IdsB = treeB->GetCellIds();
+
+  // Consecutive leaf pairs often share the leaf of B
+  if (data->TransformedNodeB != nodeIdB)
+    {
+    TransformLeafTriangles(treeB, nodeB, Xform, data);
+    data->TransformedNodeB = nodeIdB;
+    }
+
+  double x1[3], x2[3];
+  double ptsA[9], boundsA[6], planeA[4], ptsB[9], planeB[4];
+
+  // Loop thru the triangles of the leaf of A
+  for (vtkIdType i = nodeA.First; i < nodeA.First + nodeA.Count; i++)
+    {
+    for (int k = 0; k < 9; k++)
+      {
+      ptsA[k] = tableA.Points[k][i];
+      }
+    for (int k = 0; k < 6; k++)
+      {
+      boundsA[k] = tableA.Bounds[k][i];
+      }
+    for (int k = 0; k < 4; k++)
+      {
+      planeA[k] = tableA.Plane[k][i];
+      }
+
+    // Reject most triangles of the leaf of B in batches, then test the remaining ones exactly.
+    // Triangles farther apart than the proximity distance are rejected the same way.
+    bool withinDistance =
+      (data->CollisionMode == vtkCollisionDetectionFilter::VTK_WITHIN_DISTANCE);
+    vtkIdType numCandidates = vtkCollisionTriangleKernel::FindCandidates(ptsA, boundsA, planeA,
+      trianglesB, 0, nodeB.Count, withinDistance ? data->ProximityDistance : data->CellTolerance,
+      &data->Candidates[0], data->InstructionSet);
+    for (vtkIdType c = 0; c < numCandidates; c++)
+      {
+      vtkIdType m = data->Candidates[c];
+      for (int k = 0; k < 9; k++)
+        {
+        ptsB[k] = trianglesB.Points[k][m];
+        }
+      for (int k = 0; k < 4; k++)
+        {
+        planeB[k] = trianglesB.Plane[k][m];
+        }
+      if (withinDistance)
+        {
+        // The contact points are the closest points of the two triangles
+        if (vtkCollisionTriangleKernel::DistanceBetweenTriangles(ptsA, planeA, ptsB, planeB,
+          x1, x2) > data->ProximityDistance)
+          {
+          continue;
+          }
+        }
+      else if (!vtkCollisionTriangleKernel::IntersectTriangles(ptsA, planeA, ptsB, planeB,
+        data->CellTolerance, x1, x2))
+        {
+        continue;
+        }
+
+      data->ContactTasks.push_back(data->Task);
+      data->ContactCells.push_back(IdsA[i]);
+      data->ContactCells.push_back(IdsB[nodeB.First + m]);
+      data->ContactTriangles.push_back(i);
+      data->ContactTriangles.push_back(nodeB.First + m);
+      data->ContactPoints.insert(data->ContactPoints.end(), x1, x1+3);
+      data->ContactPoints.insert(data->ContactPoints.end(), x2, x2+3);
+
+      if (data->CollisionMode == vtkCollisionDetectionFilter::VTK_FIRST_CONTACT || withinDistance)
+        {
+        // a negative value calls a halt to the proceedings
+        return -1;
+        }
+      }
+    }
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+namespace
+{
+// Closest pair of cells found by the minimum distance query, the points are in the
+// coordinate system of input 0
+struct ClosestPair
+  {
+  double Distance;
+  vtkIdType Cells[2];
+  vtkIdType Triangles[2];
+  double Points[6];
+  };
+
+// A pair of nodes to visit and the lower bound of the distance between their boxes
+struct BoundedNodePair
+  {
+  NodePair Pair;
+  double LowerBound;
+  };
+}
+
+// Update closest with the closest pair of triangles of two leaves, if they are closer
+static void ComputeLeafDistance(vtkCollisionHierarchy *treeA, vtkIdType nodeIdA,
+  vtkCollisionHierarchy *treeB, vtkIdType nodeIdB, vtkMatrix4x4 *Xform, LeafPairData *data,
+  ClosestPair &closest)
+{
+  const vtkCollisionHierarchy::Node &nodeA = treeA->GetNodes()[nodeIdA];
+  const vtkCollisionHierarchy::Node &nodeB = treeB->GetNodes()[nodeIdB];
+  const vtkCollisionHierarchy::TriangleTable &tableA = treeA->GetTriangles();
+  const vtkCollisionHierarchy::TriangleTable &trianglesB = data->TrianglesB;
+  if (data->TransformedNodeB != nodeIdB)
+    {
+    TransformLeafTriangles(treeB, nodeB, Xform, data);
+    data->TransformedNodeB = nodeIdB;
+    }
+
+  double ptsA[9], planeA[4], ptsB[9], planeB[4], closestA[3], closestB[3];
+  for (vtkIdType i = nodeA.First; i < nodeA.First + nodeA.Count; i++)
+    {
+    for (int k = 0; k < 9; k++)
+      {
+      ptsA[k] = tableA.Points[k][i];
+      }
+    for (int k = 0; k < 4; k++)
+      {
+      planeA[k] = tableA.Plane[k][i];
+      }
+    for (vtkIdType m = 0; m < nodeB.Count; m++)
+      {
+      // The distance between the bounds is a cheap lower bound
+      double gap2 = 0.0;
+      for (int k = 0; k < 3; k++)
+        {
+        double gap = std::max(trianglesB.Bounds[2*k][m] - tableA.Bounds[2*k+1][i],
+          tableA.Bounds[2*k][i] - trianglesB.Bounds[2*k+1][m]);
+        if (gap > 0.0)
+          {
+          gap2 += gap*gap;
+          }
+        }
+      if (gap2 >= closest.Distance*closest.Distance)
+        {
+        continue;
+        }
+
+      for (int k = 0; k < 9; k++)
+        {
+        ptsB[k] = trianglesB.Points[k][m];
+        }
+      for (int k = 0; k < 4; k++)
+        {
+        planeB[k] = trianglesB.Plane[k][m];
+        }
+      double distance = vtkCollisionTriangleKernel::DistanceBetweenTriangles(ptsA, planeA,
+        ptsB, planeB, closestA, closestB);
+      if (distance < closest.Distance)
+        {
+        closest.Distance = distance;
+        closest.Cells[0] = treeA->GetCellIds()[i];
+        closest.Cells[1] = treeB->GetCellIds()[nodeB.First + m];
+        closest.Triangles[0] = i;
+        closest.Triangles[1] = nodeB.First + m;
+        std::copy(closestA, closestA+3, closest.Points);
+        std::copy(closestB, closestB+3, closest.Points+3);
+        if (distance <= 0.0)
+          {
+          return;
+          }
+        }
+      }
+    }
+}
+
+// Find the closest pair of triangles of the two hierarchies by branch and bound: the pairs of
+// nodes whose boxes are farther apart than the closest pair found so far are skipped, and the
+// nearer of two child pairs is visited first. The search stops as soon as intersecting
+// triangles are found. The initial bound is maximumDistance, so no pair is found if the
+// models are farther apart. If witness is a pair of triangles (the closest pair of the last
+// query) closer than it, its distance is the initial bound, so that little more than the
+// neighborhood of the witness is searched when the models have not moved much. Returns the
+// number of box tests.
+static int ComputeMinimumDistance(vtkCollisionHierarchy *treeA, vtkCollisionHierarchy *treeB,
+  vtkMatrix4x4 *Xform, const vtkIdType witness[2], double maximumDistance, LeafPairData *data,
+  ClosestPair &closest)
+{
+  closest.Distance = maximumDistance;
+  closest.Cells[0] = closest.Cells[1] = -1;
+  closest.Triangles[0] = closest.Triangles[1] = -1;
+  const vtkCollisionHierarchy::Node *nodesA = treeA->GetNodes();
+  const vtkCollisionHierarchy::Node *nodesB = treeB->GetNodes();
+  if (nodesA == NULL || nodesB == NULL)
+    {
+    return 0;
+    }
+
+  if (witness[0] >= 0 && witness[1] >= 0)
+    {
+    double ptsA[9], planeA[4], ptsB[9], planeB[4];
+    GetTableTriangle(treeA->GetTriangles(), witness[0], ptsA, planeA);
+    TransformTriangle(treeB->GetTriangles(), witness[1], Xform->Element, ptsB, planeB);
+    double points[6];
+    double distance = vtkCollisionTriangleKernel::DistanceBetweenTriangles(ptsA, planeA,
+      ptsB, planeB, points, points+3);
+    if (distance < closest.Distance)
+      {
+      closest.Distance = distance;
+      std::copy(points, points+6, closest.Points);
+      closest.Cells[0] = treeA->GetCellIds()[witness[0]];
+      closest.Cells[1] = treeB->GetCellIds()[witness[1]];
+      closest.Triangles[0] = witness[0];
+      closest.Triangles[1] = witness[1];
+      }
+    }
+
+  std::vector<BoundedNodePair> stack;
+  stack.reserve(2*(treeA->GetLevel() + treeB->GetLevel() + 1));
+  BoundedNodePair root = {{0, 0, 0, 0}, 0.0};
+  root.LowerBound = NodeDistanceLowerBound(nodesA[0], nodesB[0], Xform->Element);
+  stack.push_back(root);
+  int boxTests = 1;
+
+  NodePair children[2];
+  while (!stack.empty() && closest.Distance > 0.0)
+    {
+    BoundedNodePair entry = stack.back();
+    stack.pop_back();
+    if (entry.LowerBound >= closest.Distance)
+      {
+      continue;
+      }
+
+    if (!SplitNodePair(nodesA, nodesB, entry.Pair, children))
+      {
+      ComputeLeafDistance(treeA, entry.Pair.A, treeB, entry.Pair.B, Xform, data, closest);
+      continue;
+      }
+
+    BoundedNodePair next[2];
+    for (int c = 0; c < 2; c++)
+      {
+      next[c].Pair = children[c];
+      next[c].LowerBound = NodeDistanceLowerBound(nodesA[children[c].A], nodesB[children[c].B],
+        Xform->Element);
+      }
+    boxTests += 2;
+    int nearer = (next[1].LowerBound < next[0].LowerBound ? 1 : 0);
+    for (int c = 1; c >= 0; c--)
+      {
+      const BoundedNodePair &pair = next[c == 1 ? 1-nearer : nearer];
+      if (pair.LowerBound < closest.Distance)
+        {
+        stack.push_back(pair);
+        }
+      }
+    }
+
+  return boxTests;
+}
+
+// Transform a point from the coordinate system of input 0 to world coordinates and append it
+static void AppendContactPoint(std::vector<double> &points, vtkMatrix4x4 *matrix0,
+  const double point[3])
+{
+  double x[4], xnew[4];
+  x[0] = point[0]; x[1] = point[1]; x[2] = point[2]; x[3] = 1.0;
+  matrix0->MultiplyPoint(x,xnew);
+  points.push_back(xnew[0]/xnew[3]);
+  points.push_back(xnew[1]/xnew[3]);
+  points.push_back(xnew[2]/xnew[3]);
+}
+
+// Broadphase test of the inputs as a whole, from their bounds alone: true if the bounding
+// spheres or the axis aligned bounding boxes of the inputs are farther apart than tolerance in
+// the coordinate system of input 0. Xform transforms from the coordinate system of input 1 to
+// the one of input 0. Empty inputs are always apart.
+static bool BoundsApart(const double boundsA[6], const double boundsB[6], const double Xform[4][4],
+  double tolerance)
+{
+  if (boundsA[0] > boundsA[1] || boundsB[0] > boundsB[1])
+    {
+    return true;
+    }
+
+  double centerA[3], halfA[3], centerB[3], halfB[3];
+  for (int i = 0; i < 3; i++)
+    {
+    centerA[i] = 0.5*(boundsA[2*i] + boundsA[2*i+1]);
+    halfA[i] = 0.5*(boundsA[2*i+1] - boundsA[2*i]);
+    centerB[i] = 0.5*(boundsB[2*i] + boundsB[2*i+1]);
+    halfB[i] = 0.5*(boundsB[2*i+1] - boundsB[2*i]);
+    }
+
+  // Center of the box of B in the coordinate system of A, and the half extents of the axis
+  // aligned box around the transformed box
+  double center[3], half[3];
+  for (int i = 0; i < 3; i++)
+    {
+    center[i] = Xform[i][3];
+    half[i] = 0.0;
+    for (int j = 0; j < 3; j++)
+      {
+      center[i] += Xform[i][j]*centerB[j];
+      half[i] += fabs(Xform[i][j])*halfB[j];
+      }
+    }
+
+  // The transform scales lengths by at most the square root of the largest eigenvalue of
+  // M^T M, which is bounded by its largest absolute row sum. The bound is exact for rotations
+  // and uniform scalings.
+  double scale2 = 0.0;
+  for (int i = 0; i < 3; i++)
+    {
+    double rowSum = 0.0;
+    for (int j = 0; j < 3; j++)
+      {
+      rowSum += fabs(Xform[0][i]*Xform[0][j] + Xform[1][i]*Xform[1][j] + Xform[2][i]*Xform[2][j]);
+      }
+    scale2 = (rowSum > scale2 ? rowSum : scale2);
+    }
+  double radius = sqrt(vtkMath::Dot(halfA, halfA)) + sqrt(scale2*vtkMath::Dot(halfB, halfB)) +
+    tolerance;
+  if (vtkMath::Distance2BetweenPoints(centerA, center) > radius*radius)
+    {
+    return true;
+    }
+
+  for (int i = 0; i < 3; i++)
+    {
+    if (fabs(center[i] - centerA[i]) > halfA[i] + half[i] + tolerance)
+      {
+      return true;
+      }
+    }
+  return false;
+}
+
+// Sets the input on its hierarchy. A hierarchy shared with SetHierarchy may have been built
+// for another polydata with the same points and cells as the input, as each filter sharing it
+// may have its own shallow copy of the triangles. It is kept on that polydata then, so that
+// the filters do not set their inputs on the hierarchy in turn and rebuild it each time.
+static void SetHierarchyInput(vtkCollisionHierarchy *tree, vtkPolyData *input)
+{
+  vtkPolyData *dataSet = tree->GetDataSet();
+  if (dataSet == NULL || dataSet == input || dataSet->GetPoints() != input->GetPoints() ||
+    dataSet->GetPolys() != input->GetPolys() || dataSet->GetStrips() != input->GetStrips())
+    {
+    tree->SetDataSet(input);
+    }
+}
+
+// True if an object that the filter keeps between updates is referenced by something else than
+// the filter and the output it is set on (inOutput), e.g. a consumer that kept the output of the
+// last update with a shallow copy. The object must not be modified in place then.
+static bool IsReferencedOutside(vtkObjectBase *object, bool inOutput)
+{
+  return object->GetReferenceCount() - 1 - (inOutput ? 1 : 0) > 0;
+}
+
+// Description:
+// Perform a collision detection
+int vtkCollisionDetectionFilter::RequestData(
+  vtkInformation *vtkNotUsed(request),
+  vtkInformationVector **inputVector,
+  vtkInformationVector *outputVector)
+{
+  // get the info objects
+  vtkDebugMacro(<< "Beginning execution...");
+
+  // inputs and outputs
+  vtkPolyData *input[2];
+  vtkPolyData *output[3];
+
+  vtkInformation *inInfo, *outInfo;
+  for (int i=0; i<3; i++)
+    {
+    if (i < 2)
+      {
+      inInfo = inputVector[i]->GetInformationObject(0);
+      input[i] = vtkPolyData::SafeDownCast(
+        inInfo->Get(vtkDataObject::DATA_OBJECT()));
+      }
+    outInfo = outputVector->GetInformationObject(i);
+    output[i] = vtkPolyData::SafeDownCast(
+      outInfo->Get(vtkDataObject::DATA_OBJECT()));
+    }
+
+  // The contacts are collected in buffers kept between updates, and the outputs are filled
+  // from them at the end. They are cleared first, so that the outputs have no contacts when
+  // the filter cannot execute.
+  std::vector<vtkIdType> &contactCellIds = this->Internals->ContactCellIds;
+  std::vector<double> &contactPoints = this->Internals->ContactPointCoords;
+  contactCellIds.clear();
+  contactPoints.clear();
+  int numPoints = (this->CollisionMode == VTK_ALL_CONTACTS ||
+    this->CollisionMode == VTK_MIN_DISTANCE || this->CollisionMode == VTK_WITHIN_DISTANCE ? 2 : 1);
+  this->NumberOfContacts = 0;
+  this->NumberOfBoxTests = 0;
+  this->MinimumDistance = -1.0;
+
+  // make sure input is available
+  if ( ! input[0] )
+    {
+    vtkWarningMacro(<< "Input 1 hasn't been added... can't execute!");
+    this->FillContactOutputs(output, numPoints);
+    return 1;
+    }
+
+  // make sure input is available
+  if ( ! input[1] )
+    {
+    vtkWarningMacro(<< "Input 2 hasn't been added... can't execute!");
+    this->FillContactOutputs(output, numPoints);
+    return 1;
+    }
+
+  // The transformations...
+  if (this->Transform[0] == NULL || this->Transform[1] == NULL)
+    {
+    vtkWarningMacro(<< "Set two transforms or two matrices");
+    this->FillContactOutputs(output, numPoints);
+    return 1;
+    }
+  vtkMatrix4x4 *matrix = this->Internals->Matrix;
+  vtkMatrix4x4 *tmpMatrix = this->Internals->InverseMatrix0;
+  vtkMatrix4x4::Invert(this->Transform[0]->GetMatrix(), tmpMatrix);
+  // the sequence of multiplication is significant
+  vtkMatrix4x4::Multiply4x4(tmpMatrix, this->Transform[1]->GetMatrix(), matrix);
+
+  this->InvokeEvent(vtkCommand::StartEvent, NULL);
+
+  // The boxes are inflated by the proximity distance to find the triangles within it
+  double boxTolerance = this->BoxTolerance;
+  if (this->CollisionMode == VTK_WITHIN_DISTANCE)
+    {
+    boxTolerance += this->ProximityDistance;
+    }
+  // The minimum distance is only searched up to the maximum distance, the models farther
+  // apart are rejected like in VTK_WITHIN_DISTANCE mode. Without a maximum distance the
+  // distance is needed even then, so there is no broadphase.
+  bool broadphase = (this->CollisionMode != VTK_MIN_DISTANCE ||
+    this->MaximumDistance < VTK_DOUBLE_MAX);
+  if (this->CollisionMode == VTK_MIN_DISTANCE && broadphase)
+    {
+    boxTolerance += this->MaximumDistance;
+    }
+
+  // Broadphase: most of the time the models are far apart, which the bounds of the inputs
+  // show without building or refitting the hierarchies.
+  bool apart = false;
+  int BoxTests = 0;
+  if (broadphase)
+    {
+    apart = BoundsApart(input[0]->GetBounds(), input[1]->GetBounds(), matrix->Element,
+      boxTolerance);
+    }
+
+  if (!apart)
+    {
+    // rebuild the hierarchies... they do their own mtime checking with input data. The
+    // parameters of a hierarchy set with SetHierarchy are left to its owner, setting them here
+    // would rebuild it under the other filters that share it.
+    vtkCollisionHierarchy *trees[2] = {tree0, tree1};
+    for (int i = 0; i < 2; i++)
+      {
+      SetHierarchyInput(trees[i], input[i]);
+      if (!this->ExternalHierarchy[i])
+        {
+        trees[i]->SetNumberOfCellsPerNode(this->NumberOfCellsPerNode);
+        trees[i]->SetHierarchyType(this->HierarchyType);
+        }
+      trees[i]->BuildHierarchy();
+      }
+
+    // The witnesses of the last update refer to the nodes and cells of the hierarchies it used,
+    // which a refit of the boxes to moved points keeps
+    if (!this->TemporalCoherence || tree0->GetTopologyTime() != this->WitnessBuildTime[0] ||
+      tree1->GetTopologyTime() != this->WitnessBuildTime[1])
+      {
+      this->WitnessTriangles[0] = this->WitnessTriangles[1] = -1;
+      this->WitnessAxis = -1;
+      this->Internals->Front.clear();
+      }
+    this->WitnessBuildTime[0] = tree0->GetTopologyTime();
+    this->WitnessBuildTime[1] = tree1->GetTopologyTime();
+
+    // The boxes of the roots are tighter than the bounds. The axis that separated them at the
+    // last update is tried first, as the models usually move little between two updates.
+    if (broadphase)
+      {
+      apart = (tree0->GetNumberOfNodes() == 0 || tree1->GetNumberOfNodes() == 0);
+      if (!apart)
+        {
+        BoxTests++;
+        this->WitnessAxis = FindSeparatingAxis(tree0->GetNodes()[0], tree1->GetNodes()[0],
+          matrix->Element, boxTolerance, this->WitnessAxis);
+        apart = (this->WitnessAxis >= 0);
+        }
+      }
+    }
+
+  // Without contacts, the next traversal starts from the roots
+  if (apart)
+    {
+    this->WitnessTriangles[0] = this->WitnessTriangles[1] = -1;
+    this->Internals->Front.clear();
+    }
+
+  // When the models are apart, the result is empty: the inputs are not passed to outputs 0 and
+  // 1, which only hold the empty contact cells arrays, and there are no cells to color. The
+  // scalars are kept for the next update that colors them.
+  if (apart)
+    {
+    this->FillContactOutputs(output, numPoints);
+    this->NumberOfBoxTests = BoxTests;
+    vtkDebugMacro(<< "Collision detection finished, the models are apart");
+    this->InvokeEvent(vtkCommand::EndEvent, NULL);
+    return 1;
+    }
+
+  // copy inputs to outputs
+  bool generateScalars = (this->GenerateScalars && this->PassInputs);
+  for (int i=0; i<2 && this->PassInputs; i++)
+    {
+    output[i]->CopyStructure(input[i]);
+    output[i]->GetPointData()->PassData(input[i]->GetPointData());
+    output[i]->GetCellData()->PassData(input[i]->GetCellData());
+    output[i]->GetFieldData()->PassData(input[i]->GetFieldData());
+    }
+
+  // Do the collision detection...
+  LeafPairData exemplar;
+  exemplar.CollisionMode = this->CollisionMode;
+  // The triangle kernel takes a distance, CellTolerance is squared
+  exemplar.CellTolerance = sqrt(this->CellTolerance);
+  exemplar.ProximityDistance = this->ProximityDistance;
+  exemplar.InstructionSet = this->InstructionSet;
+  exemplar.BoxTests = 0;
+  exemplar.Task = 0;
+  exemplar.TransformedNodeB = -1;
+  exemplar.RecordFront = 0;
+
+  bool firstContactOnly = (this->CollisionMode == VTK_FIRST_CONTACT ||
+    this->CollisionMode == VTK_WITHIN_DISTANCE);
+  vtkMatrix4x4 *matrix0 = this->GetMatrix(0);
+
+  if (this->CollisionMode == VTK_MIN_DISTANCE)
+    {
+    // The closest pair of cells and a line between their closest points
+    ClosestPair closest;
+    BoxTests += ComputeMinimumDistance(tree0, tree1, matrix, this->WitnessTriangles,
+      this->MaximumDistance, &exemplar, closest);
+    this->Internals->Front.clear();
+    this->WitnessTriangles[0] = closest.Triangles[0];
+    this->WitnessTriangles[1] = closest.Triangles[1];
+    if (closest.Cells[0] >= 0)
+      {
+      contactCellIds.push_back(closest.Cells[0]);
+      contactCellIds.push_back(closest.Cells[1]);
+      AppendContactPoint(contactPoints, matrix0, closest.Points);
+      AppendContactPoint(contactPoints, matrix0, closest.Points+3);
+      this->MinimumDistance = (closest.Distance > 0.0 ? sqrt(vtkMath::Distance2BetweenPoints(
+        &contactPoints[0], &contactPoints[3])) : 0.0);
+      }
+    }
+  else
+    {
+    // Split the traversal into enough tasks to keep the threads of vtkSMPTools busy. Splitting
+    // costs box tests that a sequential search for the first contact may not need, so use fewer
+    // tasks for it.
+    size_t numberOfTasks = 1;
+    int numberOfThreads = vtkSMPTools::GetEstimatedNumberOfThreads();
+    if (this->ParallelTraversal && numberOfThreads > 1)
+      {
+      numberOfTasks = (firstContactOnly ? 1 : 8) * numberOfThreads;
+      }
+    // Between two updates the models usually move little, so when only one contact is needed
+    // the contact of the last update is tested first. The traversal is skipped if it answers
+    // the query.
+    bool answered = false;
+    LeafPairData witness = exemplar;
+    if (!answered && firstContactOnly && this->WitnessTriangles[0] >= 0)
+      {
+      double x[6];
+      if (TestWitnessTriangles(tree0, tree1, this->WitnessTriangles, matrix, exemplar, x, x+3))
+        {
+        witness.ContactTasks.push_back(0);
+        witness.ContactCells.push_back(tree0->GetCellIds()[this->WitnessTriangles[0]]);
+        witness.ContactCells.push_back(tree1->GetCellIds()[this->WitnessTriangles[1]]);
+        witness.ContactTriangles.push_back(this->WitnessTriangles[0]);
+        witness.ContactTriangles.push_back(this->WitnessTriangles[1]);
+        witness.ContactPoints.insert(witness.ContactPoints.end(), x, x+6);
+        answered = true;
+        }
+      }
+
+    // When all the contacts are needed, the traversal starts from the front where the
+    // traversal of the last update stopped instead of the roots, and the new front is kept.
+    // While the models move little, most of the front stays in place.
+    bool trackFront = (this->TemporalCoherence && !firstContactOnly);
+    std::vector<FrontPair> &front = this->Internals->Front;
+    exemplar.RecordFront = trackFront;
+    NodePair root = {0, 0, 0, 0};
+    std::vector<NodePair> tasks;
+    if (!answered && tree0->GetNumberOfNodes() > 0 && tree1->GetNumberOfNodes() > 0)
+      {
+      if (trackFront && !front.empty())
+        {
+        tasks.resize(front.size());
+        for (size_t i = 0; i < front.size(); i++)
+          {
+          tasks[i] = front[i].Pair;
+          }
+        }
+      else
+        {
+        tasks.assign(1, root);
+        }
+      BoxTests += SplitTraversal(tree0, tree1, matrix, boxTolerance, numberOfTasks, trackFront,
+        tasks);
+      }
+    // The front restored from the last update has several tasks even without
+    // ParallelTraversal, they are then traversed in order by this thread
+    TraverseTasksFunctor functor(tree0, tree1, tasks, matrix, boxTolerance, exemplar);
+    if (this->ParallelTraversal && tasks.size() > 1)
+      {
+      size_t grain = tasks.size() / (8*static_cast<size_t>(numberOfThreads));
+      vtkSMPTools::For(0, static_cast<vtkIdType>(tasks.size()),
+        static_cast<vtkIdType>(grain > 1 ? grain : 1), functor);
+      }
+    else if (!tasks.empty())
+      {
+      functor(0, static_cast<vtkIdType>(tasks.size()));
+      }
+
+    // Merge the contacts of the threads in task order, which is the order of a sequential traversal
+    std::vector<ContactReference> contacts;
+    if (!witness.ContactTasks.empty())
+      {
+      ContactReference contact = {0, &witness, 0};
+      contacts.push_back(contact);
+      }
+    vtkSMPThreadLocal<LeafPairData>::iterator dataEnd = functor.Data.end();
+    for (vtkSMPThreadLocal<LeafPairData>::iterator dataIter = functor.Data.begin();
+      dataIter != dataEnd; ++dataIter)
+      {
+      LeafPairData &data = *dataIter;
+      BoxTests += data.BoxTests;
+      for (size_t i = 0; i < data.ContactTasks.size(); i++)
+        {
+        ContactReference contact = {data.ContactTasks[i], &data, static_cast<vtkIdType>(i)};
+        contacts.push_back(contact);
+        }
+      }
+    std::stable_sort(contacts.begin(), contacts.end());
+
+    if (trackFront)
+      {
+      std::vector<FrontPair> stopped;
+      for (vtkSMPThreadLocal<LeafPairData>::iterator dataIter = functor.Data.begin();
+        dataIter != dataEnd; ++dataIter)
+        {
+        stopped.insert(stopped.end(), dataIter->Front.begin(), dataIter->Front.end());
+        }
+      std::stable_sort(stopped.begin(), stopped.end());
+      front.clear();
+      for (size_t i = 0; i < stopped.size(); i++)
+        {
+        BoxTests += AppendToFront(tree0->GetNodes(), tree1->GetNodes(), stopped[i], matrix,
+          boxTolerance, front);
+        }
+      }
+    else
+      {
+      front.clear();
+      }
+    if (firstContactOnly && contacts.size() > 1)
+      {
+      contacts.resize(1);
+      }
+    this->WitnessTriangles[0] = this->WitnessTriangles[1] = -1;
+    if (!contacts.empty())
+      {
+      this->WitnessTriangles[0] = contacts[0].Data->ContactTriangles[2*contacts[0].Index];
+      this->WitnessTriangles[1] = contacts[0].Data->ContactTriangles[2*contacts[0].Index+1];
+      }
+
+    for (size_t c = 0; c < contacts.size(); c++)
+      {
+      const LeafPairData &data = *contacts[c].Data;
+      vtkIdType index = contacts[c].Index;
+      contactCellIds.push_back(data.ContactCells[2*index]);
+      contactCellIds.push_back(data.ContactCells[2*index+1]);
+
+      //transform x back to "world space"
+      for (int j = 0; j < numPoints; j++)
+        {
+        AppendContactPoint(contactPoints, matrix0, &data.ContactPoints[6*index+3*j]);
+        }
+      }
+    }
+
+  this->FillContactOutputs(output, numPoints);
+
+  vtkDebugMacro(<< "Collision detection finished");
+  this->NumberOfBoxTests = BoxTests;
+  this->NumberOfContacts = static_cast<int>(contactCellIds.size()/2);
+
+  // Generate the scalars if needed
+  if (generateScalars)
+    {
+    this->GenerateContactScalars(output);
+    }
+
+  this->InvokeEvent(vtkCommand::EndEvent, NULL);
+
+  return 1;
+
+}
+
+// Description:
+// Fill the contact cells arrays of outputs 0 and 1 and the contacts output from the contacts
+// of the update, reusing the arrays of the last update
+void vtkCollisionDetectionFilter::FillContactOutputs(vtkPolyData *output[3], int numPoints)
+{
+  const std::vector<vtkIdType> &contactCellIds = this->Internals->ContactCellIds;
+  const std::vector<double> &contactPoints = this->Internals->ContactPointCoords;
+  vtkIdType numContacts = static_cast<vtkIdType>(contactCellIds.size()/2);
+
+  // The arrays still referenced by a consumer of the last update are left unchanged, and new
+  // arrays are filled instead, as for the scalars
+  for (int i = 0; i < 2; i++)
+    {
+    vtkIdTypeArray *contactcells = this->Internals->ContactCells[i];
+    if (IsReferencedOutside(contactcells,
+      output[i]->GetFieldData()->GetArray("ContactCells") == contactcells))
+      {
+      this->Internals->ContactCells[i] = vtkSmartPointer<vtkIdTypeArray>::New();
+      contactcells = this->Internals->ContactCells[i];
+      contactcells->SetName("ContactCells");
+      }
+    contactcells->SetNumberOfTuples(numContacts);
+    for (vtkIdType c = 0; c < numContacts; c++)
+      {
+      contactcells->SetValue(c, contactCellIds[2*c+i]);
+      }
+    contactcells->Modified();
+    output[i]->GetFieldData()->AddArray(contactcells);
+    }
+
+  // The contacts output has a line or a vertex per contact
+  vtkPoints *points = this->Internals->ContactPoints;
+  if (IsReferencedOutside(points, output[2]->GetPoints() == points))
+    {
+    this->Internals->ContactPoints = vtkSmartPointer<vtkPoints>::New();
+    points = this->Internals->ContactPoints;
+    }
+  vtkCellArray *segments = this->Internals->ContactSegments;
+  if (IsReferencedOutside(segments,
+    output[2]->GetLines() == segments || output[2]->GetVerts() == segments))
+    {
+    this->Internals->ContactSegments = vtkSmartPointer<vtkCellArray>::New();
+    segments = this->Internals->ContactSegments;
+    }
+  vtkIdType numOutputContacts = (this->GenerateContacts ? numContacts : 0);
+  points->SetNumberOfPoints(numOutputContacts*numPoints);
+  segments->Reset();
+  for (vtkIdType c = 0; c < numOutputContacts; c++)
+    {
+    segments->InsertNextCell(numPoints);
+    for (int j = 0; j < numPoints; j++)
+      {
+      vtkIdType pointId = numPoints*c + j;
+      points->SetPoint(pointId, &contactPoints[3*pointId]);
+      segments->InsertCellPoint(pointId);
+      }
+    }
+  points->Modified();
+  segments->Modified();
+
+  output[2]->Initialize();
+  output[2]->SetPoints(points);
+  if (numPoints == 2)
+    {
+    output[2]->SetLines(segments);
+    }
+  else
+    {
+    output[2]->SetVerts(segments);
+    }
+}
+
+// Description:
+// Color the cells of outputs 0 and 1: the contacting cells from red through to blue, the
+// others white. The scalars are kept between updates and only the cells colored by the last
+// update are cleared, so the cost grows with the number of contacts, not of cells. All the
+// cells are only written when their number or the blank alpha changes.
+void vtkCollisionDetectionFilter::GenerateContactScalars(vtkPolyData *output[3])
+{
+  vtkIdType numContacts = this->GetNumberOfContacts();
+
+  // Maybe this should change, to alpha set to Opacity
+  // regardless if there are contact or not.
+  float alpha;
+  if (numContacts > 0)
+    {
+    alpha = this->Opacity*255.0;
+    }
+  else
+    {
+    alpha = 255.0;
+    }
+  float blank[4] = {255.0,255.0,255.0,alpha};
+
+  vtkLookupTable *lut = this->Internals->ContactColors;
+  if (numContacts>0)
+    {
+    if (this->CollisionMode == VTK_ALL_CONTACTS)
+      {
+      lut->SetTableRange(0, numContacts-1);
+      lut->SetNumberOfTableValues(numContacts);
+      }
+    else // VTK_FIRST_CONTACT
+      {
+      lut->SetTableRange(0, 1);
+      lut->SetNumberOfTableValues(numContacts+1);
+      }
+    lut->Build();
+    }
+
+  for (int idx = 0; idx < 2; idx++)
+    {
+    vtkUnsignedCharArray *scalars = this->Internals->Scalars[idx];
+    std::vector<vtkIdType> &coloredCells = this->Internals->ColoredCells[idx];
+    vtkIdType numCells = output[idx]->GetNumberOfCells();
+
+    // A consumer that kept the scalars of the last update, e.g. with a shallow copy of the
+    // output, references them besides this filter and the output: they are left unchanged and
+    // new scalars are filled instead
+    bool referenced = IsReferencedOutside(scalars,
+      output[idx]->GetCellData()->GetScalars() == scalars);
+    if (referenced)
+      {
+      this->Internals->Scalars[idx] = vtkSmartPointer<vtkUnsignedCharArray>::New();
+      scalars = this->Internals->Scalars[idx];
+      scalars->SetNumberOfComponents(4);
+      }
+
+    if (scalars->GetNumberOfTuples() != numCells || alpha != this->Internals->BlankAlpha ||
+      referenced)
+      {
+      // Fill the array with blanks...
+      scalars->SetNumberOfTuples(numCells);
+      for (vtkIdType i = 0; i < numCells; i++)
+        {
+        scalars->SetTuple(i, blank);
+        }
+      }
+    else
+      {
+      for (size_t i = 0; i < coloredCells.size(); i++)
+        {
+        scalars->SetTuple(coloredCells[i], blank);
+        }
+      }
+    coloredCells.clear();
+
+    // Now color the intersecting cells
+    vtkIdTypeArray *contactcells = this->GetContactCells(idx);
+    double *RGBA;
+    float RGB[4];
+    for (vtkIdType id, i = 0; i < numContacts; i++)
+      {
+      id = contactcells->GetValue(i);
+      RGBA = lut->GetTableValue(i);
+      RGB[0] = 255.0*RGBA[0];
+      RGB[1] = 255.0*RGBA[1];
+      RGB[2] = 255.0*RGBA[2];
+      RGB[3] = 255.0;
+      scalars->SetTuple(id, RGB);
+      coloredCells.push_back(id);
+      }
+
+    scalars->Modified();
+    output[idx]->GetCellData()->SetScalars(scalars);
+    vtkDebugMacro(<< "Created scalars on output " << idx);
+    }
+  this->Internals->BlankAlpha = alpha;
 }
 
 // Method intersects two polygons. You must supply the number of points and
@@ -780,5 +2262,15 @@ void vtkCollisionDetectionFilter::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "Box Tolerance: " << this->BoxTolerance << "\n";
   os << indent << "Cell Tolerance: " << this->CellTolerance << "\n";
   os << indent << "Number of cells per Node: " << this->NumberOfCellsPerNode << "\n";
+  os << indent << "Hierarchy Type: " << (this->HierarchyType == vtkCollisionHierarchy::VTK_AABB_HIERARCHY ? "AABB" : "OBB") << "\n";
+  os << indent << "Parallel Traversal: " << this->ParallelTraversal << "\n";
+  os << indent << "Instruction Set: " << this->InstructionSet << "\n";
+  os << indent << "Minimum Distance: " << this->MinimumDistance << "\n";
+  os << indent << "Maximum Distance: " << this->MaximumDistance << "\n";
+  os << indent << "Proximity Distance: " << this->ProximityDistance << "\n";
+  os << indent << "Temporal Coherence: " << this->TemporalCoherence << "\n";
+  os << indent << "Pass Inputs: " << this->PassInputs << "\n";
+  os << indent << "Generate Contacts: " << this->GenerateContacts << "\n";
+  os << indent << "Number Of Contacts: " << this->NumberOfContacts << "\n";
 
 }
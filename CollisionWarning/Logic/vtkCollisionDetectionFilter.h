@@ -14,9 +14,16 @@
 // .NAME vtkCollisionDetectionFilter - performs collision determination between two polyhedral surfaces
 // .SECTION Description
 // vtkCollisionDetectionFilter performs collision determination between two polyhedral surfaces using
-// two instances of vtkOBBTree. Set the polydata inputs, the tolerance and transforms or matrices. If
+// two instances of vtkCollisionHierarchy, a flattened OBB tree owned by the filter. The hierarchies
+// are only rebuilt when the inputs are modified, so moving the models by changing the transforms or
+// matrices does not rebuild them. Except in MinimumDistance mode, models whose bounds or root boxes are
+// apart are rejected before any further work, and the outputs then have no contacts.
+// Set the polydata inputs, the tolerance and transforms or matrices. If
 // CollisionMode is set to AllContacts, the Contacts output will be lines of contact.
 // If CollisionMode is FirstContact or HalfContacts then the Contacts output will be vertices.
+// If CollisionMode is MinimumDistance, the Contacts output is the line between the closest points
+// of the two models. If CollisionMode is WithinDistance, it is the line between the closest points
+// of the first pair of cells found closer than ProximityDistance.
 // See below for an explanation of these options.
 //
 // This class can be used to clip one polydata surface with another, using the Contacts output as a loop
@@ -33,7 +40,7 @@
 
 
 // .SECTION See Also
-// vtkTriangleFilter, vtkSelectPolyData, vtkOBBTree
+// vtkTriangleFilter, vtkSelectPolyData, vtkOBBTree, vtkCollisionHierarchy
 
 #ifndef __vtkCollisionDetectionFilter_h
 #define __vtkCollisionDetectionFilter_h
@@ -44,8 +51,8 @@
 #include "vtkLinearTransform.h"
 #include "vtkIdTypeArray.h"
 #include "vtkFieldData.h"
+#include "vtkCollisionHierarchy.h"
 
-class vtkOBBTree;
 class vtkPolyData;
 class vtkPoints;
 class vtkMatrix4x4;
@@ -65,7 +72,9 @@ public:
   {
     VTK_ALL_CONTACTS = 0,
     VTK_FIRST_CONTACT = 1,
-    VTK_HALF_CONTACTS = 2
+    VTK_HALF_CONTACTS = 2,
+    VTK_MIN_DISTANCE = 3,
+    VTK_WITHIN_DISTANCE = 4
   };
 //ETX
 
@@ -73,12 +82,16 @@ public:
   // Set the collision mode to VTK_ALL_CONTACTS to find all the contacting cell pairs with
   // two points per collision, or VTK_HALF_CONTACTS to find all the contacting cell pairs
   // with one point per collision, or VTK_FIRST_CONTACT to quickly find the first contact
-  // point.
-  vtkSetClampMacro(CollisionMode,int,VTK_ALL_CONTACTS,VTK_HALF_CONTACTS);
+  // point, or VTK_MIN_DISTANCE to find the closest pair of cells with a line between their
+  // closest points (see GetMinimumDistance), or VTK_WITHIN_DISTANCE to quickly find the first
+  // pair of cells closer than ProximityDistance, with a line between their closest points.
+  vtkSetClampMacro(CollisionMode,int,VTK_ALL_CONTACTS,VTK_WITHIN_DISTANCE);
   vtkGetMacro(CollisionMode,int);
   void SetCollisionModeToAllContacts() {this->SetCollisionMode(VTK_ALL_CONTACTS);};
   void SetCollisionModeToFirstContact() {this->SetCollisionMode(VTK_FIRST_CONTACT);};
   void SetCollisionModeToHalfContacts() {this->SetCollisionMode(VTK_HALF_CONTACTS);};
+  void SetCollisionModeToMinimumDistance() {this->SetCollisionMode(VTK_MIN_DISTANCE);};
+  void SetCollisionModeToWithinDistance() {this->SetCollisionMode(VTK_WITHIN_DISTANCE);};
   const char *GetCollisionModeAsString();
 
   // Description:
@@ -107,12 +120,16 @@ public:
   // the "ContactCells" field array in outputs 0 and 1. These arrays index contacting
   // cells (eg) index 50 of array 0 points to a cell (triangle) which contacts/intersects
   // a cell at index 50 of array 1. This method is equivalent to
-  // GetOutput(i)->GetFieldData()->GetArray("ContactCells")
+  // GetOutput(i)->GetFieldData()->GetArray("ContactCells"), but does not go through the
+  // outputs. The arrays are filled again in place by the next update, unless something else
+  // than the filter and its outputs references them, in which case new arrays are filled and
+  // the referenced ones keep the contacts of the last update.
     vtkIdTypeArray *GetContactCells(int i);
 
   // Description:
   // Get the output with the points where the contacting cells intersect. This method is
-  // is equivalent to GetOutputPort(2)/GetOutput(2)
+  // is equivalent to GetOutputPort(2)/GetOutput(2). Like the contact cells arrays, its points
+  // and cells are only filled again in place when nothing else references them.
   vtkAlgorithmOutput *GetContactsOutputPort() {return this->GetOutputPort(2);}
   vtkPolyData *GetContactsOutput() {return this->GetOutput(2);}
 
@@ -127,6 +144,19 @@ public:
   void SetMatrix(int i, vtkMatrix4x4 *matrix);
   vtkMatrix4x4 *GetMatrix(int i);
 
+  // Description:
+  // Set the hierarchy built for input i, to share it with other filters that have the same
+  // polydata as input (e.g. the output of the same vtkTriangleFilter), or a shallow copy of it
+  // with the same points and cells. The filter rebuilds the hierarchy if its input differs
+  // from the one it was built for. The number of cells per node and the type of a hierarchy
+  // set here are the ones of its owner, the NumberOfCellsPerNode and HierarchyType of the
+  // filter are not applied to it. The filters sharing a hierarchy may then be updated
+  // concurrently, as long as the polydata is not modified meanwhile, and its bounds have been
+  // computed beforehand (GetBounds computes them again after a modification of the points,
+  // which the shallow copies share). Set NULL to go back to a hierarchy of the filter's own.
+  void SetHierarchy(int i, vtkCollisionHierarchy *hierarchy);
+  vtkCollisionHierarchy *GetHierarchy(int i);
+
   //Description:
   // Set and Get the obb tolerance (absolute value, in world coords). Default is 0.001
   vtkSetMacro(BoxTolerance, float);
@@ -140,24 +170,112 @@ public:
   //Description:
   // Set and Get the the flag to visualize the contact cells. If set the contacting cells
   // will be coloured from red through to blue, with collisions first determined coloured red.
+  // The scalars are kept between updates and only the cells whose contact state changed are
+  // rewritten, unless the scalars of the last update are still referenced outside of the
+  // filter and its outputs, in which case new scalars are allocated. Requires PassInputs.
   vtkSetMacro(GenerateScalars, int);
   vtkGetMacro(GenerateScalars, int);
   vtkBooleanMacro(GenerateScalars,int);
 
   //Description:
-  // Get the number of contacting cell pairs
-  int GetNumberOfContacts()
-    {return this->GetOutput(0)->GetFieldData()->GetArray("ContactCells")->GetNumberOfTuples();}
+  // Get the number of contacting cell pairs. In VTK_MIN_DISTANCE mode it is the number of
+  // closest pairs, 1 whenever a pair closer than MaximumDistance is found, even if the models
+  // do not touch: GetMinimumDistance tells whether they do.
+  vtkGetMacro(NumberOfContacts, int);
+
+  //Description:
+  // Set and Get the flag to pass the inputs to outputs 0 and 1. The outputs then reference
+  // the points, cells and data of the inputs, and GenerateScalars colours their cells. If the
+  // flag is off, outputs 0 and 1 only hold the "ContactCells" field arrays, which saves
+  // copying the structure and data of large inputs when only the contacts are needed, and no
+  // scalars are generated. The inputs are not passed either when the broadphase finds the
+  // models apart: the result of the update is empty then. Default is 1
+  vtkSetMacro(PassInputs, int);
+  vtkGetMacro(PassInputs, int);
+  vtkBooleanMacro(PassInputs, int);
+
+  //Description:
+  // Set and Get the flag to fill the contacts output (output 2) with the points and the lines
+  // or vertices of the contacts. If the flag is off, the contacts output is empty, the
+  // contact cells arrays and the minimum distance are still computed. Default is 1
+  vtkSetMacro(GenerateContacts, int);
+  vtkGetMacro(GenerateContacts, int);
+  vtkBooleanMacro(GenerateContacts, int);
+
+  //Description:
+  // Get the distance between the two models, in world coords, found in VTK_MIN_DISTANCE mode.
+  // It is 0 if the models intersect and -1 if it was not computed, or if the models are
+  // farther apart than MaximumDistance. The search is done in the coordinate system of input
+  // 0, so the distance is exact if the matrix of input 0 does not scale.
+  vtkGetMacro(MinimumDistance, double);
+
+  //Description:
+  // Set and Get the largest distance searched in VTK_MIN_DISTANCE mode (in the coords of
+  // input 0). Models farther apart are rejected from their bounds and the boxes of the roots,
+  // like in the other modes, instead of searching their closest pair. Default is
+  // VTK_DOUBLE_MAX, the distance is always computed.
+  vtkSetClampMacro(MaximumDistance, double, 0.0, VTK_DOUBLE_MAX);
+  vtkGetMacro(MaximumDistance, double);
+
+  //Description:
+  // Set and Get the distance used in VTK_WITHIN_DISTANCE mode (absolute value, in the coords of
+  // input 0). The boxes are inflated by this distance and the search stops at the first pair
+  // of cells closer than it. Default is 0.0
+  vtkSetClampMacro(ProximityDistance, double, 0.0, VTK_DOUBLE_MAX);
+  vtkGetMacro(ProximityDistance, double);
 
   //Description:
   // Get the number of box tests
   vtkGetMacro(NumberOfBoxTests, int);
 
   //Description:
-  // Set and Get the number of cells in each OBB. Default is 2
+  // Set and Get the number of cells in each OBB of the hierarchies of the filter's own, see
+  // SetHierarchy. Default is 2
   vtkSetMacro(NumberOfCellsPerNode, int);
   vtkGetMacro(NumberOfCellsPerNode, int);
 
+  //Description:
+  // Set and Get the type of the hierarchies of the filter's own, see SetHierarchy: oriented
+  // boxes (vtkCollisionHierarchy::VTK_OBB_HIERARCHY) or axis aligned
+  // boxes built with the surface area heuristic (VTK_AABB_HIERARCHY). Axis aligned boxes are
+  // faster to build and refit, oriented boxes are tighter so the traversal tests fewer of
+  // them. Default is VTK_OBB_HIERARCHY
+  vtkSetClampMacro(HierarchyType, int, vtkCollisionHierarchy::VTK_OBB_HIERARCHY,
+    vtkCollisionHierarchy::VTK_AABB_HIERARCHY);
+  vtkGetMacro(HierarchyType, int);
+  void SetHierarchyTypeToOBB() {this->SetHierarchyType(vtkCollisionHierarchy::VTK_OBB_HIERARCHY);};
+  void SetHierarchyTypeToAABB() {this->SetHierarchyType(vtkCollisionHierarchy::VTK_AABB_HIERARCHY);};
+
+  //Description:
+  // Set and Get the flag to split the traversal of the hierarchies into tasks that are run
+  // in parallel with vtkSMPTools. The contacts are the same and in the same order as with a
+  // sequential traversal, except in VTK_FIRST_CONTACT mode where any contact may be found
+  // first. The number of tasks follows vtkSMPTools::GetEstimatedNumberOfThreads(). Turn it off
+  // when the filter runs on threads of its own that already occupy the cores. Default is 1
+  vtkSetMacro(ParallelTraversal, int);
+  vtkGetMacro(ParallelTraversal, int);
+  vtkBooleanMacro(ParallelTraversal, int);
+
+  //Description:
+  // Set and Get the flag to test the witnesses of the last update first: the pair of cells
+  // of the last contact (or the closest pair in VTK_MIN_DISTANCE mode) and the axis that
+  // separated the models. When the models have moved little, this answers the
+  // VTK_FIRST_CONTACT and VTK_WITHIN_DISTANCE queries without a traversal in most cases,
+  // and bounds the search of VTK_MIN_DISTANCE from the start. In VTK_ALL_CONTACTS and
+  // VTK_HALF_CONTACTS modes, the traversal also starts from the pairs of nodes where the last
+  // one stopped (the front of the traversal) instead of the roots. Default is 1
+  vtkSetMacro(TemporalCoherence, int);
+  vtkGetMacro(TemporalCoherence, int);
+  vtkBooleanMacro(TemporalCoherence, int);
+
+  //Description:
+  // Set and Get the instruction set of the batched triangle tests, see
+  // vtkCollisionTriangleKernel. Set it to force a slower instruction set, an instruction set
+  // that the processor does not support is replaced by the best one that it supports.
+  // Default is the best instruction set supported by the processor.
+  void SetInstructionSet(int instructionSet);
+  vtkGetMacro(InstructionSet, int);
+
   //Description:
   // Set and Get the opacity of the polydata output when a collision takes place.
   // Default is 1.0
@@ -175,18 +293,52 @@ protected:
   // Usual data generation method
   virtual int RequestData(vtkInformation *, vtkInformationVector **, vtkInformationVector *);
 
-  vtkOBBTree *tree0;
-  vtkOBBTree *tree1;
+  // Description:
+  // Fill the contact cells arrays of outputs 0 and 1 and the contacts output from the contacts
+  // found by the update, with numPoints points per contact.
+  void FillContactOutputs(vtkPolyData *output[3], int numPoints);
+
+  // Description:
+  // Color the contacting cells of outputs 0 and 1, see GenerateScalars.
+  void GenerateContactScalars(vtkPolyData *output[3]);
+
+  vtkCollisionHierarchy *tree0;
+  vtkCollisionHierarchy *tree1;
+  // Set for the hierarchies set with SetHierarchy, whose parameters the filter does not change
+  int ExternalHierarchy[2];
 
   vtkLinearTransform *Transform[2];
   vtkMatrix4x4 *Matrix[2];
 
   int NumberOfBoxTests;
+  int NumberOfContacts;
+  int PassInputs;
+  int GenerateContacts;
 
   int NumberOfCellsPerNode;
+  int HierarchyType;
 
   int GenerateScalars;
 
+  int ParallelTraversal;
+  int InstructionSet;
+
+  double MinimumDistance;
+  double MaximumDistance;
+  double ProximityDistance;
+
+  // Witnesses of the last update: triangle indices of the contact or closest pair in the
+  // hierarchies, the separating axis of the roots, and the build times of the hierarchies
+  int TemporalCoherence;
+  vtkIdType WitnessTriangles[2];
+  int WitnessAxis;
+  unsigned long WitnessBuildTime[2];
+
+//BTX
+  class vtkInternals;
+  vtkInternals *Internals;
+//ETX
+
   float BoxTolerance;
   float CellTolerance;
   float Opacity;
@@ -211,10 +363,18 @@ inline const char *vtkCollisionDetectionFilter::GetCollisionModeAsString(void)
     {
     return (char *)"FirstContact";
     }
-  else
+  else if (this->CollisionMode == VTK_HALF_CONTACTS)
     {
     return (char *)"HalfContacts";
     }
+  else if (this->CollisionMode == VTK_MIN_DISTANCE)
+    {
+    return (char *)"MinimumDistance";
+    }
+  else
+    {
+    return (char *)"WithinDistance";
+    }
 }
 
 //ETX
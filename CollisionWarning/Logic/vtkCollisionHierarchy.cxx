@@ -0,0 +1,1032 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+#include "vtkCollisionHierarchy.h"
+#include "vtkObjectFactory.h"
+#include "vtkCellArray.h"
+#include "vtkIdList.h"
+#include "vtkMath.h"
+#include "vtkMultiThreader.h"
+#include "vtkPoints.h"
+#include "vtkPolyData.h"
+#include "vtkSMPTools.h"
+#include "vtkSmartPointer.h"
+
+#include <algorithm>
+
+vtkStandardNewMacro(vtkCollisionHierarchy);
+vtkCxxSetObjectMacro(vtkCollisionHierarchy, DataSet, vtkPolyData);
+
+namespace
+{
+typedef vtkCollisionHierarchy::Node Node;
+
+// The sums of the box of a node are computed over chunks of this many cells, and the chunks are
+// added in order. The chunks only depend on the number of cells, so the boxes, and the
+// hierarchy, do not depend on the number of threads that computed them.
+const vtkIdType CellsPerChunk = 2048;
+const vtkIdType MaxChunks = 64;
+
+// Nodes with fewer cells are not split in the parallel top levels but left to a subtree task
+const vtkIdType MinCellsPerParallelNode = 2*CellsPerChunk;
+
+// Number of bins of the centroids along each axis for the surface area heuristic
+const int NumberOfBins = 16;
+
+// Orders the cells by the projection of their centroid on an axis
+class CentroidProjectionLess
+{
+public:
+  CentroidProjectionLess(const double *cellPoints, const double axis[3])
+    : CellPoints(cellPoints), Axis(axis) {}
+  double Projection(vtkIdType cellId) const
+    {
+    const double *p = this->CellPoints + 9*cellId;
+    return this->Axis[0]*(p[0]+p[3]+p[6]) + this->Axis[1]*(p[1]+p[4]+p[7]) + this->Axis[2]*(p[2]+p[5]+p[8]);
+    }
+  bool operator()(vtkIdType a, vtkIdType b) const {return this->Projection(a) < this->Projection(b);}
+private:
+  const double *CellPoints;
+  const double *Axis;
+};
+
+// True if the centroid of the cell is below the split plane
+class BelowSplitPlane
+{
+public:
+  BelowSplitPlane(const double *cellPoints, const double axis[3], double split)
+    : Less(cellPoints, axis), Split(3.0*split) {}
+  bool operator()(vtkIdType cellId) const {return this->Less.Projection(cellId) < this->Split;}
+private:
+  CentroidProjectionLess Less;
+  double Split;
+};
+
+// True if the centroid of the cell falls in a bin below the split bin along an axis
+class BelowSplitBin
+{
+public:
+  BelowSplitBin(const double *cellPoints, int axis, double origin, double scale, int split)
+    : CellPoints(cellPoints), Axis(axis), Origin(origin), Scale(scale), Split(split) {}
+  int Bin(vtkIdType cellId) const
+    {
+    const double *p = this->CellPoints + 9*cellId + this->Axis;
+    int bin = static_cast<int>((p[0] + p[3] + p[6] - this->Origin) * this->Scale);
+    return std::min(std::max(bin, 0), NumberOfBins-1);
+    }
+  bool operator()(vtkIdType cellId) const {return this->Bin(cellId) < this->Split;}
+private:
+  const double *CellPoints;
+  int Axis;
+  double Origin;
+  double Scale;
+  int Split;
+};
+
+// Base of the functors that reduce the cells ids[0] ... ids[count-1] chunk by chunk. Each chunk
+// writes its own ChunkSize values of Results.
+class ChunkFunctor
+{
+public:
+  ChunkFunctor(const vtkIdType *ids, vtkIdType count, const double *cellPoints,
+    vtkIdType numberOfChunks, int chunkSize)
+    : Ids(ids), Count(count), CellPoints(cellPoints), NumberOfChunks(numberOfChunks),
+      ChunkSize(chunkSize), Results(numberOfChunks*chunkSize) {}
+
+  vtkIdType ChunkBegin(vtkIdType chunk) const {return chunk*this->Count/this->NumberOfChunks;}
+
+  const vtkIdType *Ids;
+  vtkIdType Count;
+  const double *CellPoints;
+  vtkIdType NumberOfChunks;
+  int ChunkSize;
+  std::vector<double> Results;
+};
+
+// Area weighted moments of the cells: mass, first moments and the second moments a00, a01, a02,
+// a11, a12, a22, as in vtkOBBTree::ComputeOBB. With UnitWeights every cell has a unit mass.
+class MomentsFunctor : public ChunkFunctor
+{
+public:
+  MomentsFunctor(const vtkIdType *ids, vtkIdType count, const double *cellPoints,
+    vtkIdType numberOfChunks)
+    : ChunkFunctor(ids, count, cellPoints, numberOfChunks, 10), UnitWeights(false) {}
+
+  void operator()(vtkIdType begin, vtkIdType end)
+    {
+    for (vtkIdType chunk = begin; chunk < end; chunk++)
+      {
+      double *m = &this->Results[10*chunk];
+      std::fill(m, m+10, 0.0);
+      for (vtkIdType i = this->ChunkBegin(chunk); i < this->ChunkBegin(chunk+1); i++)
+        {
+        const double *p = this->CellPoints + 9*this->Ids[i];
+        const double *q = p + 3;
+        const double *r = p + 6;
+        double c[3], dp0[3], dp1[3], n[3];
+        for (int k = 0; k < 3; k++)
+          {
+          c[k] = (p[k] + q[k] + r[k]) / 3.0;
+          dp0[k] = q[k] - p[k];
+          dp1[k] = r[k] - p[k];
+          }
+        double triMass = 1.0;
+        if (!this->UnitWeights)
+          {
+          vtkMath::Cross(dp0, dp1, n);
+          triMass = 0.5*vtkMath::Norm(n);
+          }
+        m[0] += triMass;
+        m[1] += triMass * c[0];
+        m[2] += triMass * c[1];
+        m[3] += triMass * c[2];
+        m[4] += triMass*(9.0*c[0]*c[0] + p[0]*p[0] + q[0]*q[0] + r[0]*r[0])/12.0;
+        m[5] += triMass*(9.0*c[0]*c[1] + p[0]*p[1] + q[0]*q[1] + r[0]*r[1])/12.0;
+        m[6] += triMass*(9.0*c[0]*c[2] + p[0]*p[2] + q[0]*q[2] + r[0]*r[2])/12.0;
+        m[7] += triMass*(9.0*c[1]*c[1] + p[1]*p[1] + q[1]*q[1] + r[1]*r[1])/12.0;
+        m[8] += triMass*(9.0*c[1]*c[2] + p[1]*p[2] + q[1]*q[2] + r[1]*r[2])/12.0;
+        m[9] += triMass*(9.0*c[2]*c[2] + p[2]*p[2] + q[2]*q[2] + r[2]*r[2])/12.0;
+        }
+      }
+    }
+
+  bool UnitWeights;
+};
+
+// Range of the projections of the cell vertices on the axes: tMin[3], tMax[3]
+class ExtentsFunctor : public ChunkFunctor
+{
+public:
+  ExtentsFunctor(const vtkIdType *ids, vtkIdType count, const double *cellPoints,
+    vtkIdType numberOfChunks, const double axes[3][3])
+    : ChunkFunctor(ids, count, cellPoints, numberOfChunks, 6), Axes(axes) {}
+
+  void operator()(vtkIdType begin, vtkIdType end)
+    {
+    for (vtkIdType chunk = begin; chunk < end; chunk++)
+      {
+      double *tMin = &this->Results[6*chunk];
+      double *tMax = tMin + 3;
+      tMin[0] = tMin[1] = tMin[2] = VTK_DOUBLE_MAX;
+      tMax[0] = tMax[1] = tMax[2] = -VTK_DOUBLE_MAX;
+      for (vtkIdType i = this->ChunkBegin(chunk); i < this->ChunkBegin(chunk+1); i++)
+        {
+        const double *p = this->CellPoints + 9*this->Ids[i];
+        for (int j = 0; j < 3; j++, p += 3)
+          {
+          for (int k = 0; k < 3; k++)
+            {
+            double t = vtkMath::Dot(p, this->Axes[k]);
+            if (t < tMin[k])
+              {
+              tMin[k] = t;
+              }
+            if (t > tMax[k])
+              {
+              tMax[k] = t;
+              }
+            }
+          }
+        }
+      }
+    }
+
+  const double (*Axes)[3];
+};
+
+// Set the center and the half extents of the box from the range of the projections on its axes
+void SetNodeExtents(Node &node, const double tMin[3], const double tMax[3])
+{
+  for (int k = 0; k < 3; k++)
+    {
+    node.Center[k] = 0.0;
+    node.HalfExtents[k] = 0.5*(tMax[k] - tMin[k]);
+    }
+  for (int i = 0; i < 3; i++)
+    {
+    double mid = 0.5*(tMin[i] + tMax[i]);
+    for (int k = 0; k < 3; k++)
+      {
+      node.Center[k] += mid*node.Axes[i][k];
+      }
+    }
+}
+
+// Extend the range of the projections on the axes of the box to the point x
+void ExtendNodeExtents(const Node &node, const double x[3], double tMin[3], double tMax[3])
+{
+  for (int k = 0; k < 3; k++)
+    {
+    double t = vtkMath::Dot(x, node.Axes[k]);
+    if (t < tMin[k])
+      {
+      tMin[k] = t;
+      }
+    if (t > tMax[k])
+      {
+      tMax[k] = t;
+      }
+    }
+}
+
+template<class Functor>
+void ReduceChunks(Functor &functor, bool parallel)
+{
+  if (parallel && functor.NumberOfChunks > 1)
+    {
+    vtkSMPTools::For(0, functor.NumberOfChunks, 1, functor);
+    }
+  else
+    {
+    functor(0, functor.NumberOfChunks);
+    }
+}
+
+// Area weighted covariance of the cells of the node (as in vtkOBBTree::ComputeOBB), its
+// eigenvectors are the axes of the box. The extents are given by the projection of the cell
+// vertices. Also returns the area weighted mean of the cells. With parallel set the chunks are
+// reduced with vtkSMPTools.
+void ComputeNodeBox(Node &node, double mean[3], const vtkIdType *cellIds,
+  const double *cellPoints, bool parallel)
+{
+  const vtkIdType *ids = cellIds + node.First;
+  vtkIdType numberOfChunks = std::max(static_cast<vtkIdType>(1),
+    std::min(MaxChunks, node.Count/CellsPerChunk));
+
+  // Cells without area get a unit weight if all the cells are degenerate
+  MomentsFunctor moments(ids, node.Count, cellPoints, numberOfChunks);
+  double m[10];
+  for (int pass = 0; pass < 2; pass++)
+    {
+    moments.UnitWeights = (pass == 1);
+    ReduceChunks(moments, parallel);
+    std::fill(m, m+10, 0.0);
+    for (vtkIdType chunk = 0; chunk < numberOfChunks; chunk++)
+      {
+      for (int k = 0; k < 10; k++)
+        {
+        m[k] += moments.Results[10*chunk+k];
+        }
+      }
+    if (m[0] > 0.0)
+      {
+      break;
+      }
+    }
+
+  double totalMass = m[0];
+  for (int k = 0; k < 3; k++)
+    {
+    mean[k] = m[k+1] / totalMass;
+    }
+  double a0[3], a1[3], a2[3];
+  a0[0] = m[4]/totalMass - mean[0]*mean[0];
+  a0[1] = m[5]/totalMass - mean[0]*mean[1];
+  a0[2] = m[6]/totalMass - mean[0]*mean[2];
+  a1[1] = m[7]/totalMass - mean[1]*mean[1];
+  a1[2] = m[8]/totalMass - mean[1]*mean[2];
+  a2[2] = m[9]/totalMass - mean[2]*mean[2];
+  a1[0] = a0[1];
+  a2[0] = a0[2];
+  a2[1] = a1[2];
+
+  // Eigenvectors of the covariance matrix, sorted by decreasing eigenvalue
+  double *a[3] = {a0, a1, a2};
+  double eigenvalues[3], v0[3], v1[3], v2[3];
+  double *v[3] = {v0, v1, v2};
+  vtkMath::Jacobi(a, eigenvalues, v);
+  for (int i = 0; i < 3; i++)
+    {
+    node.Axes[i][0] = v[0][i];
+    node.Axes[i][1] = v[1][i];
+    node.Axes[i][2] = v[2][i];
+    }
+
+  // Extents along the axes
+  ExtentsFunctor extents(ids, node.Count, cellPoints, numberOfChunks, node.Axes);
+  ReduceChunks(extents, parallel);
+  double tMin[3] = {VTK_DOUBLE_MAX, VTK_DOUBLE_MAX, VTK_DOUBLE_MAX};
+  double tMax[3] = {-VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX};
+  for (vtkIdType chunk = 0; chunk < numberOfChunks; chunk++)
+    {
+    for (int k = 0; k < 3; k++)
+      {
+      tMin[k] = std::min(tMin[k], extents.Results[6*chunk+k]);
+      tMax[k] = std::max(tMax[k], extents.Results[6*chunk+3+k]);
+      }
+    }
+  SetNodeExtents(node, tMin, tMax);
+}
+
+// Axis aligned box of the vertices of the cells of the node
+void ComputeAlignedNodeBox(Node &node, const vtkIdType *cellIds, const double *cellPoints,
+  bool parallel)
+{
+  for (int i = 0; i < 3; i++)
+    {
+    for (int k = 0; k < 3; k++)
+      {
+      node.Axes[i][k] = (i == k ? 1.0 : 0.0);
+      }
+    }
+  vtkIdType numberOfChunks = std::max(static_cast<vtkIdType>(1),
+    std::min(MaxChunks, node.Count/CellsPerChunk));
+  ExtentsFunctor extents(cellIds + node.First, node.Count, cellPoints, numberOfChunks, node.Axes);
+  ReduceChunks(extents, parallel);
+  double tMin[3] = {VTK_DOUBLE_MAX, VTK_DOUBLE_MAX, VTK_DOUBLE_MAX};
+  double tMax[3] = {-VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX};
+  for (vtkIdType chunk = 0; chunk < numberOfChunks; chunk++)
+    {
+    for (int k = 0; k < 3; k++)
+      {
+      tMin[k] = std::min(tMin[k], extents.Results[6*chunk+k]);
+      tMax[k] = std::max(tMax[k], extents.Results[6*chunk+3+k]);
+      }
+    }
+  SetNodeExtents(node, tMin, tMax);
+}
+
+// Surface area of the box bounds[6], without the factor 2
+inline double HalfSurfaceArea(const double bounds[6])
+{
+  double dx = bounds[1] - bounds[0];
+  double dy = bounds[3] - bounds[2];
+  double dz = bounds[5] - bounds[4];
+  return (dx < 0.0 ? 0.0 : dx*dy + dy*dz + dz*dx);
+}
+
+// Split the cells with the surface area heuristic: the centroids are sorted into bins along
+// each axis, and the cells are split between the two bins that minimize the number of cells
+// times the surface area of the bounds, summed over the two halves. Returns begin if all the
+// centroids are in the same bin.
+vtkIdType *SplitSurfaceAreaHeuristic(vtkIdType *begin, vtkIdType *end, const double *cellPoints)
+{
+  // Bounds of the centroids, times 3
+  double cMin[3] = {VTK_DOUBLE_MAX, VTK_DOUBLE_MAX, VTK_DOUBLE_MAX};
+  double cMax[3] = {-VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX};
+  for (vtkIdType *id = begin; id != end; ++id)
+    {
+    const double *p = cellPoints + 9*(*id);
+    for (int k = 0; k < 3; k++)
+      {
+      double c = p[k] + p[k+3] + p[k+6];
+      cMin[k] = std::min(cMin[k], c);
+      cMax[k] = std::max(cMax[k], c);
+      }
+    }
+
+  // Count the cells and bound their vertices in each bin of each axis, in one pass
+  vtkIdType counts[3][NumberOfBins];
+  double bounds[3][NumberOfBins][6];
+  double scale[3];
+  for (int axis = 0; axis < 3; axis++)
+    {
+    scale[axis] = (cMax[axis] > cMin[axis] ? NumberOfBins/(cMax[axis] - cMin[axis]) : 0.0);
+    for (int bin = 0; bin < NumberOfBins; bin++)
+      {
+      counts[axis][bin] = 0;
+      for (int k = 0; k < 3; k++)
+        {
+        bounds[axis][bin][2*k] = VTK_DOUBLE_MAX;
+        bounds[axis][bin][2*k+1] = -VTK_DOUBLE_MAX;
+        }
+      }
+    }
+  BelowSplitBin binners[3] = {
+    BelowSplitBin(cellPoints, 0, cMin[0], scale[0], 0),
+    BelowSplitBin(cellPoints, 1, cMin[1], scale[1], 0),
+    BelowSplitBin(cellPoints, 2, cMin[2], scale[2], 0)};
+  for (vtkIdType *id = begin; id != end; ++id)
+    {
+    const double *p = cellPoints + 9*(*id);
+    double cellBounds[6];
+    for (int k = 0; k < 3; k++)
+      {
+      cellBounds[2*k] = std::min(p[k], std::min(p[k+3], p[k+6]));
+      cellBounds[2*k+1] = std::max(p[k], std::max(p[k+3], p[k+6]));
+      }
+    for (int axis = 0; axis < 3; axis++)
+      {
+      int bin = binners[axis].Bin(*id);
+      counts[axis][bin]++;
+      double *box = bounds[axis][bin];
+      for (int k = 0; k < 6; k += 2)
+        {
+        box[k] = std::min(box[k], cellBounds[k]);
+        box[k+1] = std::max(box[k+1], cellBounds[k+1]);
+        }
+      }
+    }
+
+  double bestCost = VTK_DOUBLE_MAX;
+  int bestAxis = -1;
+  int bestSplit = 0;
+  for (int axis = 0; axis < 3; axis++)
+    {
+    if (scale[axis] == 0.0)
+      {
+      continue;
+      }
+
+    // Sweep from the right to get the cost of the upper halves, then from the left
+    double rightCost[NumberOfBins];
+    double box[6] = {VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX, VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX,
+      VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX};
+    vtkIdType count = 0;
+    for (int bin = NumberOfBins-1; bin > 0; bin--)
+      {
+      for (int k = 0; k < 6; k += 2)
+        {
+        box[k] = std::min(box[k], bounds[axis][bin][k]);
+        box[k+1] = std::max(box[k+1], bounds[axis][bin][k+1]);
+        }
+      count += counts[axis][bin];
+      rightCost[bin] = (count > 0 ? count*HalfSurfaceArea(box) : -1.0);
+      }
+    box[0] = box[2] = box[4] = VTK_DOUBLE_MAX;
+    box[1] = box[3] = box[5] = -VTK_DOUBLE_MAX;
+    count = 0;
+    for (int split = 1; split < NumberOfBins; split++)
+      {
+      for (int k = 0; k < 6; k += 2)
+        {
+        box[k] = std::min(box[k], bounds[axis][split-1][k]);
+        box[k+1] = std::max(box[k+1], bounds[axis][split-1][k+1]);
+        }
+      count += counts[axis][split-1];
+      if (count == 0 || rightCost[split] < 0.0)
+        {
+        continue;
+        }
+      double cost = count*HalfSurfaceArea(box) + rightCost[split];
+      if (cost < bestCost)
+        {
+        bestCost = cost;
+        bestAxis = axis;
+        bestSplit = split;
+        }
+      }
+    }
+
+  if (bestAxis < 0)
+    {
+    return begin;
+    }
+  return std::partition(begin, end,
+    BelowSplitBin(cellPoints, bestAxis, cMin[bestAxis], scale[bestAxis], bestSplit));
+}
+
+// Compute the box of nodes[nodeId] and, unless leaf is set, split its cells. Oriented boxes
+// are split at the mean, trying the axes from the longest to the shortest, like vtkOBBTree
+// does, and axis aligned boxes with the surface area heuristic. The two children are appended
+// to nodes. Returns true if the node was split.
+bool SplitNode(std::vector<Node> &nodes, vtkIdType nodeId, bool leaf, int hierarchyType,
+  vtkIdType *cellIds, const double *cellPoints, bool parallel)
+{
+  // Nodes may be reallocated when children are added, so always access them by index
+  bool aligned = (hierarchyType == vtkCollisionHierarchy::VTK_AABB_HIERARCHY);
+  double mean[3];
+  if (aligned)
+    {
+    ComputeAlignedNodeBox(nodes[nodeId], cellIds, cellPoints, parallel);
+    }
+  else
+    {
+    ComputeNodeBox(nodes[nodeId], mean, cellIds, cellPoints, parallel);
+    }
+  nodes[nodeId].Child = -1;
+  if (leaf)
+    {
+    return false;
+    }
+
+  vtkIdType first = nodes[nodeId].First;
+  vtkIdType count = nodes[nodeId].Count;
+  vtkIdType *begin = cellIds + first;
+  vtkIdType *end = begin + count;
+  vtkIdType *middle = begin;
+  if (aligned)
+    {
+    middle = SplitSurfaceAreaHeuristic(begin, end, cellPoints);
+    }
+  else
+    {
+    for (int axis = 0; axis < 3; axis++)
+      {
+      const double *splitAxis = nodes[nodeId].Axes[axis];
+      middle = std::partition(begin, end,
+        BelowSplitPlane(cellPoints, splitAxis, vtkMath::Dot(mean, splitAxis)));
+      if (middle != begin && middle != end)
+        {
+        break;
+        }
+      }
+    }
+  if (middle == begin || middle == end)
+    {
+    // All centroids are on the same side of the split, split in half instead
+    middle = begin + count/2;
+    std::nth_element(begin, middle, end,
+      CentroidProjectionLess(cellPoints, nodes[nodeId].Axes[0]));
+    }
+
+  vtkIdType child = static_cast<vtkIdType>(nodes.size());
+  nodes.resize(child+2);
+  nodes[nodeId].Child = child;
+  nodes[child].Parent = nodes[child+1].Parent = nodeId;
+  nodes[child].First = first;
+  nodes[child].Count = middle - begin;
+  nodes[child+1].First = first + (middle - begin);
+  nodes[child+1].Count = end - middle;
+  return true;
+}
+
+// Builds the subtree below nodes[0], whose First and Count are set, depth first. level is the
+// depth of nodes[0] in the hierarchy. Returns the depth of the deepest node.
+int BuildSubtree(std::vector<Node> &nodes, int level, int maxLevel, int cellsPerNode,
+  int hierarchyType, vtkIdType *cellIds, const double *cellPoints)
+{
+  int depth = level;
+  std::vector< std::pair<vtkIdType, int> > stack;
+  stack.push_back(std::make_pair(static_cast<vtkIdType>(0), level));
+  while (!stack.empty())
+    {
+    vtkIdType nodeId = stack.back().first;
+    level = stack.back().second;
+    stack.pop_back();
+    depth = std::max(depth, level);
+
+    bool leaf = (nodes[nodeId].Count <= cellsPerNode || level >= maxLevel);
+    if (SplitNode(nodes, nodeId, leaf, hierarchyType, cellIds, cellPoints, false))
+      {
+      vtkIdType child = nodes[nodeId].Child;
+      stack.push_back(std::make_pair(child, level+1));
+      stack.push_back(std::make_pair(child+1, level+1));
+      }
+    }
+  return depth;
+}
+
+// Builds the subtrees below a range of roots, each into its own node array. The subtrees own
+// disjoint ranges of the cell ids, so they can be reordered concurrently.
+class BuildSubtreesFunctor
+{
+public:
+  BuildSubtreesFunctor(const std::vector<Node> &nodes,
+    const std::vector< std::pair<vtkIdType, int> > &roots, int maxLevel, int cellsPerNode,
+    int hierarchyType, vtkIdType *cellIds, const double *cellPoints)
+    : Nodes(nodes), Roots(roots), MaxLevel(maxLevel), CellsPerNode(cellsPerNode),
+      HierarchyType(hierarchyType), CellIds(cellIds), CellPoints(cellPoints), Subtrees(roots.size()), Depths(roots.size()) {}
+
+  void operator()(vtkIdType begin, vtkIdType end)
+    {
+    for (vtkIdType task = begin; task < end; task++)
+      {
+      std::vector<Node> &subtree = this->Subtrees[task];
+      const Node &root = this->Nodes[this->Roots[task].first];
+      subtree.reserve(2*(root.Count/this->CellsPerNode)+1);
+      subtree.assign(1, root);
+      this->Depths[task] = BuildSubtree(subtree, this->Roots[task].second, this->MaxLevel,
+        this->CellsPerNode, this->HierarchyType, this->CellIds, this->CellPoints);
+      }
+    }
+
+  const std::vector<Node> &Nodes;
+  const std::vector< std::pair<vtkIdType, int> > &Roots;
+  int MaxLevel;
+  int CellsPerNode;
+  int HierarchyType;
+  vtkIdType *CellIds;
+  const double *CellPoints;
+  std::vector< std::vector<Node> > Subtrees;
+  std::vector<int> Depths;
+};
+
+// Fills the rows of the triangle table from the cell vertices
+class TriangleTableFunctor
+{
+public:
+  TriangleTableFunctor(vtkCollisionHierarchy::TriangleTable &table, const vtkIdType *cellIds,
+    const double *cellPoints)
+    : Table(table), CellIds(cellIds), CellPoints(cellPoints) {}
+
+  void operator()(vtkIdType begin, vtkIdType end)
+    {
+    vtkCollisionHierarchy::TriangleTable &table = this->Table;
+    for (vtkIdType i = begin; i < end; i++)
+      {
+      const double *p = this->CellPoints + 9*this->CellIds[i];
+      for (int k = 0; k < 9; k++)
+        {
+        table.Points[k][i] = p[k];
+        }
+      for (int k = 0; k < 3; k++)
+        {
+        table.Bounds[2*k][i] = std::min(p[k], std::min(p[k+3], p[k+6]));
+        table.Bounds[2*k+1][i] = std::max(p[k], std::max(p[k+3], p[k+6]));
+        }
+      double dp0[3] = {p[3]-p[0], p[4]-p[1], p[5]-p[2]};
+      double dp1[3] = {p[6]-p[0], p[7]-p[1], p[8]-p[2]};
+      double n[3];
+      vtkMath::Cross(dp0, dp1, n);
+      vtkMath::Normalize(n);
+      table.Plane[0][i] = n[0];
+      table.Plane[1][i] = n[1];
+      table.Plane[2][i] = n[2];
+      table.Plane[3][i] = -vtkMath::Dot(n, p);
+      }
+    }
+
+  vtkCollisionHierarchy::TriangleTable &Table;
+  const vtkIdType *CellIds;
+  const double *CellPoints;
+};
+}
+
+// Constructs with initial 0 values.
+vtkCollisionHierarchy::vtkCollisionHierarchy()
+{
+  this->DataSet = NULL;
+  this->NumberOfCellsPerNode = 2;
+  this->MaxLevel = 64;
+  this->ParallelBuild = 1;
+  this->HierarchyType = VTK_OBB_HIERARCHY;
+  this->RefitThreshold = 2.0;
+  this->Level = 0;
+  this->BuildQuality = 0.0;
+  this->NumberOfBuildCells = 0;
+  this->NumberOfBuildPoints = 0;
+}
+
+// Destroy any allocated memory.
+vtkCollisionHierarchy::~vtkCollisionHierarchy()
+{
+  this->SetDataSet(NULL);
+}
+
+void vtkCollisionHierarchy::Initialize()
+{
+  this->Nodes.clear();
+  this->CellIds.clear();
+  this->Level = 0;
+  for (int k = 0; k < 9; k++)
+    {
+    this->Triangles.Points[k].clear();
+    }
+  for (int k = 0; k < 6; k++)
+    {
+    this->Triangles.Bounds[k].clear();
+    }
+  for (int k = 0; k < 4; k++)
+    {
+    this->Triangles.Plane[k].clear();
+    }
+}
+
+void vtkCollisionHierarchy::DeepCopy(vtkCollisionHierarchy *hierarchy)
+{
+  if (hierarchy == NULL || hierarchy == this)
+    {
+    return;
+    }
+  this->NumberOfCellsPerNode = hierarchy->NumberOfCellsPerNode;
+  this->MaxLevel = hierarchy->MaxLevel;
+  this->ParallelBuild = hierarchy->ParallelBuild;
+  this->HierarchyType = hierarchy->HierarchyType;
+  this->RefitThreshold = hierarchy->RefitThreshold;
+  this->Level = hierarchy->Level;
+  this->BuildQuality = hierarchy->BuildQuality;
+  this->NumberOfBuildCells = hierarchy->NumberOfBuildCells;
+  this->NumberOfBuildPoints = hierarchy->NumberOfBuildPoints;
+  this->Nodes = hierarchy->Nodes;
+  this->CellIds = hierarchy->CellIds;
+  this->Triangles = hierarchy->Triangles;
+  this->Modified();
+  // The copied nodes are the topology of this hierarchy from now on, but the boxes are not
+  // fitted to its data set yet, so the build time is left as is
+  this->TopologyTime.Modified();
+}
+
+// Description:
+// Build the nodes top-down. Oriented boxes are split at the area weighted mean of their
+// cells, trying the axes from the longest to the shortest, like vtkOBBTree does. Axis aligned
+// boxes are split with the surface area heuristic.
+// The top levels are split breadth first, with the sums over the cells of each node reduced
+// in parallel, until there are enough nodes to keep the threads busy. The subtrees below them
+// are then built in parallel and appended to the node array.
+void vtkCollisionHierarchy::BuildHierarchy()
+{
+  if (this->DataSet == NULL)
+    {
+    this->Initialize();
+    return;
+    }
+
+  // Only rebuild if something has changed
+  if (this->BuildTime.GetMTime() > this->GetMTime() &&
+    this->BuildTime.GetMTime() > this->DataSet->GetMTime())
+    {
+    return;
+    }
+
+  // If only the points have moved, moving the boxes with them is much cheaper than a rebuild
+  if (this->IsTopologyUnchanged() && this->RefitHierarchy())
+    {
+    this->BuildTime.Modified();
+    return;
+    }
+
+  vtkDebugMacro(<< "Building hierarchy");
+  this->Initialize();
+
+  vtkPolyData *input = this->DataSet;
+  vtkPoints *points = input->GetPoints();
+  vtkIdType numCells = input->GetNumberOfCells();
+  this->NumberOfBuildCells = numCells;
+  this->NumberOfBuildPoints = input->GetNumberOfPoints();
+  this->TopologyTime.Modified();
+  if (points == NULL || numCells == 0)
+    {
+    this->BuildTime.Modified();
+    return;
+    }
+
+  // Copy the vertices of the cells into a contiguous array
+  std::vector<double> cellPoints(9*numCells);
+  this->CellIds.reserve(numCells);
+  vtkSmartPointer<vtkIdList> pointIds = vtkSmartPointer<vtkIdList>::New();
+  for (vtkIdType cellId = 0; cellId < numCells; cellId++)
+    {
+    input->GetCellPoints(cellId, pointIds);
+    if (pointIds->GetNumberOfIds() < 3)
+      {
+      continue;
+      }
+    for (int j = 0; j < 3; j++)
+      {
+      points->GetPoint(pointIds->GetId(j), &cellPoints[9*cellId+3*j]);
+      }
+    this->CellIds.push_back(cellId);
+    }
+
+  vtkIdType numIds = static_cast<vtkIdType>(this->CellIds.size());
+  if (numIds == 0)
+    {
+    this->BuildTime.Modified();
+    return;
+    }
+
+  int cellsPerNode = (this->NumberOfCellsPerNode < 1 ? 1 : this->NumberOfCellsPerNode);
+  this->Nodes.reserve(2*(numIds/cellsPerNode)+1);
+  this->Nodes.resize(1);
+  this->Nodes[0].Parent = -1;
+  this->Nodes[0].First = 0;
+  this->Nodes[0].Count = numIds;
+
+  size_t numberOfSubtrees = 1;
+  int numberOfThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  if (this->ParallelBuild && numberOfThreads > 1)
+    {
+    numberOfSubtrees = 8 * numberOfThreads;
+    }
+
+  // Split the top levels breadth first. The nodes left in the queue are the roots of the subtrees.
+  std::vector< std::pair<vtkIdType, int> > queue;
+  queue.push_back(std::make_pair(static_cast<vtkIdType>(0), 0));
+  size_t head = 0;
+  while (head < queue.size() && queue.size() - head < numberOfSubtrees)
+    {
+    vtkIdType nodeId = queue[head].first;
+    int level = queue[head].second;
+    if (this->Nodes[nodeId].Count < MinCellsPerParallelNode)
+      {
+      // Too small to be worth a parallel reduction, the nodes behind it in the queue are too
+      break;
+      }
+    head++;
+    this->Level = std::max(this->Level, level);
+
+    bool leaf = (this->Nodes[nodeId].Count <= cellsPerNode || level >= this->MaxLevel);
+    if (SplitNode(this->Nodes, nodeId, leaf, this->HierarchyType, &this->CellIds[0],
+      &cellPoints[0], true))
+      {
+      vtkIdType child = this->Nodes[nodeId].Child;
+      queue.push_back(std::make_pair(child, level+1));
+      queue.push_back(std::make_pair(child+1, level+1));
+      }
+    }
+  queue.erase(queue.begin(), queue.begin() + head);
+
+  BuildSubtreesFunctor subtrees(this->Nodes, queue, this->MaxLevel, cellsPerNode,
+    this->HierarchyType, &this->CellIds[0], &cellPoints[0]);
+  if (queue.size() > 1)
+    {
+    vtkSMPTools::For(0, static_cast<vtkIdType>(queue.size()), 1, subtrees);
+    }
+  else
+    {
+    subtrees(0, static_cast<vtkIdType>(queue.size()));
+    }
+
+  // Append the subtrees in order. The root of a subtree replaces its node, the other nodes
+  // follow the nodes already in the array.
+  for (size_t task = 0; task < queue.size(); task++)
+    {
+    vtkIdType rootId = queue[task].first;
+    const std::vector<Node> &subtree = subtrees.Subtrees[task];
+    vtkIdType offset = static_cast<vtkIdType>(this->Nodes.size()) - 1;
+    for (size_t k = 0; k < subtree.size(); k++)
+      {
+      Node node = subtree[k];
+      if (node.Child >= 0)
+        {
+        node.Child += offset;
+        }
+      if (k == 0)
+        {
+        node.Parent = this->Nodes[rootId].Parent;
+        this->Nodes[rootId] = node;
+        }
+      else
+        {
+        node.Parent = (node.Parent == 0 ? rootId : node.Parent + offset);
+        this->Nodes.push_back(node);
+        }
+      }
+    this->Level = std::max(this->Level, subtrees.Depths[task]);
+    }
+
+  this->BuildTriangleTable(&cellPoints[0]);
+  this->BuildQuality = this->ComputeQuality();
+
+  vtkDebugMacro(<< "Built hierarchy with " << this->Nodes.size() << " nodes and " << this->Level << " levels");
+  this->BuildTime.Modified();
+}
+
+// Description:
+// The cells are unchanged if the hierarchy parameters and the cell arrays have not been
+// modified since the last build, so the data set can only have changed through its points.
+bool vtkCollisionHierarchy::IsTopologyUnchanged()
+{
+  vtkPolyData *input = this->DataSet;
+  if (this->RefitThreshold <= 0.0 || this->Nodes.empty() ||
+    this->TopologyTime.GetMTime() < this->GetMTime() || input->GetPoints() == NULL ||
+    input->GetNumberOfCells() != this->NumberOfBuildCells ||
+    input->GetNumberOfPoints() != this->NumberOfBuildPoints)
+    {
+    return false;
+    }
+  vtkCellArray *cells[4] = {input->GetVerts(), input->GetLines(), input->GetPolys(), input->GetStrips()};
+  for (int i = 0; i < 4; i++)
+    {
+    if (cells[i] != NULL && cells[i]->GetMTime() > this->TopologyTime.GetMTime())
+      {
+      return false;
+      }
+    }
+  return true;
+}
+
+// Description:
+// Keep the nodes, their axes and their cells, and only fit the extents of the boxes to the
+// new points: the leaves to their triangles, then the internal nodes to the corners of the
+// boxes of their children. Returns false if the boxes fit the triangles much worse than after
+// the last build.
+bool vtkCollisionHierarchy::RefitHierarchy()
+{
+  vtkDebugMacro(<< "Refitting hierarchy");
+  vtkPolyData *input = this->DataSet;
+  vtkPoints *points = input->GetPoints();
+  std::vector<double> cellPoints(9*input->GetNumberOfCells());
+  vtkSmartPointer<vtkIdList> pointIds = vtkSmartPointer<vtkIdList>::New();
+  for (size_t i = 0; i < this->CellIds.size(); i++)
+    {
+    vtkIdType cellId = this->CellIds[i];
+    input->GetCellPoints(cellId, pointIds);
+    if (pointIds->GetNumberOfIds() < 3)
+      {
+      return false;
+      }
+    for (int j = 0; j < 3; j++)
+      {
+      points->GetPoint(pointIds->GetId(j), &cellPoints[9*cellId+3*j]);
+      }
+    }
+  this->BuildTriangleTable(&cellPoints[0]);
+
+  // The children of a node are always stored after it, so going backwards refits them first
+  const TriangleTable &table = this->Triangles;
+  for (vtkIdType nodeId = static_cast<vtkIdType>(this->Nodes.size()) - 1; nodeId >= 0; nodeId--)
+    {
+    Node &node = this->Nodes[nodeId];
+    double tMin[3] = {VTK_DOUBLE_MAX, VTK_DOUBLE_MAX, VTK_DOUBLE_MAX};
+    double tMax[3] = {-VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX};
+    if (node.Child < 0)
+      {
+      for (vtkIdType i = node.First; i < node.First + node.Count; i++)
+        {
+        for (int j = 0; j < 3; j++)
+          {
+          double x[3] = {table.Points[3*j][i], table.Points[3*j+1][i], table.Points[3*j+2][i]};
+          ExtendNodeExtents(node, x, tMin, tMax);
+          }
+        }
+      }
+    else
+      {
+      for (int c = 0; c < 2; c++)
+        {
+        const Node &child = this->Nodes[node.Child + c];
+        for (int corner = 0; corner < 8; corner++)
+          {
+          double x[3] = {child.Center[0], child.Center[1], child.Center[2]};
+          for (int i = 0; i < 3; i++)
+            {
+            double h = ((corner >> i) & 1) ? child.HalfExtents[i] : -child.HalfExtents[i];
+            for (int k = 0; k < 3; k++)
+              {
+              x[k] += h*child.Axes[i][k];
+              }
+            }
+          ExtendNodeExtents(node, x, tMin, tMax);
+          }
+        }
+      }
+    SetNodeExtents(node, tMin, tMax);
+    }
+
+  double quality = this->ComputeQuality();
+  vtkDebugMacro(<< "Refitted hierarchy quality " << quality << ", built " << this->BuildQuality);
+  return quality <= this->RefitThreshold * this->BuildQuality;
+}
+
+// Description:
+// Sum of the surface areas of the boxes, relative to the area of the root box, so that the
+// measure does not change when the data set is scaled.
+double vtkCollisionHierarchy::ComputeQuality()
+{
+  double total = 0.0;
+  for (size_t i = 0; i < this->Nodes.size(); i++)
+    {
+    const double *h = this->Nodes[i].HalfExtents;
+    total += 8.0*(h[0]*h[1] + h[1]*h[2] + h[2]*h[0]);
+    }
+  const double *h = this->Nodes[0].HalfExtents;
+  double rootArea = 8.0*(h[0]*h[1] + h[1]*h[2] + h[2]*h[0]);
+  return (rootArea > 0.0 ? total / rootArea : 0.0);
+}
+
+void vtkCollisionHierarchy::BuildTriangleTable(const double *cellPoints)
+{
+  vtkIdType numIds = static_cast<vtkIdType>(this->CellIds.size());
+  TriangleTable &table = this->Triangles;
+  for (int k = 0; k < 9; k++)
+    {
+    table.Points[k].resize(numIds);
+    }
+  for (int k = 0; k < 6; k++)
+    {
+    table.Bounds[k].resize(numIds);
+    }
+  for (int k = 0; k < 4; k++)
+    {
+    table.Plane[k].resize(numIds);
+    }
+
+  TriangleTableFunctor functor(table, &this->CellIds[0], cellPoints);
+  if (this->ParallelBuild && numIds >= CellsPerChunk)
+    {
+    vtkSMPTools::For(0, numIds, CellsPerChunk, functor);
+    }
+  else
+    {
+    functor(0, numIds);
+    }
+}
+
+void vtkCollisionHierarchy::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os,indent);
+
+  os << indent << "Data Set: " << this->DataSet << "\n";
+  os << indent << "Number of cells per Node: " << this->NumberOfCellsPerNode << "\n";
+  os << indent << "Max Level: " << this->MaxLevel << "\n";
+  os << indent << "Parallel Build: " << this->ParallelBuild << "\n";
+  os << indent << "Hierarchy Type: " << this->GetHierarchyTypeAsString() << "\n";
+  os << indent << "Refit Threshold: " << this->RefitThreshold << "\n";
+  os << indent << "Level: " << this->Level << "\n";
+  os << indent << "Number of Nodes: " << this->Nodes.size() << "\n";
+}
@@ -0,0 +1,242 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+// .NAME vtkCollisionHierarchy - flattened bounding box hierarchy of a triangle mesh
+// .SECTION Description
+// vtkCollisionHierarchy is the bounding volume hierarchy used by vtkCollisionDetectionFilter.
+// By default it is an oriented bounding box hierarchy built the same way as vtkOBBTree (area
+// weighted covariance of the triangles, split at the mean along the longest axis). It can also
+// be an axis aligned bounding box hierarchy split with the surface area heuristic, which is
+// cheaper to build but has looser boxes. In both cases the nodes are stored in one contiguous
+// array instead of being allocated one by one. The two children of a node are stored next to each other, and
+// instead of a vtkIdList of cells, each node references a range of a reordered cell id array,
+// so the cells of a subtree are contiguous in memory.
+//
+// The vertices, bounds and planes of the triangles are copied into a table in the same order
+// as the reordered cell ids, so the triangles of a leaf can be read without going through
+// vtkPolyData.
+//
+// The hierarchy is only rebuilt if the data set or the build parameters have been modified
+// since the last build. If only the points of the data set have moved, as for a deforming
+// mesh, the boxes are refitted to the new points instead: the nodes, their axes and their
+// cells are kept and only the extents of the boxes change. The hierarchy is rebuilt when the
+// refitted boxes fit the mesh too poorly, see SetRefitThreshold.
+
+// .SECTION Caveats
+// Only the first three points of each cell are used. Use vtkTriangleFilter to
+// convert any strips or polygons to triangles.
+
+// .SECTION See Also
+// vtkCollisionDetectionFilter, vtkOBBTree
+
+#ifndef __vtkCollisionHierarchy_h
+#define __vtkCollisionHierarchy_h
+
+#include "vtkObject.h"
+#include "vtkBioengConfigure.h" // Include configuration header.
+
+#include <vector>
+
+class vtkPolyData;
+
+class VTK_BIOENG_EXPORT vtkCollisionHierarchy : public vtkObject
+{
+public:
+  vtkTypeMacro(vtkCollisionHierarchy, vtkObject);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Constructs with initial values.
+  static vtkCollisionHierarchy *New();
+
+  enum HierarchyTypes
+  {
+    VTK_OBB_HIERARCHY = 0,
+    VTK_AABB_HIERARCHY = 1
+  };
+
+//BTX
+  // Description:
+  // A node of the hierarchy. The box is stored as center, unit axes (rows of Axes) and half
+  // extents along the axes. Leaves have Child = -1. The children of an internal node are
+  // at Child and Child+1, the root has Parent = -1. The cells of the node are
+  // CellIds[First] ... CellIds[First+Count-1].
+  struct Node
+    {
+    double Center[3];
+    double Axes[3][3];
+    double HalfExtents[3];
+    vtkIdType Parent;
+    vtkIdType Child;
+    vtkIdType First;
+    vtkIdType Count;
+    };
+
+  // Description:
+  // The triangles of the hierarchy in the order of the reordered cell ids, with one array per
+  // component. Points holds x, y, z of the first, second and third vertex, Bounds holds
+  // xmin, xmax, ymin, ymax, zmin, zmax, and Plane holds the unit normal n and the offset d
+  // of the plane n.x + d = 0.
+  struct TriangleTable
+    {
+    std::vector<double> Points[9];
+    std::vector<double> Bounds[6];
+    std::vector<double> Plane[4];
+    };
+//ETX
+
+  // Description:
+  // Set and Get the polydata the hierarchy is built for.
+  virtual void SetDataSet(vtkPolyData *dataSet);
+  vtkGetObjectMacro(DataSet, vtkPolyData);
+
+  // Description:
+  // Set and Get the maximum number of cells in a leaf node. Default is 2
+  vtkSetMacro(NumberOfCellsPerNode, int);
+  vtkGetMacro(NumberOfCellsPerNode, int);
+
+  // Description:
+  // Set and Get the maximum depth of the hierarchy. Default is 64
+  vtkSetMacro(MaxLevel, int);
+  vtkGetMacro(MaxLevel, int);
+
+  // Description:
+  // Set and Get the flag to build the hierarchy in parallel with vtkSMPTools. The hierarchy
+  // is the same as with a sequential build, only the order of the nodes differs. Default is 1
+  vtkSetMacro(ParallelBuild, int);
+  vtkGetMacro(ParallelBuild, int);
+  vtkBooleanMacro(ParallelBuild, int);
+
+  // Description:
+  // Set and Get the type of the boxes: oriented (VTK_OBB_HIERARCHY, the default) or axis
+  // aligned in the coordinate system of the data set (VTK_AABB_HIERARCHY). The axes of axis
+  // aligned nodes are the coordinate axes.
+  vtkSetClampMacro(HierarchyType, int, VTK_OBB_HIERARCHY, VTK_AABB_HIERARCHY);
+  vtkGetMacro(HierarchyType, int);
+  void SetHierarchyTypeToOBB() {this->SetHierarchyType(VTK_OBB_HIERARCHY);};
+  void SetHierarchyTypeToAABB() {this->SetHierarchyType(VTK_AABB_HIERARCHY);};
+  const char *GetHierarchyTypeAsString();
+
+  // Description:
+  // Set and Get the threshold of the refit quality. When only the points of the data set have
+  // been modified, the boxes are refitted, unless the sum of their areas relative to the area
+  // of the root grows by more than this factor since the last build, in which case the
+  // hierarchy is rebuilt. 0 always rebuilds. Default is 2
+  vtkSetClampMacro(RefitThreshold, double, 0.0, VTK_DOUBLE_MAX);
+  vtkGetMacro(RefitThreshold, double);
+
+  // Description:
+  // Build the hierarchy if the data set or the parameters have been modified since the last build.
+  void BuildHierarchy();
+
+  // Description:
+  // Free the hierarchy.
+  void Initialize();
+
+  // Description:
+  // Copy the nodes, the reordered cell ids, the triangle table and the parameters of
+  // hierarchy. The data set is not copied: set one with the same cells as the data set of
+  // hierarchy on this one first. The next BuildHierarchy then refits the copied boxes to its
+  // points, while hierarchy can still be used with the points it was fitted to.
+  void DeepCopy(vtkCollisionHierarchy *hierarchy);
+
+  // Description:
+  // Get the number of nodes. Node 0 is the root. Zero if the hierarchy is empty.
+  vtkIdType GetNumberOfNodes() {return static_cast<vtkIdType>(this->Nodes.size());}
+
+  // Description:
+  // Get the depth of the hierarchy (0 if it only contains the root).
+  vtkGetMacro(Level, int);
+
+//BTX
+  // Description:
+  // Direct access to the nodes and to the reordered cell ids
+  const Node *GetNodes() {return this->Nodes.empty() ? NULL : &this->Nodes[0];}
+  const vtkIdType *GetCellIds() {return this->CellIds.empty() ? NULL : &this->CellIds[0];}
+  const TriangleTable &GetTriangles() {return this->Triangles;}
+//ETX
+
+  // Description:
+  // Get the time of the last build or refit
+  unsigned long GetBuildTime() {return this->BuildTime.GetMTime();}
+
+  // Description:
+  // Get the time of the last build. The nodes and the reordered cell ids only change then,
+  // a refit only moves the boxes and the triangles.
+  unsigned long GetTopologyTime() {return this->TopologyTime.GetMTime();}
+
+protected:
+  vtkCollisionHierarchy();
+  ~vtkCollisionHierarchy();
+
+  // Description:
+  // Fill the triangle table from the cell vertices, in the order of the reordered cell ids.
+  void BuildTriangleTable(const double *cellPoints);
+
+  // Description:
+  // True if the cells of the data set are the same as at the last build.
+  bool IsTopologyUnchanged();
+
+  // Description:
+  // Fit the boxes to the moved points of the data set. Returns false if the hierarchy has to
+  // be rebuilt.
+  bool RefitHierarchy();
+
+  // Description:
+  // Sum of the areas of the boxes relative to the area of the root box.
+  double ComputeQuality();
+
+  vtkPolyData *DataSet;
+  int NumberOfCellsPerNode;
+  int MaxLevel;
+  int ParallelBuild;
+  int HierarchyType;
+  double RefitThreshold;
+  int Level;
+  double BuildQuality;
+  vtkIdType NumberOfBuildCells;
+  vtkIdType NumberOfBuildPoints;
+
+//BTX
+  std::vector<Node> Nodes;
+  std::vector<vtkIdType> CellIds;
+  TriangleTable Triangles;
+//ETX
+
+  vtkTimeStamp BuildTime;
+  vtkTimeStamp TopologyTime;
+
+private:
+  vtkCollisionHierarchy(const vtkCollisionHierarchy&);  // Not implemented.
+  void operator=(const vtkCollisionHierarchy&);  // Not implemented.
+};
+
+//BTX
+
+inline const char *vtkCollisionHierarchy::GetHierarchyTypeAsString(void)
+{
+  if ( this->HierarchyType == VTK_AABB_HIERARCHY )
+    {
+    return (char *)"AABB";
+    }
+  else
+    {
+    return (char *)"OBB";
+    }
+}
+
+//ETX
+#endif
@@ -0,0 +1,696 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+#include "vtkCollisionTriangleKernel.h"
+#include "vtkMath.h"
+
+#include <algorithm>
+#include <cmath>
+
+// The vectorized candidate search is only compiled for x86 processors. The functions using
+// AVX are compiled for AVX with a target attribute, so the rest of the library does not
+// require it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define COLLISION_KERNEL_X86
+# define COLLISION_KERNEL_TARGET_SSE2 __attribute__((target("sse2")))
+# define COLLISION_KERNEL_TARGET_AVX __attribute__((target("avx")))
+# include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+# define COLLISION_KERNEL_X86
+# define COLLISION_KERNEL_TARGET_SSE2
+# define COLLISION_KERNEL_TARGET_AVX
+# include <intrin.h>
+# include <immintrin.h>
+#endif
+
+namespace
+{
+typedef vtkIdType (*FindCandidatesFunction)(const double pts[9], const double bounds[6],
+  const double plane[4], const vtkCollisionHierarchy::TriangleTable &table,
+  vtkIdType first, vtkIdType count, double tolerance, vtkIdType *candidates);
+
+//----------------------------------------------------------------------------
+// Returns 1 if the three distances are all above tolerance or all below -tolerance
+inline int SameSide(const double d[3], double tolerance)
+{
+  return (d[0] > tolerance && d[1] > tolerance && d[2] > tolerance) ||
+    (d[0] < -tolerance && d[1] < -tolerance && d[2] < -tolerance);
+}
+
+// Scalar test of triangle j of the table, with the same arithmetic as the vectorized versions
+inline int RejectTriangle(const double pts[9], const double bounds[6], const double plane[4],
+  const vtkCollisionHierarchy::TriangleTable &table, vtkIdType j, double tolerance)
+{
+  for (int k = 0; k < 3; k++)
+    {
+    if (table.Bounds[2*k][j] > bounds[2*k+1] + tolerance ||
+      table.Bounds[2*k+1][j] < bounds[2*k] - tolerance)
+      {
+      return 1;
+      }
+    }
+
+  double d[3];
+  for (int v = 0; v < 3; v++)
+    {
+    d[v] = plane[0]*table.Points[3*v][j] + plane[1]*table.Points[3*v+1][j] +
+      plane[2]*table.Points[3*v+2][j] + plane[3];
+    }
+  if (SameSide(d, tolerance))
+    {
+    return 1;
+    }
+
+  for (int v = 0; v < 3; v++)
+    {
+    d[v] = table.Plane[0][j]*pts[3*v] + table.Plane[1][j]*pts[3*v+1] +
+      table.Plane[2][j]*pts[3*v+2] + table.Plane[3][j];
+    }
+  return SameSide(d, tolerance);
+}
+
+vtkIdType FindCandidatesScalar(const double pts[9], const double bounds[6],
+  const double plane[4], const vtkCollisionHierarchy::TriangleTable &table,
+  vtkIdType first, vtkIdType count, double tolerance, vtkIdType *candidates)
+{
+  vtkIdType numCandidates = 0;
+  for (vtkIdType j = first; j < first + count; j++)
+    {
+    if (!RejectTriangle(pts, bounds, plane, table, j, tolerance))
+      {
+      candidates[numCandidates++] = j;
+      }
+    }
+  return numCandidates;
+}
+
+#ifdef COLLISION_KERNEL_X86
+//----------------------------------------------------------------------------
+COLLISION_KERNEL_TARGET_SSE2
+vtkIdType FindCandidatesSSE2(const double pts[9], const double bounds[6],
+  const double plane[4], const vtkCollisionHierarchy::TriangleTable &table,
+  vtkIdType first, vtkIdType count, double tolerance, vtkIdType *candidates)
+{
+  const __m128d tol = _mm_set1_pd(tolerance);
+  const __m128d negTol = _mm_set1_pd(-tolerance);
+  vtkIdType numCandidates = 0;
+  vtkIdType j = first;
+  vtkIdType end = first + count;
+  for (; j + 2 <= end; j += 2)
+    {
+    // Bounds
+    __m128d overlap = _mm_cmpeq_pd(tol, tol);
+    for (int k = 0; k < 3; k++)
+      {
+      overlap = _mm_and_pd(overlap, _mm_cmple_pd(_mm_loadu_pd(&table.Bounds[2*k][j]),
+        _mm_set1_pd(bounds[2*k+1] + tolerance)));
+      overlap = _mm_and_pd(overlap, _mm_cmpge_pd(_mm_loadu_pd(&table.Bounds[2*k+1][j]),
+        _mm_set1_pd(bounds[2*k] - tolerance)));
+      }
+    if (_mm_movemask_pd(overlap) == 0)
+      {
+      continue;
+      }
+
+    // Vertices of the batch against the plane of the triangle
+    __m128d above = overlap;
+    __m128d below = overlap;
+    for (int v = 0; v < 3; v++)
+      {
+      __m128d d = _mm_add_pd(_mm_add_pd(_mm_add_pd(
+        _mm_mul_pd(_mm_set1_pd(plane[0]), _mm_loadu_pd(&table.Points[3*v][j])),
+        _mm_mul_pd(_mm_set1_pd(plane[1]), _mm_loadu_pd(&table.Points[3*v+1][j]))),
+        _mm_mul_pd(_mm_set1_pd(plane[2]), _mm_loadu_pd(&table.Points[3*v+2][j]))),
+        _mm_set1_pd(plane[3]));
+      above = _mm_and_pd(above, _mm_cmpgt_pd(d, tol));
+      below = _mm_and_pd(below, _mm_cmplt_pd(d, negTol));
+      }
+    overlap = _mm_andnot_pd(_mm_or_pd(above, below), overlap);
+
+    // Vertices of the triangle against the planes of the batch
+    const __m128d n0 = _mm_loadu_pd(&table.Plane[0][j]);
+    const __m128d n1 = _mm_loadu_pd(&table.Plane[1][j]);
+    const __m128d n2 = _mm_loadu_pd(&table.Plane[2][j]);
+    const __m128d n3 = _mm_loadu_pd(&table.Plane[3][j]);
+    above = overlap;
+    below = overlap;
+    for (int v = 0; v < 3; v++)
+      {
+      __m128d d = _mm_add_pd(_mm_add_pd(_mm_add_pd(
+        _mm_mul_pd(n0, _mm_set1_pd(pts[3*v])),
+        _mm_mul_pd(n1, _mm_set1_pd(pts[3*v+1]))),
+        _mm_mul_pd(n2, _mm_set1_pd(pts[3*v+2]))), n3);
+      above = _mm_and_pd(above, _mm_cmpgt_pd(d, tol));
+      below = _mm_and_pd(below, _mm_cmplt_pd(d, negTol));
+      }
+    int mask = _mm_movemask_pd(_mm_andnot_pd(_mm_or_pd(above, below), overlap));
+    for (int lane = 0; lane < 2; lane++)
+      {
+      if (mask & (1 << lane))
+        {
+        candidates[numCandidates++] = j + lane;
+        }
+      }
+    }
+
+  return numCandidates + FindCandidatesScalar(pts, bounds, plane, table, j, end - j,
+    tolerance, candidates + numCandidates);
+}
+
+//----------------------------------------------------------------------------
+COLLISION_KERNEL_TARGET_AVX
+vtkIdType FindCandidatesAVX(const double pts[9], const double bounds[6],
+  const double plane[4], const vtkCollisionHierarchy::TriangleTable &table,
+  vtkIdType first, vtkIdType count, double tolerance, vtkIdType *candidates)
+{
+  const __m256d tol = _mm256_set1_pd(tolerance);
+  const __m256d negTol = _mm256_set1_pd(-tolerance);
+  vtkIdType numCandidates = 0;
+  vtkIdType j = first;
+  vtkIdType end = first + count;
+  for (; j + 4 <= end; j += 4)
+    {
+    // Bounds
+    __m256d overlap = _mm256_cmp_pd(tol, tol, _CMP_EQ_OQ);
+    for (int k = 0; k < 3; k++)
+      {
+      overlap = _mm256_and_pd(overlap, _mm256_cmp_pd(_mm256_loadu_pd(&table.Bounds[2*k][j]),
+        _mm256_set1_pd(bounds[2*k+1] + tolerance), _CMP_LE_OQ));
+      overlap = _mm256_and_pd(overlap, _mm256_cmp_pd(_mm256_loadu_pd(&table.Bounds[2*k+1][j]),
+        _mm256_set1_pd(bounds[2*k] - tolerance), _CMP_GE_OQ));
+      }
+    if (_mm256_movemask_pd(overlap) == 0)
+      {
+      continue;
+      }
+
+    // Vertices of the batch against the plane of the triangle
+    __m256d above = overlap;
+    __m256d below = overlap;
+    for (int v = 0; v < 3; v++)
+      {
+      __m256d d = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(
+        _mm256_mul_pd(_mm256_set1_pd(plane[0]), _mm256_loadu_pd(&table.Points[3*v][j])),
+        _mm256_mul_pd(_mm256_set1_pd(plane[1]), _mm256_loadu_pd(&table.Points[3*v+1][j]))),
+        _mm256_mul_pd(_mm256_set1_pd(plane[2]), _mm256_loadu_pd(&table.Points[3*v+2][j]))),
+        _mm256_set1_pd(plane[3]));
+      above = _mm256_and_pd(above, _mm256_cmp_pd(d, tol, _CMP_GT_OQ));
+      below = _mm256_and_pd(below, _mm256_cmp_pd(d, negTol, _CMP_LT_OQ));
+      }
+    overlap = _mm256_andnot_pd(_mm256_or_pd(above, below), overlap);
+
+    // Vertices of the triangle against the planes of the batch
+    const __m256d n0 = _mm256_loadu_pd(&table.Plane[0][j]);
+    const __m256d n1 = _mm256_loadu_pd(&table.Plane[1][j]);
+    const __m256d n2 = _mm256_loadu_pd(&table.Plane[2][j]);
+    const __m256d n3 = _mm256_loadu_pd(&table.Plane[3][j]);
+    above = overlap;
+    below = overlap;
+    for (int v = 0; v < 3; v++)
+      {
+      __m256d d = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(
+        _mm256_mul_pd(n0, _mm256_set1_pd(pts[3*v])),
+        _mm256_mul_pd(n1, _mm256_set1_pd(pts[3*v+1]))),
+        _mm256_mul_pd(n2, _mm256_set1_pd(pts[3*v+2]))), n3);
+      above = _mm256_and_pd(above, _mm256_cmp_pd(d, tol, _CMP_GT_OQ));
+      below = _mm256_and_pd(below, _mm256_cmp_pd(d, negTol, _CMP_LT_OQ));
+      }
+    int mask = _mm256_movemask_pd(_mm256_andnot_pd(_mm256_or_pd(above, below), overlap));
+    for (int lane = 0; lane < 4; lane++)
+      {
+      if (mask & (1 << lane))
+        {
+        candidates[numCandidates++] = j + lane;
+        }
+      }
+    }
+
+  return numCandidates + FindCandidatesScalar(pts, bounds, plane, table, j, end - j,
+    tolerance, candidates + numCandidates);
+}
+#endif
+
+//----------------------------------------------------------------------------
+FindCandidatesFunction SelectFindCandidates(int instructionSet)
+{
+#ifdef COLLISION_KERNEL_X86
+  if (instructionSet == vtkCollisionTriangleKernel::AVX)
+    {
+    return FindCandidatesAVX;
+    }
+  if (instructionSet == vtkCollisionTriangleKernel::SSE2)
+    {
+    return FindCandidatesSSE2;
+    }
+#endif
+  (void)instructionSet;
+  return FindCandidatesScalar;
+}
+
+int DetectInstructionSet()
+{
+#if defined(COLLISION_KERNEL_X86) && defined(__GNUC__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx"))
+    {
+    return vtkCollisionTriangleKernel::AVX;
+    }
+  if (__builtin_cpu_supports("sse2"))
+    {
+    return vtkCollisionTriangleKernel::SSE2;
+    }
+#elif defined(COLLISION_KERNEL_X86) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  // AVX also needs the operating system to save the AVX registers
+  if ((info[2] & (1 << 28)) && (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6)
+    {
+    return vtkCollisionTriangleKernel::AVX;
+    }
+  if (info[3] & (1 << 26))
+    {
+    return vtkCollisionTriangleKernel::SSE2;
+    }
+#endif
+  return vtkCollisionTriangleKernel::SCALAR;
+}
+
+// Only written during the static initialization of the library, the threads only read it
+const int SupportedInstructionSet = DetectInstructionSet();
+
+//----------------------------------------------------------------------------
+// End points of the segment where a triangle with vertices v and signed distances d to the
+// plane of the other triangle crosses that plane. side holds the signs of d, with 0 for the
+// vertices on the plane, and at least one of them is not 0.
+void PlaneCrossing(const double *v, const double d[3], const int side[3], double a0[3], double a1[3])
+{
+  // The vertex alone on its side of the plane
+  int alone;
+  if (side[0]*side[1] > 0)
+    {
+    alone = 2;
+    }
+  else if (side[0]*side[2] > 0)
+    {
+    alone = 1;
+    }
+  else if (side[1]*side[2] > 0)
+    {
+    alone = 0;
+    }
+  else
+    {
+    alone = (side[0] != 0 ? 0 : (side[1] != 0 ? 1 : 2));
+    }
+
+  const double *p = v + 3*alone;
+  double *a[2] = {a0, a1};
+  for (int i = 0; i < 2; i++)
+    {
+    int other = (alone + 1 + i) % 3;
+    const double *q = v + 3*other;
+    if (side[other] == 0)
+      {
+      a[i][0] = q[0];
+      a[i][1] = q[1];
+      a[i][2] = q[2];
+      continue;
+      }
+    double t = d[alone] / (d[alone] - d[other]);
+    for (int k = 0; k < 3; k++)
+      {
+      a[i][k] = p[k] + t*(q[k] - p[k]);
+      }
+    }
+}
+
+// Orientation of c with respect to the line ab in the projection plane
+inline double Orient2D(const double *a, const double *b, const double *c, int i, int j)
+{
+  return (b[i]-a[i])*(c[j]-a[j]) - (b[j]-a[j])*(c[i]-a[i]);
+}
+
+// Returns 1 if x is inside or on the boundary of the projected triangle t
+inline int PointInTriangle2D(const double *x, const double *t, int i, int j)
+{
+  double o0 = Orient2D(t, t+3, x, i, j);
+  double o1 = Orient2D(t+3, t+6, x, i, j);
+  double o2 = Orient2D(t+6, t, x, i, j);
+  return (o0 >= 0.0 && o1 >= 0.0 && o2 >= 0.0) || (o0 <= 0.0 && o1 <= 0.0 && o2 <= 0.0);
+}
+
+// Add x to the points found, returns 1 when two points have been found
+inline int AddPoint(const double *x, int &numPoints, double *points[2])
+{
+  points[numPoints][0] = x[0];
+  points[numPoints][1] = x[1];
+  points[numPoints][2] = x[2];
+  return ++numPoints == 2;
+}
+
+// Intersection of two triangles in the same plane, projected along the largest component of
+// the normal. Edge crossings are reported first, then the vertices inside the other triangle.
+int IntersectCoplanar(const double p[9], const double q[9], const double normal[3],
+  double x1[3], double x2[3])
+{
+  int i = 1, j = 2;
+  double nx = fabs(normal[0]), ny = fabs(normal[1]), nz = fabs(normal[2]);
+  if (ny > nx && ny >= nz)
+    {
+    i = 0;
+    j = 2;
+    }
+  else if (nz > nx && nz > ny)
+    {
+    i = 0;
+    j = 1;
+    }
+
+  double *points[2] = {x1, x2};
+  int numPoints = 0;
+  for (int e = 0; e < 3; e++)
+    {
+    const double *a = p + 3*e;
+    const double *b = p + 3*((e+1)%3);
+    for (int f = 0; f < 3; f++)
+      {
+      const double *c = q + 3*f;
+      const double *d = q + 3*((f+1)%3);
+      double d1 = Orient2D(c, d, a, i, j);
+      double d2 = Orient2D(c, d, b, i, j);
+      double d3 = Orient2D(a, b, c, i, j);
+      double d4 = Orient2D(a, b, d, i, j);
+      if (d1*d2 > 0.0 || d3*d4 > 0.0 || d1 == d2)
+        {
+        // Disjoint or collinear, collinear overlaps are found with the vertices below
+        continue;
+        }
+      double t = d1 / (d1 - d2);
+      double x[3] = {a[0] + t*(b[0]-a[0]), a[1] + t*(b[1]-a[1]), a[2] + t*(b[2]-a[2])};
+      if (AddPoint(x, numPoints, points))
+        {
+        return 1;
+        }
+      }
+    }
+
+  for (int v = 0; v < 3; v++)
+    {
+    if (PointInTriangle2D(p + 3*v, q, i, j) && AddPoint(p + 3*v, numPoints, points))
+      {
+      return 1;
+      }
+    }
+  for (int v = 0; v < 3; v++)
+    {
+    if (PointInTriangle2D(q + 3*v, p, i, j) && AddPoint(q + 3*v, numPoints, points))
+      {
+      return 1;
+      }
+    }
+
+  if (numPoints == 1)
+    {
+    x2[0] = x1[0];
+    x2[1] = x1[1];
+    x2[2] = x1[2];
+    return 1;
+    }
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+// Closest points of the segments p0p1 and q0q1, returns the squared distance
+double ClosestPointsOnSegments(const double *p0, const double *p1, const double *q0,
+  const double *q1, double cp[3], double cq[3])
+{
+  double d1[3], d2[3], r[3];
+  vtkMath::Subtract(p1, p0, d1);
+  vtkMath::Subtract(q1, q0, d2);
+  vtkMath::Subtract(p0, q0, r);
+  double a = vtkMath::Dot(d1, d1);
+  double e = vtkMath::Dot(d2, d2);
+  double f = vtkMath::Dot(d2, r);
+  double s = 0.0, t = 0.0;
+  if (a <= 0.0 && e <= 0.0)
+    {
+    // Both segments are points
+    }
+  else if (a <= 0.0)
+    {
+    t = std::min(std::max(f/e, 0.0), 1.0);
+    }
+  else
+    {
+    double c = vtkMath::Dot(d1, r);
+    if (e <= 0.0)
+      {
+      s = std::min(std::max(-c/a, 0.0), 1.0);
+      }
+    else
+      {
+      double b = vtkMath::Dot(d1, d2);
+      double denom = a*e - b*b;
+      // Parallel segments: any s will do, take 0
+      s = (denom > 0.0 ? std::min(std::max((b*f - c*e)/denom, 0.0), 1.0) : 0.0);
+      t = (b*s + f)/e;
+      if (t < 0.0)
+        {
+        t = 0.0;
+        s = std::min(std::max(-c/a, 0.0), 1.0);
+        }
+      else if (t > 1.0)
+        {
+        t = 1.0;
+        s = std::min(std::max((b - c)/a, 0.0), 1.0);
+        }
+      }
+    }
+  for (int k = 0; k < 3; k++)
+    {
+    cp[k] = p0[k] + s*d1[k];
+    cq[k] = q0[k] + t*d2[k];
+    }
+  return vtkMath::Distance2BetweenPoints(cp, cq);
+}
+
+// Closest point of the triangle t to the point x, returns the squared distance
+double ClosestPointOnTriangle(const double *x, const double *t, double closest[3])
+{
+  const double *a = t;
+  const double *b = t + 3;
+  const double *c = t + 6;
+  double ab[3], ac[3], ax[3], bx[3], cx[3];
+  vtkMath::Subtract(b, a, ab);
+  vtkMath::Subtract(c, a, ac);
+  vtkMath::Subtract(x, a, ax);
+  vtkMath::Subtract(x, b, bx);
+  vtkMath::Subtract(x, c, cx);
+  double d1 = vtkMath::Dot(ab, ax);
+  double d2 = vtkMath::Dot(ac, ax);
+  double d3 = vtkMath::Dot(ab, bx);
+  double d4 = vtkMath::Dot(ac, bx);
+  double d5 = vtkMath::Dot(ab, cx);
+  double d6 = vtkMath::Dot(ac, cx);
+  double va = d3*d6 - d5*d4;
+  double vb = d5*d2 - d1*d6;
+  double vc = d1*d4 - d3*d2;
+
+  double u = 0.0, v = 0.0;
+  if (d1 <= 0.0 && d2 <= 0.0)
+    {
+    // Vertex a
+    }
+  else if (d3 >= 0.0 && d4 <= d3)
+    {
+    u = 1.0;
+    }
+  else if (d6 >= 0.0 && d5 <= d6)
+    {
+    v = 1.0;
+    }
+  else if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0)
+    {
+    u = d1/(d1 - d3);
+    }
+  else if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0)
+    {
+    v = d2/(d2 - d6);
+    }
+  else if (va <= 0.0 && (d4 - d3) >= 0.0 && (d5 - d6) >= 0.0)
+    {
+    double w = (d4 - d3)/((d4 - d3) + (d5 - d6));
+    u = 1.0 - w;
+    v = w;
+    }
+  else
+    {
+    // Inside the face
+    double denom = 1.0/(va + vb + vc);
+    u = vb*denom;
+    v = vc*denom;
+    }
+  for (int k = 0; k < 3; k++)
+    {
+    closest[k] = a[k] + u*ab[k] + v*ac[k];
+    }
+  return vtkMath::Distance2BetweenPoints(x, closest);
+}
+}
+
+//----------------------------------------------------------------------------
+int vtkCollisionTriangleKernel::GetSupportedInstructionSet()
+{
+  return SupportedInstructionSet;
+}
+
+int vtkCollisionTriangleKernel::ClampInstructionSet(int instructionSet)
+{
+  return (instructionSet < SCALAR ? SCALAR :
+    (instructionSet > SupportedInstructionSet ? SupportedInstructionSet : instructionSet));
+}
+
+//----------------------------------------------------------------------------
+vtkIdType vtkCollisionTriangleKernel::FindCandidates(const double pts[9], const double bounds[6],
+  const double plane[4], const vtkCollisionHierarchy::TriangleTable &table,
+  vtkIdType first, vtkIdType count, double tolerance, vtkIdType *candidates,
+  int instructionSet)
+{
+  return SelectFindCandidates(ClampInstructionSet(instructionSet))(pts, bounds, plane, table,
+    first, count, tolerance, candidates);
+}
+
+//----------------------------------------------------------------------------
+int vtkCollisionTriangleKernel::IntersectTriangles(const double p[9], const double planeP[4],
+  const double q[9], const double planeQ[4], double tolerance, double x1[3], double x2[3])
+{
+  // Signed distances of the vertices to the plane of the other triangle
+  double dp[3], dq[3];
+  int sideP[3], sideQ[3];
+  for (int v = 0; v < 3; v++)
+    {
+    dq[v] = planeP[0]*q[3*v] + planeP[1]*q[3*v+1] + planeP[2]*q[3*v+2] + planeP[3];
+    dp[v] = planeQ[0]*p[3*v] + planeQ[1]*p[3*v+1] + planeQ[2]*p[3*v+2] + planeQ[3];
+    sideQ[v] = (dq[v] > tolerance ? 1 : (dq[v] < -tolerance ? -1 : 0));
+    sideP[v] = (dp[v] > tolerance ? 1 : (dp[v] < -tolerance ? -1 : 0));
+    }
+  if (SameSide(dq, tolerance) || SameSide(dp, tolerance))
+    {
+    return 0;
+    }
+
+  // Direction of the line where the planes meet
+  double direction[3];
+  vtkMath::Cross(planeP, planeQ, direction);
+  double length2 = vtkMath::Dot(direction, direction);
+
+  bool pOnPlane = (sideP[0] == 0 && sideP[1] == 0 && sideP[2] == 0);
+  bool qOnPlane = (sideQ[0] == 0 && sideQ[1] == 0 && sideQ[2] == 0);
+  if (pOnPlane || qOnPlane || length2 < 1e-24)
+    {
+    return IntersectCoplanar(p, q, pOnPlane ? planeQ : planeP, x1, x2);
+    }
+
+  // Segments where each triangle crosses the plane of the other, and their intervals on the line
+  double a0[3], a1[3], b0[3], b1[3];
+  PlaneCrossing(p, dp, sideP, a0, a1);
+  PlaneCrossing(q, dq, sideQ, b0, b1);
+  double *a[2] = {a0, a1};
+  double *b[2] = {b0, b1};
+  double ta[2] = {vtkMath::Dot(direction, a0), vtkMath::Dot(direction, a1)};
+  double tb[2] = {vtkMath::Dot(direction, b0), vtkMath::Dot(direction, b1)};
+  if (ta[0] > ta[1])
+    {
+    std::swap(ta[0], ta[1]);
+    std::swap(a[0], a[1]);
+    }
+  if (tb[0] > tb[1])
+    {
+    std::swap(tb[0], tb[1]);
+    std::swap(b[0], b[1]);
+    }
+
+  // The intervals are scaled by the length of direction
+  if (ta[0] > tb[1] + tolerance*sqrt(length2) || tb[0] > ta[1] + tolerance*sqrt(length2))
+    {
+    return 0;
+    }
+
+  const double *start = (ta[0] > tb[0] ? a[0] : b[0]);
+  const double *end = (ta[1] < tb[1] ? a[1] : b[1]);
+  if ((ta[0] > tb[0] ? ta[0] : tb[0]) > (ta[1] < tb[1] ? ta[1] : tb[1]))
+    {
+    // Within the tolerance but not overlapping, the triangles touch
+    end = start;
+    }
+  for (int k = 0; k < 3; k++)
+    {
+    x1[k] = start[k];
+    x2[k] = end[k];
+    }
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+double vtkCollisionTriangleKernel::DistanceBetweenTriangles(const double p[9],
+  const double planeP[4], const double q[9], const double planeQ[4],
+  double closestP[3], double closestQ[3])
+{
+  double x2[3];
+  if (IntersectTriangles(p, planeP, q, planeQ, 0.0, closestP, x2))
+    {
+    closestQ[0] = closestP[0];
+    closestQ[1] = closestP[1];
+    closestQ[2] = closestP[2];
+    return 0.0;
+    }
+
+  // The closest points of disjoint triangles are on two edges, or a vertex and a face
+  double minDistance2 = VTK_DOUBLE_MAX;
+  double cp[3], cq[3];
+  for (int e = 0; e < 3; e++)
+    {
+    for (int f = 0; f < 3; f++)
+      {
+      double distance2 = ClosestPointsOnSegments(p + 3*e, p + 3*((e+1)%3),
+        q + 3*f, q + 3*((f+1)%3), cp, cq);
+      if (distance2 < minDistance2)
+        {
+        minDistance2 = distance2;
+        std::copy(cp, cp+3, closestP);
+        std::copy(cq, cq+3, closestQ);
+        }
+      }
+    }
+  for (int v = 0; v < 3; v++)
+    {
+    double distance2 = ClosestPointOnTriangle(p + 3*v, q, cq);
+    if (distance2 < minDistance2)
+      {
+      minDistance2 = distance2;
+      std::copy(p + 3*v, p + 3*v + 3, closestP);
+      std::copy(cq, cq+3, closestQ);
+      }
+    distance2 = ClosestPointOnTriangle(q + 3*v, p, cp);
+    if (distance2 < minDistance2)
+      {
+      minDistance2 = distance2;
+      std::copy(cp, cp+3, closestP);
+      std::copy(q + 3*v, q + 3*v + 3, closestQ);
+      }
+    }
+  return sqrt(minDistance2);
+}
@@ -0,0 +1,95 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+// .NAME vtkCollisionTriangleKernel - triangle-triangle intersection tests of vtkCollisionDetectionFilter
+// .SECTION Description
+// vtkCollisionTriangleKernel tests one triangle against a batch of triangles stored in a
+// vtkCollisionHierarchy::TriangleTable, in two stages:
+//
+// FindCandidates rejects the triangles of the batch whose bounds do not overlap the bounds of
+// the triangle, or which are entirely on one side of the plane of the other triangle (the
+// first two steps of the Moller test). Several triangles of the batch are tested at once with
+// SSE2 or AVX instructions if the processor supports them. The caller selects the instruction
+// set for each call, there is no global state, so the kernel can be used by several threads
+// with different instruction sets.
+//
+// IntersectTriangles is the exact test of one pair: it intersects the two triangles with the
+// line where their planes meet and returns the end points of the common segment.
+//
+// DistanceBetweenTriangles returns the distance between two triangles and their closest points.
+//
+// All the coordinates must be in the same coordinate system.
+
+// .SECTION See Also
+// vtkCollisionDetectionFilter, vtkCollisionHierarchy
+
+#ifndef __vtkCollisionTriangleKernel_h
+#define __vtkCollisionTriangleKernel_h
+
+#include "vtkCollisionHierarchy.h"
+#include "vtkBioengConfigure.h" // Include configuration header.
+
+class VTK_BIOENG_EXPORT vtkCollisionTriangleKernel
+{
+public:
+//BTX
+  enum InstructionSet
+    {
+    SCALAR = 0,
+    SSE2 = 1,
+    AVX = 2
+    };
+//ETX
+
+  // Description:
+  // Find the triangles first ... first+count-1 of table that may intersect the triangle
+  // with vertices pts (x, y, z of the three vertices), bounds and plane (unit normal and
+  // offset), with the instructions of instructionSet, see ClampInstructionSet. The indices of
+  // the candidates are written to candidates, which must have room for count values. Returns
+  // the number of candidates.
+  static vtkIdType FindCandidates(const double pts[9], const double bounds[6],
+    const double plane[4], const vtkCollisionHierarchy::TriangleTable &table,
+    vtkIdType first, vtkIdType count, double tolerance, vtkIdType *candidates,
+    int instructionSet);
+
+  // Description:
+  // Intersect the triangles p and q with planes planeP and planeQ. Returns 1 if they
+  // intersect, and the end points of the intersection segment in x1 and x2 (equal if the
+  // triangles only touch), 0 otherwise. Vertices closer than tolerance to the plane of the
+  // other triangle are considered to be on the plane.
+  static int IntersectTriangles(const double p[9], const double planeP[4],
+    const double q[9], const double planeQ[4], double tolerance, double x1[3], double x2[3]);
+
+  // Description:
+  // Return the distance between the triangles p and q with planes planeP and planeQ, and the
+  // closest points of the two triangles in closestP and closestQ. The distance is 0 if the
+  // triangles intersect.
+  static double DistanceBetweenTriangles(const double p[9], const double planeP[4],
+    const double q[9], const double planeQ[4], double closestP[3], double closestQ[3]);
+
+  // Description:
+  // Return the best instruction set supported by the processor. It is detected once, when
+  // the library is loaded.
+  static int GetSupportedInstructionSet();
+
+  // Description:
+  // Return the instruction set that FindCandidates uses when instructionSet is requested:
+  // an instruction set that the processor does not support is replaced by the best one that
+  // it supports.
+  static int ClampInstructionSet(int instructionSet);
+};
+
+#endif
@@ -20,6 +20,7 @@
 
 // vtkbioeng includes
 #include "vtkCollisionDetectionFilter.h"
+#include "vtkCollisionHierarchy.h"
 
 // MRML includes
 #include "vtkMRMLCollisionWarningNode.h"
@@ -31,15 +32,1026 @@
 // VTK includes
 #include <vtkGeneralTransform.h>
 #include <vtkImplicitPolyDataDistance.h>
+#include <vtkAtomicInt.h>
+#include <vtkConditionVariable.h>
+#include <vtkMath.h>
+#include <vtkMatrix4x4.h>
+#include <vtkMatrixToLinearTransform.h>
+#include <vtkMultiThreader.h>
+#include <vtkMutexLock.h>
 #include <vtkNew.h>
 #include <vtkObjectFactory.h>
 #include <vtkPolyData.h>
 #include <vtkSmartPointer.h>
+#include <vtkTimerLog.h>
 #include <vtkTransformPolyDataFilter.h>
 #include <vtkTriangleFilter.h>
 
 // STD includes
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
 
+//------------------------------------------------------------------------------
+class vtkSlicerCollisionWarningLogic::vtkInternal
+{
+public:
+  vtkInternal();
+  ~vtkInternal();
+
+  /// Triangulation and hierarchy build of a model, or refit of its hierarchy, running on a worker thread. The worker
+  /// only accesses the job, the main thread accesses it again once Done is set.
+  struct BuildJob
+  {
+    /// Copy of the model polydata, so that the model can be modified during the build. NULL for a refit.
+    vtkSmartPointer< vtkPolyData > Body;
+    /// Triangles of the build. For a refit, set on the main thread: they share the cells of the triangles of the
+    /// model and have a copy of its moved points.
+    vtkSmartPointer< vtkPolyData > Triangles;
+    vtkSmartPointer< vtkCollisionHierarchy > Hierarchy;
+    /// Hierarchy of the model that the hierarchy of a refit is copied from, NULL for a build
+    vtkSmartPointer< vtkCollisionHierarchy > RefittedHierarchy;
+    /// MTime of the model polydata when it was copied, and its number of points and MTime of its cells
+    unsigned long BodyMTime;
+    vtkIdType NumberOfPoints;
+    unsigned long CellsMTime;
+    int NumberOfCellsPerNode;
+    int HierarchyType;
+    int ThreadId;
+    vtkAtomicInt< int > Done;
+  };
+
+  /// Triangulated model polydata and its collision hierarchy. Each model is triangulated and its hierarchy is built
+  /// only once, however many module nodes watch it. They are built in the background when the model is first used
+  /// and after it is modified. Ready is false until the first build has finished. While a later build runs, the
+  /// collisions are computed with the result of the last finished build, which is replaced when the new one finishes.
+  /// If only the points of the model have moved, as for a deforming model, a copy of the hierarchy is refitted to a
+  /// copy of the moved points instead, in the background as well.
+  struct SharedModel
+  {
+    SharedModel();
+    vtkSmartPointer< vtkPolyData > Body;
+    vtkSmartPointer< vtkPolyData > Triangles;
+    vtkSmartPointer< vtkCollisionHierarchy > Hierarchy;
+    bool Ready;
+    /// MTime of the model polydata when the last build was started
+    unsigned long BuildMTime;
+    /// MTime of the model polydata that Triangles and Hierarchy have been built from, and its number of points and
+    /// MTime of its cells when they were triangulated
+    unsigned long TrianglesMTime;
+    vtkIdType TrianglesNumberOfPoints;
+    unsigned long TrianglesCellsMTime;
+    /// Bounds of the triangles, computed on the main thread when they are built or refitted. The shallow copies of
+    /// the pipelines share the points of the triangles, whose bounds the workers would otherwise compute concurrently.
+    double Bounds[6];
+    BuildJob* Job;
+    /// Number of pipeline inputs that use the model
+    int ReferenceCount;
+  };
+
+  /// Shared models are keyed by the model polydata and the parameters of the hierarchy, which the filters that share
+  /// it do not change. The hierarchy is rebuilt when the polydata is modified.
+  struct SharedModelKey
+  {
+    SharedModelKey( vtkPolyData* body = NULL, int numberOfCellsPerNode = 0, int hierarchyType = 0 );
+    bool operator<( const SharedModelKey& other ) const;
+    bool operator==( const SharedModelKey& other ) const;
+    bool operator!=( const SharedModelKey& other ) const { return !( *this == other ); }
+    vtkPolyData* Body;
+    int NumberOfCellsPerNode;
+    int HierarchyType;
+  };
+  typedef std::map< SharedModelKey, SharedModel > SharedModelMapType;
+  SharedModelMapType SharedModels;
+
+  /// Snapshot of the inputs of a collision computation, taken on the main thread from the MRML nodes, so that the
+  /// worker thread never accesses them
+  struct CollisionRequest
+  {
+    vtkSmartPointer< vtkPolyData > Triangles[2];
+    vtkSmartPointer< vtkCollisionHierarchy > Hierarchy[2];
+    /// Bounds of the triangles, from the shared models
+    double Bounds[2][6];
+    double BodyToRasMatrix[2][16];
+    /// Copy of the body to RAS transform if it is not linear, NULL otherwise
+    vtkSmartPointer< vtkGeneralTransform > BodyToRasTransform[2];
+    /// Largest distance between the models that is computed exactly
+    double MaximumDistance;
+  };
+
+  /// Result of the collision computation of a module node
+  struct CollisionResult
+  {
+    CollisionResult();
+    double Distance;
+    bool Collision;
+    int NumberOfContacts;
+    /// Closest points of the two models in the coordinate system of the first model, or in RAS if its transform is not
+    /// linear. They are the same point if the models collide.
+    bool HasClosestPoints;
+    double ClosestPoints[6];
+  };
+
+  /// Results published by the worker thread to the main thread, without locking. It is a triple buffer: the worker
+  /// writes the whole result, with the closest points, in a slot that the main thread does not read, then publishes
+  /// the slot with its version in one atomic store. The main thread marks the slot that it reads before copying it,
+  /// and the worker writes its next result in the third slot. Only the latest result is kept.
+  class ResultBuffer
+  {
+  public:
+    ResultBuffer();
+    /// Called by the worker that computes the pipeline only, the workers of a pipeline publish one after the other
+    void Publish( const CollisionResult& result );
+    /// Called by the main thread only. Copies the latest result if its version is not the given one, and sets
+    /// version to its version. Returns false if there is no newer result.
+    bool Read( int& version, CollisionResult& result );
+  private:
+    CollisionResult Slots[3];
+    /// Version of the latest result times 4 plus its slot, 0 before the first result. Stored by the worker only.
+    vtkAtomicInt< int > Latest;
+    /// Slot read by the main thread, which the worker does not write. Stored by the main thread only.
+    vtkAtomicInt< int > Reading;
+    /// Slot written by the worker and version of its latest result, only accessed by the worker
+    int Writing;
+    int Version;
+  };
+
+  /// Collision detection pipeline of one module node. Model polydata -> triangle filter -> collision detection.
+  /// Linear model to RAS transforms are passed to the collision detection filter as matrices, so that the meshes
+  /// stay in their local coordinate system and a pose change only changes the relative transform between the models.
+  /// Non-linear transforms are applied to the mesh by a transform filter inserted before the collision detection.
+  /// The triangulated meshes and the hierarchies come from the shared models.
+  /// The filters are only used by one thread at a time: a worker thread while Busy, otherwise the main thread.
+  /// The pipelines of different nodes run concurrently, they only read the shared models, which are not modified
+  /// after their build: a refit replaces the triangles and the hierarchy of a model like a build does. The filters of each pipeline take a shallow copy
+  /// of the triangles of the shared models as input, so that connecting and updating them only modifies polydata
+  /// objects of the pipeline.
+  struct CollisionPipeline
+  {
+    CollisionPipeline();
+    SharedModelKey Model[2];
+    /// Shallow copies of the triangles of the shared models, made on the main thread, and the triangles they have
+    /// been copied from
+    vtkSmartPointer< vtkPolyData > Triangles[2];
+    vtkSmartPointer< vtkPolyData > SharedTriangles[2];
+    vtkSmartPointer< vtkMatrix4x4 > BodyToRasMatrix[2];
+    vtkSmartPointer< vtkTransformPolyDataFilter > BodyToRasFilter[2];
+    vtkSmartPointer< vtkCollisionDetectionFilter > CollisionDetectionFilter;
+
+    /// Latest request that the worker has not started yet. A newer request replaces it.
+    CollisionRequest Request;
+    bool RequestPending;
+    bool Busy;
+    /// Results of the worker, allocated when the pipeline is inserted in the map as they cannot be copied
+    ResultBuffer* Results;
+    /// Version and content of the result last applied to the module node by the main thread
+    int AppliedVersion;
+    CollisionResult AppliedResult;
+    /// Time of the last evaluation of the module node, in seconds
+    double LastUpdateTime;
+
+    /// Body to RAS matrix of the first model at the last update of the module node, identity if it is not linear
+    double FirstBodyToRasMatrix[16];
+    /// Models, MTimes of the polydata that their triangles were built from, pose of the second model relative to the
+    /// first one and maximum distance of the last evaluation. Its result is reused while they do not change. Only valid if both transforms are linear.
+    bool CachedPoseValid;
+    SharedModelKey CachedModel[2];
+    unsigned long CachedBodyMTime[2];
+    double CachedSecondBodyToFirstBodyMatrix[16];
+    double CachedMaximumDistance;
+  };
+
+  /// Returns the pipeline of the module node, creates it if it does not exist yet
+  CollisionPipeline* GetCollisionPipeline( vtkMRMLNode* bwNode );
+
+  /// Returns the shared model of the body for input i of the pipeline. The pipeline releases the model it used before.
+  /// Starts building the model if it is new or modified, and collects the result of a finished build.
+  SharedModel* SetPipelineModel( CollisionPipeline* pipeline, int i, vtkPolyData* body );
+
+  /// Returns the copy of the triangles of the shared model for input i of the pipeline, makes a new one if the model
+  /// has other triangles than the previous copy. NULL if the model has not been built yet.
+  static vtkPolyData* GetPipelineTriangles( CollisionPipeline* pipeline, int i, SharedModel* model );
+
+  /// Releases the shared models used by the pipeline, a model is deleted when no pipeline uses it anymore
+  void ReleasePipelineModels( CollisionPipeline* pipeline );
+
+  /// Starts a build if the model polydata has been modified since the last one, and makes the result of a finished
+  /// build available. The result of the previous build stays available until then.
+  void UpdateSharedModel( SharedModel* model, const SharedModelKey& key );
+
+  /// Waits until the build of the model is finished, if there is one running, and makes its result available
+  void WaitForBuild( SharedModel* model );
+
+  /// Returns the latest MTime of the cell arrays of the polydata
+  static unsigned long GetCellsMTime( vtkPolyData* polyData );
+
+  /// Sets the job up to refit the hierarchy of the model to its moved points, if the polydata has the same cells as
+  /// when it was triangulated. The job gets new triangles that share the cells of the triangles of the model, with a
+  /// copy of its points, so the workers keep computing with the current ones until the refit has finished.
+  /// Returns false if the model has to be triangulated again.
+  static bool SetUpRefit( SharedModel* model, BuildJob* job );
+
+  /// Makes the results of the finished builds available, and marks the module nodes that use the rebuilt models as
+  /// dirty, so that they are evaluated again with them
+  void CollectFinishedBuilds();
+
+  /// Releases a reference to a shared model, deletes it if it was the last one
+  void ReleaseSharedModel( const SharedModelKey& key );
+
+  /// Worker thread function: triangulates the copy of the model and builds its hierarchy, or refits the copy of the
+  /// hierarchy of the model to the moved points
+  static VTK_THREAD_RETURN_TYPE BuildSharedModel( void* arg );
+
+  /// Returns true if the motion from pose a to pose b is within the tolerances. The translation tolerance is in the
+  /// units of the poses and the rotation tolerance in degrees. A scaling is a motion larger than any tolerance.
+  static bool IsPoseUnchanged( const double a[16], const double b[16], double translationTolerance,
+    double rotationTolerance );
+
+  /// Computes the bounds of the 8 corners of the box bounds transformed by transform
+  static void GetTransformedBounds( const double bounds[6], vtkAbstractTransform* transform, double transformedBounds[6] );
+
+  /// Computes the distance between the bounding boxes in RAS of the models of the request, whose bounds in their own
+  /// coordinate systems are given. It is a lower bound of the distance between the models, 0 if the boxes overlap.
+  static double GetBoundsDistance( const CollisionRequest& request, const double bounds[2][6] );
+
+  /// Runs the collision detection of the pipeline for the request. The filter traverses the hierarchies with the
+  /// threads of vtkSMPTools if parallelTraversal is true. The workers already run one thread per core, so they
+  /// compute their requests with a sequential traversal, which does not oversubscribe the cores.
+  static void ComputeCollision( CollisionPipeline* pipeline, const CollisionRequest& request, bool parallelTraversal,
+    CollisionResult& result );
+
+  /// Posts the request to the worker threads. It replaces the request of the pipeline that no worker has started
+  /// yet, if any, so the workers only compute the latest pose of each module node. Spawns a new worker if there are
+  /// fewer workers than pipelines and the maximum number of workers has not been reached. Returns false without
+  /// posting the request if there is no worker, because no thread could be spawned.
+  bool PostRequest( CollisionPipeline* pipeline, const CollisionRequest& request );
+
+  /// Cancels the pending request of the pipeline and waits until no worker uses it anymore, after which the main
+  /// thread can use or delete the pipeline
+  void WaitForPipeline( CollisionPipeline* pipeline );
+
+  /// Removes the first pending pipeline that no other worker is computing from the queue and returns it, NULL if
+  /// there is none. A pipeline is computed by one worker at a time. Called with the mutex locked.
+  CollisionPipeline* TakePendingPipeline();
+
+  /// Worker thread function: computes the pending requests until the workers are stopped
+  static VTK_THREAD_RETURN_TYPE CollisionWorker( void* arg );
+
+  /// Returns true if a model is being built, or a request is being computed or waits for a worker, or a result has
+  /// not been applied yet
+  bool HasRunningJobs();
+
+  typedef std::map< vtkMRMLNode*, CollisionPipeline > CollisionPipelineMapType;
+  CollisionPipelineMapType CollisionPipelines;
+
+  /// The model builds and the workers have threaders of their own, so that the threads of one cannot exhaust the
+  /// other. A build that exceeds the maximum number of builds runs on the main thread.
+  vtkSmartPointer< vtkMultiThreader > BuildThreader;
+  unsigned int MaximumNumberOfBuilds;
+  unsigned int NumberOfRunningBuilds;
+
+  /// Worker thread pool state, the pipelines with a pending request are in the order of their requests. The request
+  /// and busy members of the pipelines are protected by the mutex.
+  vtkSmartPointer< vtkMutexLock > WorkerMutex;
+  vtkSmartPointer< vtkConditionVariable > RequestPosted;
+  vtkSmartPointer< vtkConditionVariable > RequestDone;
+  std::deque< CollisionPipeline* > PendingPipelines;
+  vtkSmartPointer< vtkMultiThreader > WorkerThreader;
+  std::vector< int > WorkerThreadIds;
+  unsigned int MaximumNumberOfWorkers;
+  bool StopWorkers;
+  /// Set by the workers when they have published a result, so that the main thread only looks for results then
+  vtkAtomicInt< int > ResultsPending;
+  /// Number of requests replaced by a newer one before a worker started them
+  unsigned long NumberOfDroppedRequests;
+  /// Number of model modifications that refitted the hierarchy of the model instead of building a new one
+  unsigned long NumberOfRefittedModels;
+
+  /// Module nodes whose inputs have been modified since the last frame
+  std::set< vtkMRMLNode* > DirtyNodes;
+};
+
+//------------------------------------------------------------------------------
+vtkSlicerCollisionWarningLogic::vtkInternal::vtkInternal()
+: NumberOfRunningBuilds( 0 )
+, StopWorkers( false )
+, NumberOfDroppedRequests( 0 )
+, NumberOfRefittedModels( 0 )
+{
+  // One worker per core, limited to the VTK_MAX_THREADS threads that a vtkMultiThreader can spawn. The builds are
+  // parallel themselves, so half as many of them run concurrently.
+  int numberOfCores = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  this->MaximumNumberOfWorkers = std::max( 1, std::min( numberOfCores, VTK_MAX_THREADS ) );
+  this->MaximumNumberOfBuilds = std::max( 1, std::min( numberOfCores / 2, VTK_MAX_THREADS ) );
+  this->BuildThreader = vtkSmartPointer< vtkMultiThreader >::New();
+  this->WorkerThreader = vtkSmartPointer< vtkMultiThreader >::New();
+  this->WorkerMutex = vtkSmartPointer< vtkMutexLock >::New();
+  this->RequestPosted = vtkSmartPointer< vtkConditionVariable >::New();
+  this->RequestDone = vtkSmartPointer< vtkConditionVariable >::New();
+  this->ResultsPending.Store( 0 );
+}
+
+//------------------------------------------------------------------------------
+vtkSlicerCollisionWarningLogic::vtkInternal::~vtkInternal()
+{
+  // The workers finish the requests they are computing, the pending ones are dropped
+  this->WorkerMutex->Lock();
+  this->StopWorkers = true;
+  this->RequestPosted->Broadcast();
+  this->WorkerMutex->Unlock();
+  for ( size_t i = 0; i < this->WorkerThreadIds.size(); i++ )
+  {
+    this->WorkerThreader->TerminateThread( this->WorkerThreadIds[i] );
+  }
+  for ( SharedModelMapType::iterator model = this->SharedModels.begin(); model != this->SharedModels.end(); ++model )
+  {
+    this->WaitForBuild( &model->second );
+  }
+  for ( CollisionPipelineMapType::iterator pipeline = this->CollisionPipelines.begin();
+    pipeline != this->CollisionPipelines.end(); ++pipeline )
+  {
+    delete pipeline->second.Results;
+  }
+}
+
+//------------------------------------------------------------------------------
+vtkSlicerCollisionWarningLogic::vtkInternal::SharedModel::SharedModel()
+: Ready( false )
+, BuildMTime( 0 )
+, TrianglesMTime( 0 )
+, TrianglesNumberOfPoints( 0 )
+, TrianglesCellsMTime( 0 )
+, Job( NULL )
+, ReferenceCount( 0 )
+{
+  vtkMath::UninitializeBounds( this->Bounds );
+}
+
+//------------------------------------------------------------------------------
+vtkSlicerCollisionWarningLogic::vtkInternal::SharedModelKey::SharedModelKey( vtkPolyData* body,
+  int numberOfCellsPerNode, int hierarchyType )
+: Body( body )
+, NumberOfCellsPerNode( numberOfCellsPerNode )
+, HierarchyType( hierarchyType )
+{
+}
+
+//------------------------------------------------------------------------------
+bool vtkSlicerCollisionWarningLogic::vtkInternal::SharedModelKey::operator<( const SharedModelKey& other ) const
+{
+  if ( this->Body != other.Body )
+  {
+    return this->Body < other.Body;
+  }
+  if ( this->NumberOfCellsPerNode != other.NumberOfCellsPerNode )
+  {
+    return this->NumberOfCellsPerNode < other.NumberOfCellsPerNode;
+  }
+  return this->HierarchyType < other.HierarchyType;
+}
+
+//------------------------------------------------------------------------------
+bool vtkSlicerCollisionWarningLogic::vtkInternal::SharedModelKey::operator==( const SharedModelKey& other ) const
+{
+  return this->Body == other.Body && this->NumberOfCellsPerNode == other.NumberOfCellsPerNode
+    && this->HierarchyType == other.HierarchyType;
+}
+
+//------------------------------------------------------------------------------
+vtkSlicerCollisionWarningLogic::vtkInternal::CollisionResult::CollisionResult()
+: Distance( 0 )
+, Collision( false )
+, NumberOfContacts( 0 )
+, HasClosestPoints( false )
+{
+  std::fill( this->ClosestPoints, this->ClosestPoints + 6, 0.0 );
+}
+
+//------------------------------------------------------------------------------
+vtkSlicerCollisionWarningLogic::vtkInternal::ResultBuffer::ResultBuffer()
+: Writing( 1 )
+, Version( 0 )
+{
+  this->Latest.Store( 0 );
+  this->Reading.Store( 0 );
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::vtkInternal::ResultBuffer::Publish( const CollisionResult& result )
+{
+  this->Slots[ this->Writing ] = result;
+  // The versions wrap around without going back to 0, which means no result
+  this->Version = this->Version % 0x1fffffff + 1;
+  // The stores and loads of vtkAtomicInt are sequentially consistent: the main thread that loads the new version has
+  // seen the result written before
+  this->Latest.Store( 4 * this->Version + this->Writing );
+  // The next result goes to the slot that is neither the published one nor the one that the main thread reads. If
+  // the main thread marks the published slot after this, it reads that slot, not the one written next.
+  int reading = this->Reading.Load();
+  int published = this->Writing;
+  this->Writing = 0;
+  while ( this->Writing == published || this->Writing == reading )
+  {
+    this->Writing++;
+  }
+}
+
+//------------------------------------------------------------------------------
+bool vtkSlicerCollisionWarningLogic::vtkInternal::ResultBuffer::Read( int& version, CollisionResult& result )
+{
+  int latest = this->Latest.Load();
+  if ( latest == version )
+  {
+    return false;
+  }
+  // The worker may publish again between the load and the mark, and start writing the slot that was loaded. It is
+  // safe to read the slot once it is marked and still the latest, the worker then chooses another one.
+  while ( true )
+  {
+    this->Reading.Store( latest % 4 );
+    int check = this->Latest.Load();
+    if ( check == latest )
+    {
+      break;
+    }
+    latest = check;
+  }
+  result = this->Slots[ latest % 4 ];
+  version = latest;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+vtkSlicerCollisionWarningLogic::vtkInternal::CollisionPipeline::CollisionPipeline()
+: RequestPending( false )
+, Busy( false )
+, Results( NULL )
+, AppliedVersion( 0 )
+, LastUpdateTime( 0 )
+, CachedPoseValid( false )
+, CachedMaximumDistance( 0 )
+{
+  std::fill( this->FirstBodyToRasMatrix, this->FirstBodyToRasMatrix + 16, 0.0 );
+  for ( int i = 0; i < 4; i++ )
+  {
+    this->FirstBodyToRasMatrix[ 4 * i + i ] = 1.0;
+  }
+  this->CollisionDetectionFilter = vtkSmartPointer< vtkCollisionDetectionFilter >::New();
+  // Also gives the distance between the models when they do not collide, and stops at the first contact when they do
+  this->CollisionDetectionFilter->SetCollisionModeToMinimumDistance();
+  this->CollisionDetectionFilter->GenerateScalarsOff();
+  // Only the number of contacts, the distance and the closest points are read, the models are not needed on
+  // outputs 0 and 1
+  this->CollisionDetectionFilter->PassInputsOff();
+  for ( int i = 0; i < 2; i++ )
+  {
+    this->Model[i] = SharedModelKey();
+    this->CachedModel[i] = SharedModelKey();
+    this->CachedBodyMTime[i] = 0;
+    this->BodyToRasMatrix[i] = vtkSmartPointer< vtkMatrix4x4 >::New();
+    this->BodyToRasFilter[i] = vtkSmartPointer< vtkTransformPolyDataFilter >::New();
+    this->CollisionDetectionFilter->SetMatrix( i, this->BodyToRasMatrix[i] );
+  }
+}
+
+//------------------------------------------------------------------------------
+vtkSlicerCollisionWarningLogic::vtkInternal::CollisionPipeline* vtkSlicerCollisionWarningLogic::vtkInternal::GetCollisionPipeline( vtkMRMLNode* bwNode )
+{
+  // operator[] creates a new pipeline if there is none for this node yet
+  CollisionPipeline* pipeline = &this->CollisionPipelines[ bwNode ];
+  if ( pipeline->Results == NULL )
+  {
+    pipeline->Results = new ResultBuffer;
+  }
+  return pipeline;
+}
+
+//------------------------------------------------------------------------------
+vtkSlicerCollisionWarningLogic::vtkInternal::SharedModel* vtkSlicerCollisionWarningLogic::vtkInternal::SetPipelineModel( CollisionPipeline* pipeline, int i, vtkPolyData* body )
+{
+  vtkCollisionDetectionFilter* filter = pipeline->CollisionDetectionFilter;
+  SharedModelKey key( body, filter->GetNumberOfCellsPerNode(), filter->GetHierarchyType() );
+  SharedModel* model = &this->SharedModels[ key ];
+  if ( pipeline->Model[i] != key )
+  {
+    // Keep a reference to the polydata, so that its address is not reused for another model while it is a key
+    model->Body = body;
+    model->ReferenceCount++;
+
+    // Release the previous model after the new one is referenced, in case they are the same
+    SharedModelKey previousKey = pipeline->Model[i];
+    pipeline->Model[i] = key;
+    this->ReleaseSharedModel( previousKey );
+  }
+  this->UpdateSharedModel( model, key );
+  return model;
+}
+
+//------------------------------------------------------------------------------
+vtkPolyData* vtkSlicerCollisionWarningLogic::vtkInternal::GetPipelineTriangles( CollisionPipeline* pipeline, int i,
+  SharedModel* model )
+{
+  if ( model->Triangles == NULL )
+  {
+    return NULL;
+  }
+  if ( pipeline->SharedTriangles[i] != model->Triangles )
+  {
+    // A new copy, the worker may still be computing with the previous one
+    pipeline->Triangles[i] = vtkSmartPointer< vtkPolyData >::New();
+    pipeline->Triangles[i]->ShallowCopy( model->Triangles );
+    pipeline->SharedTriangles[i] = model->Triangles;
+  }
+  return pipeline->Triangles[i];
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::vtkInternal::ReleasePipelineModels( CollisionPipeline* pipeline )
+{
+  for ( int i = 0; i < 2; i++ )
+  {
+    this->ReleaseSharedModel( pipeline->Model[i] );
+    pipeline->Model[i] = SharedModelKey();
+  }
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::vtkInternal::UpdateSharedModel( SharedModel* model, const SharedModelKey& key )
+{
+  if ( model->Job != NULL && model->Job->Done.Load() )
+  {
+    // The build has finished, the filters can use its result from now on
+    this->WaitForBuild( model );
+  }
+
+  if ( model->Job == NULL && model->Body->GetMTime() != model->BuildMTime )
+  {
+    model->BuildMTime = model->Body->GetMTime();
+
+    // The triangles and the hierarchy of the last build, if any, are used until this one finishes
+    model->Job = new BuildJob;
+    if ( model->Ready && SetUpRefit( model, model->Job ) )
+    {
+      this->NumberOfRefittedModels++;
+    }
+    else
+    {
+      model->Job->Body = vtkSmartPointer< vtkPolyData >::New();
+      model->Job->Body->DeepCopy( model->Body );
+    }
+    model->Job->BodyMTime = model->BuildMTime;
+    model->Job->NumberOfPoints = model->Body->GetNumberOfPoints();
+    model->Job->CellsMTime = GetCellsMTime( model->Body );
+    model->Job->NumberOfCellsPerNode = key.NumberOfCellsPerNode;
+    model->Job->HierarchyType = key.HierarchyType;
+    model->Job->Done.Store( 0 );
+    model->Job->ThreadId = -1;
+    if ( this->NumberOfRunningBuilds < this->MaximumNumberOfBuilds )
+    {
+      model->Job->ThreadId = this->BuildThreader->SpawnThread( BuildSharedModel, model->Job );
+    }
+    if ( model->Job->ThreadId >= 0 )
+    {
+      this->NumberOfRunningBuilds++;
+    }
+    else
+    {
+      // Too many builds are running, or all the threads of the threader are in use, build on this thread instead
+      vtkMultiThreader::ThreadInfo info;
+      info.ThreadID = 0;
+      info.NumberOfThreads = 1;
+      info.ActiveFlag = NULL;
+      info.ActiveFlagLock = NULL;
+      info.UserData = model->Job;
+      BuildSharedModel( &info );
+      this->WaitForBuild( model );
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::vtkInternal::WaitForBuild( SharedModel* model )
+{
+  if ( model->Job == NULL )
+  {
+    return;
+  }
+  // Joins the thread, unless the build has run on this thread
+  if ( model->Job->ThreadId >= 0 )
+  {
+    this->BuildThreader->TerminateThread( model->Job->ThreadId );
+    this->NumberOfRunningBuilds--;
+  }
+  // The pipelines that still compute with the previous build keep a reference to it
+  model->Triangles = model->Job->Triangles;
+  model->Hierarchy = model->Job->Hierarchy;
+  model->TrianglesMTime = model->Job->BodyMTime;
+  model->TrianglesNumberOfPoints = model->Job->NumberOfPoints;
+  model->TrianglesCellsMTime = model->Job->CellsMTime;
+  model->Triangles->GetBounds( model->Bounds );
+  // If the model has been modified again during the build, the next UpdateSharedModel starts another one
+  model->Ready = true;
+  delete model->Job;
+  model->Job = NULL;
+}
+
+//------------------------------------------------------------------------------
+unsigned long vtkSlicerCollisionWarningLogic::vtkInternal::GetCellsMTime( vtkPolyData* polyData )
+{
+  vtkCellArray* cells[4] = { polyData->GetVerts(), polyData->GetLines(), polyData->GetPolys(), polyData->GetStrips() };
+  unsigned long cellsMTime = 0;
+  for ( int i = 0; i < 4; i++ )
+  {
+    if ( cells[i] != NULL )
+    {
+      cellsMTime = std::max( cellsMTime, cells[i]->GetMTime() );
+    }
+  }
+  return cellsMTime;
+}
+
+//------------------------------------------------------------------------------
+bool vtkSlicerCollisionWarningLogic::vtkInternal::SetUpRefit( SharedModel* model, BuildJob* job )
+{
+  // vtkTriangleFilter passes the points of its input, so the triangles reference the points of the model by the same
+  // ids as long as its cells are the same
+  vtkPoints* points = model->Body->GetPoints();
+  if ( points == NULL || model->Triangles == NULL || model->Triangles->GetPoints() == NULL
+    || model->Body->GetNumberOfPoints() != model->TrianglesNumberOfPoints
+    || GetCellsMTime( model->Body ) != model->TrianglesCellsMTime )
+  {
+    return false;
+  }
+
+  // The points are copied, the model polydata may be modified again during the refit. The copy of the triangles is
+  // made on this thread, as it references the cell arrays that the pipelines reference as well.
+  vtkSmartPointer< vtkPoints > trianglePoints = vtkSmartPointer< vtkPoints >::New();
+  trianglePoints->DeepCopy( points );
+  job->Triangles = vtkSmartPointer< vtkPolyData >::New();
+  job->Triangles->ShallowCopy( model->Triangles );
+  job->Triangles->SetPoints( trianglePoints );
+  job->RefittedHierarchy = model->Hierarchy;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::vtkInternal::CollectFinishedBuilds()
+{
+  for ( SharedModelMapType::iterator model = this->SharedModels.begin(); model != this->SharedModels.end(); ++model )
+  {
+    if ( model->second.Job == NULL || !model->second.Job->Done.Load() )
+    {
+      continue;
+    }
+    this->WaitForBuild( &model->second );
+    for ( CollisionPipelineMapType::iterator pipeline = this->CollisionPipelines.begin();
+      pipeline != this->CollisionPipelines.end(); ++pipeline )
+    {
+      if ( pipeline->second.Model[0] == model->first || pipeline->second.Model[1] == model->first )
+      {
+        this->DirtyNodes.insert( pipeline->first );
+      }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE vtkSlicerCollisionWarningLogic::vtkInternal::BuildSharedModel( void* arg )
+{
+  vtkMultiThreader::ThreadInfo* info = static_cast< vtkMultiThreader::ThreadInfo* >( arg );
+  BuildJob* job = static_cast< BuildJob* >( info->UserData );
+
+  if ( job->RefittedHierarchy != NULL )
+  {
+    // Same cells, so the copy of the hierarchy only refits its boxes to the moved points, unless they fit too poorly
+    job->Hierarchy = vtkSmartPointer< vtkCollisionHierarchy >::New();
+    job->Hierarchy->SetDataSet( job->Triangles );
+    job->Hierarchy->DeepCopy( job->RefittedHierarchy );
+    job->Hierarchy->BuildHierarchy();
+    job->Done.Store( 1 );
+    return VTK_THREAD_RETURN_VALUE;
+  }
+
+  vtkSmartPointer< vtkTriangleFilter > triangleFilter = vtkSmartPointer< vtkTriangleFilter >::New();
+  triangleFilter->SetInputData( job->Body );
+  triangleFilter->Update();
+  job->Triangles = vtkSmartPointer< vtkPolyData >::New();
+  job->Triangles->ShallowCopy( triangleFilter->GetOutput() );
+
+  job->Hierarchy = vtkSmartPointer< vtkCollisionHierarchy >::New();
+  job->Hierarchy->SetDataSet( job->Triangles );
+  job->Hierarchy->SetNumberOfCellsPerNode( job->NumberOfCellsPerNode );
+  job->Hierarchy->SetHierarchyType( job->HierarchyType );
+  job->Hierarchy->BuildHierarchy();
+
+  job->Done.Store( 1 );
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//------------------------------------------------------------------------------
+bool vtkSlicerCollisionWarningLogic::vtkInternal::IsPoseUnchanged( const double a[16], const double b[16],
+  double translationTolerance, double rotationTolerance )
+{
+  double inverseA[16];
+  double delta[16];
+  vtkMatrix4x4::Invert( a, inverseA );
+  vtkMatrix4x4::Multiply4x4( inverseA, b, delta );
+
+  double translation = sqrt( delta[3] * delta[3] + delta[7] * delta[7] + delta[11] * delta[11] );
+  if ( translation > translationTolerance )
+  {
+    return false;
+  }
+
+  // The Frobenius norm of R - I is 2 sqrt(2) sin(angle/2) for a rotation R, a scaling makes it larger as well
+  double squaredNorm = 0;
+  for ( int row = 0; row < 3; row++ )
+  {
+    for ( int column = 0; column < 3; column++ )
+    {
+      double difference = delta[ 4 * row + column ] - ( row == column ? 1.0 : 0.0 );
+      squaredNorm += difference * difference;
+    }
+  }
+  double maximumNorm = 2.0 * sqrt( 2.0 ) * sin( vtkMath::RadiansFromDegrees( std::min( rotationTolerance, 180.0 ) ) / 2.0 );
+  return squaredNorm <= maximumNorm * maximumNorm;
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::vtkInternal::GetTransformedBounds( const double bounds[6], vtkAbstractTransform* transform, double transformedBounds[6] )
+{
+  for ( int axis = 0; axis < 3; axis++ )
+  {
+    transformedBounds[2*axis] = VTK_DOUBLE_MAX;
+    transformedBounds[2*axis+1] = -VTK_DOUBLE_MAX;
+  }
+  for ( int corner = 0; corner < 8; corner++ )
+  {
+    double point[3] = { bounds[ corner & 1 ], bounds[ 2 + ( ( corner >> 1 ) & 1 ) ], bounds[ 4 + ( ( corner >> 2 ) & 1 ) ] };
+    double transformedPoint[3];
+    transform->TransformPoint( point, transformedPoint );
+    for ( int axis = 0; axis < 3; axis++ )
+    {
+      transformedBounds[2*axis] = std::min( transformedBounds[2*axis], transformedPoint[axis] );
+      transformedBounds[2*axis+1] = std::max( transformedBounds[2*axis+1], transformedPoint[axis] );
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+double vtkSlicerCollisionWarningLogic::vtkInternal::GetBoundsDistance( const CollisionRequest& request, const double bounds[2][6] )
+{
+  double rasBounds[2][6];
+  for ( int i = 0; i < 2; i++ )
+  {
+    vtkAbstractTransform* bodyToRas = request.BodyToRasTransform[i];
+    vtkSmartPointer< vtkMatrixToLinearTransform > bodyToRasLinear;
+    if ( bodyToRas == NULL )
+    {
+      vtkSmartPointer< vtkMatrix4x4 > bodyToRasMatrix = vtkSmartPointer< vtkMatrix4x4 >::New();
+      bodyToRasMatrix->DeepCopy( request.BodyToRasMatrix[i] );
+      bodyToRasLinear = vtkSmartPointer< vtkMatrixToLinearTransform >::New();
+      bodyToRasLinear->SetInput( bodyToRasMatrix );
+      bodyToRas = bodyToRasLinear;
+    }
+    GetTransformedBounds( bounds[i], bodyToRas, rasBounds[i] );
+  }
+  double squaredDistance = 0;
+  for ( int axis = 0; axis < 3; axis++ )
+  {
+    double gap = std::max( rasBounds[1][2*axis] - rasBounds[0][2*axis+1], rasBounds[0][2*axis] - rasBounds[1][2*axis+1] );
+    if ( gap > 0 )
+    {
+      squaredDistance += gap * gap;
+    }
+  }
+  return sqrt( squaredDistance );
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::vtkInternal::ComputeCollision( CollisionPipeline* pipeline,
+  const CollisionRequest& request, bool parallelTraversal, CollisionResult& result )
+{
+  vtkCollisionDetectionFilter* filter = pipeline->CollisionDetectionFilter;
+  for ( int i = 0; i < 2; i++ )
+  {
+    pipeline->BodyToRasMatrix[i]->DeepCopy( request.BodyToRasMatrix[i] );
+    // The inputs are only set when they change, so that the filters do not execute again. They are the copies of
+    // the triangles of this pipeline, which no other worker reads.
+    if ( request.BodyToRasTransform[i] == NULL )
+    {
+      if ( filter->GetInputDataObject( i, 0 ) != request.Triangles[i] )
+      {
+        filter->SetInputData( i, request.Triangles[i] );
+      }
+      filter->SetHierarchy( i, request.Hierarchy[i] );
+    }
+    else
+    {
+      // Non-linear transform: the mesh has to be transformed to RAS, so the hierarchy of the transformed mesh
+      // cannot be shared
+      pipeline->BodyToRasFilter[i]->SetTransform( request.BodyToRasTransform[i] );
+      if ( pipeline->BodyToRasFilter[i]->GetInput() != request.Triangles[i] )
+      {
+        pipeline->BodyToRasFilter[i]->SetInputData( request.Triangles[i] );
+      }
+      if ( filter->GetInputConnection( i, 0 ) != pipeline->BodyToRasFilter[i]->GetOutputPort() )
+      {
+        filter->SetInputConnection( i, pipeline->BodyToRasFilter[i]->GetOutputPort() );
+      }
+      if ( filter->GetHierarchy( i ) == request.Hierarchy[i] )
+      {
+        filter->SetHierarchy( i, NULL );
+      }
+    }
+  }
+
+  // The closest pair is only searched up to the maximum distance, models farther apart are rejected by the
+  // broadphase of the filter
+  filter->SetMaximumDistance( request.MaximumDistance );
+  filter->SetParallelTraversal( parallelTraversal );
+  filter->Update();
+
+  double minimumDistance = filter->GetMinimumDistance();
+  if ( minimumDistance >= 0 )
+  {
+    result.Distance = minimumDistance;
+    result.Collision = ( minimumDistance <= 0 );
+    // The filter reports the closest pair as a contact even if the models do not touch
+    result.NumberOfContacts = ( result.Collision ? filter->GetNumberOfContacts() : 0 );
+  }
+  else
+  {
+    // Farther apart than the maximum distance, the distance between the bounding boxes is a lower bound
+    result.Distance = GetBoundsDistance( request, request.Bounds );
+    if ( request.MaximumDistance < VTK_DOUBLE_MAX )
+    {
+      result.Distance = std::max( result.Distance, request.MaximumDistance );
+    }
+    result.Collision = false;
+    result.NumberOfContacts = 0;
+  }
+  vtkPoints* closestPoints = filter->GetContactsOutput()->GetPoints();
+  if ( closestPoints != NULL && closestPoints->GetNumberOfPoints() == 2 )
+  {
+    // Relative to the first model, so that they follow it if the result is reused for the same relative pose
+    double rasToFirstBody[16];
+    vtkMatrix4x4::Invert( request.BodyToRasMatrix[0], rasToFirstBody );
+    for ( int i = 0; i < 2; i++ )
+    {
+      double rasPoint[4] = { 0, 0, 0, 1 };
+      double point[4];
+      closestPoints->GetPoint( i, rasPoint );
+      vtkMatrix4x4::MultiplyPoint( rasToFirstBody, rasPoint, point );
+      std::copy( point, point + 3, result.ClosestPoints + 3 * i );
+    }
+    result.HasClosestPoints = true;
+  }
+}
+
+//------------------------------------------------------------------------------
+bool vtkSlicerCollisionWarningLogic::vtkInternal::PostRequest( CollisionPipeline* pipeline,
+  const CollisionRequest& request )
+{
+  this->WorkerMutex->Lock();
+  if ( this->WorkerThreadIds.size() < std::min< size_t >( this->MaximumNumberOfWorkers, this->CollisionPipelines.size() ) )
+  {
+    // Fails if all the threads of the threader are in use, the existing workers then take the request
+    int threadId = this->WorkerThreader->SpawnThread( CollisionWorker, this );
+    if ( threadId >= 0 )
+    {
+      this->WorkerThreadIds.push_back( threadId );
+    }
+  }
+  if ( this->WorkerThreadIds.empty() )
+  {
+    this->WorkerMutex->Unlock();
+    return false;
+  }
+  if ( !pipeline->RequestPending )
+  {
+    pipeline->RequestPending = true;
+    this->PendingPipelines.push_back( pipeline );
+  }
+  else
+  {
+    this->NumberOfDroppedRequests++;
+  }
+  pipeline->Request = request;
+  this->RequestPosted->Signal();
+  this->WorkerMutex->Unlock();
+  return true;
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::vtkInternal::WaitForPipeline( CollisionPipeline* pipeline )
+{
+  this->WorkerMutex->Lock();
+  if ( pipeline->RequestPending )
+  {
+    pipeline->RequestPending = false;
+    this->PendingPipelines.erase( std::find( this->PendingPipelines.begin(), this->PendingPipelines.end(), pipeline ) );
+  }
+  while ( pipeline->Busy )
+  {
+    this->RequestDone->Wait( this->WorkerMutex );
+  }
+  this->WorkerMutex->Unlock();
+}
+
+//------------------------------------------------------------------------------
+vtkSlicerCollisionWarningLogic::vtkInternal::CollisionPipeline* vtkSlicerCollisionWarningLogic::vtkInternal::TakePendingPipeline()
+{
+  for ( std::deque< CollisionPipeline* >::iterator pipeline = this->PendingPipelines.begin();
+    pipeline != this->PendingPipelines.end(); ++pipeline )
+  {
+    if ( !(*pipeline)->Busy )
+    {
+      CollisionPipeline* pendingPipeline = *pipeline;
+      this->PendingPipelines.erase( pipeline );
+      return pendingPipeline;
+    }
+  }
+  return NULL;
+}
+
+//------------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE vtkSlicerCollisionWarningLogic::vtkInternal::CollisionWorker( void* arg )
+{
+  vtkMultiThreader::ThreadInfo* info = static_cast< vtkMultiThreader::ThreadInfo* >( arg );
+  vtkInternal* self = static_cast< vtkInternal* >( info->UserData );
+
+  self->WorkerMutex->Lock();
+  while ( true )
+  {
+    CollisionPipeline* pipeline = NULL;
+    while ( !self->StopWorkers && ( pipeline = self->TakePendingPipeline() ) == NULL )
+    {
+      self->RequestPosted->Wait( self->WorkerMutex );
+    }
+    if ( self->StopWorkers )
+    {
+      break;
+    }
+    CollisionRequest request = pipeline->Request;
+    pipeline->Request = CollisionRequest();
+    pipeline->RequestPending = false;
+    pipeline->Busy = true;
+    self->WorkerMutex->Unlock();
+
+    CollisionResult result;
+    ComputeCollision( pipeline, request, false, result );
+    pipeline->Results->Publish( result );
+    self->ResultsPending.Store( 1 );
+
+    self->WorkerMutex->Lock();
+    pipeline->Busy = false;
+    self->RequestDone->Broadcast();
+    // A request posted for the pipeline while it was busy is taken by this worker in the next iteration
+  }
+  self->WorkerMutex->Unlock();
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//------------------------------------------------------------------------------
+bool vtkSlicerCollisionWarningLogic::vtkInternal::HasRunningJobs()
+{
+  if ( this->ResultsPending.Load() )
+  {
+    return true;
+  }
+  for ( SharedModelMapType::iterator model = this->SharedModels.begin(); model != this->SharedModels.end(); ++model )
+  {
+    if ( model->second.Job != NULL )
+    {
+      return true;
+    }
+  }
+  bool running = false;
+  this->WorkerMutex->Lock();
+  for ( CollisionPipelineMapType::iterator pipeline = this->CollisionPipelines.begin();
+    pipeline != this->CollisionPipelines.end() && !running; ++pipeline )
+  {
+    running = ( pipeline->second.RequestPending || pipeline->second.Busy );
+  }
+  this->WorkerMutex->Unlock();
+  return running;
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::vtkInternal::ReleaseSharedModel( const SharedModelKey& key )
+{
+  SharedModelMapType::iterator model = this->SharedModels.find( key );
+  if ( model != this->SharedModels.end() && --model->second.ReferenceCount <= 0 )
+  {
+    this->WaitForBuild( &model->second );
+    this->SharedModels.erase( model );
+  }
+}
+
+//------------------------------------------------------------------------------
 // Slicer methods 
 
 vtkStandardNewMacro(vtkSlicerCollisionWarningLogic);
@@ -47,19 +1059,38 @@ vtkStandardNewMacro(vtkSlicerCollisionWarningLogic);
 //------------------------------------------------------------------------------
 vtkSlicerCollisionWarningLogic::vtkSlicerCollisionWarningLogic()
 : WarningSoundPlaying(false)
+, AsynchronousUpdate(true)
+, MinimumUpdateInterval(0)
+, NumberOfMergedEvents(0)
+, PoseTranslationTolerance(0.001)
+, PoseRotationTolerance(0.001)
+, NumberOfReusedResults(0)
+, MaximumDistance(100.0)
 {
+  this->Internal = new vtkInternal;
 }
 
 
 //------------------------------------------------------------------------------
 vtkSlicerCollisionWarningLogic::~vtkSlicerCollisionWarningLogic()
 {
+  delete this->Internal;
+  this->Internal = NULL;
 }
 
 //------------------------------------------------------------------------------
 void vtkSlicerCollisionWarningLogic::PrintSelf(ostream& os, vtkIndent indent)
 {
   this->Superclass::PrintSelf(os, indent);
+  os << indent << "AsynchronousUpdate: " << this->AsynchronousUpdate << "\n";
+  os << indent << "MinimumUpdateInterval: " << this->MinimumUpdateInterval << "\n";
+  os << indent << "NumberOfMergedEvents: " << this->NumberOfMergedEvents << "\n";
+  os << indent << "NumberOfDroppedRequests: " << this->GetNumberOfDroppedRequests() << "\n";
+  os << indent << "PoseTranslationTolerance: " << this->PoseTranslationTolerance << "\n";
+  os << indent << "PoseRotationTolerance: " << this->PoseRotationTolerance << "\n";
+  os << indent << "NumberOfReusedResults: " << this->NumberOfReusedResults << "\n";
+  os << indent << "NumberOfRefittedModels: " << this->GetNumberOfRefittedModels() << "\n";
+  os << indent << "MaximumDistance: " << this->MaximumDistance << "\n";
 }
 
 //------------------------------------------------------------------------------
@@ -151,136 +1182,319 @@ void vtkSlicerCollisionWarningLogic::UpdateToolState( vtkMRMLCollisionWarningNod
 
 original method */
 
-void vtkSlicerCollisionWarningLogic::UpdateToolState( vtkMRMLCollisionWarningNode* bwNode )
+//------------------------------------------------------------------------------
+bool vtkSlicerCollisionWarningLogic::UpdateToolState( vtkMRMLCollisionWarningNode* bwNode )
 {
   if ( bwNode == NULL )
   {
-    return;
+    return false;
   }
 
   vtkMRMLModelNode* modelNode = bwNode->GetWatchedModelNode();
-  vtkMRMLTransformNode* toolToRasNode = bwNode->GetToolTransformNode();
   vtkMRMLModelNode* secondModelNode = bwNode->GetSecondModelNode();
 
   if ( modelNode == NULL || secondModelNode == NULL )
   {
+    // Nothing to watch anymore: the pipeline releases the shared models, and the node stops warning. A new pipeline
+    // is created once both models are set again.
+    this->RemoveCollisionPipeline( bwNode );
     bwNode->SetClosestDistanceToModelFromToolTip(0);
-    return;
+    bwNode->SetCollision( false );
+    return true;
   }
 
-
   vtkPolyData* body = modelNode->GetPolyData();
   if ( body == NULL )
   {
     vtkWarningMacro( "No surface model in first node" );
-    return;
+    return false;
   }
 
   vtkPolyData* secondBody = secondModelNode->GetPolyData();
   if ( secondBody == NULL )
   {
     vtkWarningMacro( "No surface model in second node" );
-    return;
+    return false;
   }
 
-  vtkSmartPointer<vtkTriangleFilter> triangleFilter1 = vtkSmartPointer<vtkTriangleFilter>::New();
-  vtkSmartPointer<vtkTriangleFilter> triangleFilter0 = vtkSmartPointer<vtkTriangleFilter>::New();
-
-  vtkSmartPointer< vtkCollisionDetectionFilter> collisionDetectionFilter = vtkSmartPointer< vtkCollisionDetectionFilter>::New();
-  collisionDetectionFilter->SetCollisionModeToFirstContact(); // should be faster
-
-// start transform first model
-  // Transform the first body poly data if there is a parent transform.
-  vtkMRMLTransformNode* bodyParentTransform = modelNode->GetParentTransformNode();
-  if ( bodyParentTransform != NULL )
+  // The pipeline is kept between updates, so each stage only re-executes if its input has changed:
+  // the triangulation is recomputed and the hierarchies are rebuilt only if the polydata of the model is modified.
+  // Nodes that watch the same model share its triangulation and hierarchy, which are built in the background.
+  vtkInternal::CollisionPipeline* pipeline = this->Internal->GetCollisionPipeline( bwNode );
+
+  // The poses and the models are copied to a request, which is computed on the worker thread
+  vtkMRMLModelNode* modelNodes[2] = { modelNode, secondModelNode };
+  vtkPolyData* bodies[2] = { body, secondBody };
+  vtkInternal::CollisionRequest request;
+  request.MaximumDistance = this->MaximumDistance;
+  vtkSmartPointer< vtkMatrix4x4 > bodyToRasMatrix = vtkSmartPointer< vtkMatrix4x4 >::New();
+  bool modelsReady = true;
+  unsigned long trianglesMTime[2];
+  for ( int i = 0; i < 2; i++ )
   {
-    vtkSmartPointer< vtkGeneralTransform > bodyToRasTransform = vtkSmartPointer< vtkGeneralTransform >::New();
-    bodyParentTransform->GetTransformToWorld( bodyToRasTransform );
+    // vtkCollisionDetectionFilter only accepts triangles
+    vtkInternal::SharedModel* model = this->Internal->SetPipelineModel( pipeline, i, bodies[i] );
+    request.Triangles[i] = vtkInternal::GetPipelineTriangles( pipeline, i, model );
+    trianglesMTime[i] = model->TrianglesMTime;
+    request.Hierarchy[i] = model->Hierarchy;
+    std::copy( model->Bounds, model->Bounds + 6, request.Bounds[i] );
+    modelsReady = modelsReady && model->Ready;
+
+    vtkMRMLTransformNode* bodyParentTransform = modelNodes[i]->GetParentTransformNode();
+    bodyToRasMatrix->Identity();
+    if ( bodyParentTransform != NULL && bodyParentTransform->IsTransformToWorldLinear() )
+    {
+      // Keep the mesh in its local coordinate system, only the matrix is updated
+      bodyParentTransform->GetMatrixTransformToWorld( bodyToRasMatrix );
+    }
+    else if ( bodyParentTransform != NULL )
+    {
+      // The copy does not reference the transforms of the scene, which the main thread may modify
+      vtkSmartPointer< vtkGeneralTransform > bodyToRasTransform = vtkSmartPointer< vtkGeneralTransform >::New();
+      bodyParentTransform->GetTransformToWorld( bodyToRasTransform );
+      request.BodyToRasTransform[i] = vtkSmartPointer< vtkGeneralTransform >::New();
+      request.BodyToRasTransform[i]->DeepCopy( bodyToRasTransform );
+    }
+    std::copy( &bodyToRasMatrix->Element[0][0], &bodyToRasMatrix->Element[0][0] + 16, request.BodyToRasMatrix[i] );
+  }
+  std::copy( request.BodyToRasMatrix[0], request.BodyToRasMatrix[0] + 16, pipeline->FirstBodyToRasMatrix );
 
-    vtkSmartPointer< vtkTransformPolyDataFilter > bodyToRasFilter = vtkSmartPointer< vtkTransformPolyDataFilter >::New();
-#if (VTK_MAJOR_VERSION <= 5)
-    bodyToRasFilter->SetInput( body );
-#else
-    bodyToRasFilter->SetInputData( body );
-#endif
-    bodyToRasFilter->SetTransform( bodyToRasTransform );
-    bodyToRasFilter->Update();
+  if ( !modelsReady )
+  {
+    // Until the first build of the hierarchies has finished, only the bounding boxes of the models in RAS are compared.
+    // Models whose boxes are apart do not collide, and the distance between the boxes is not larger than the
+    // distance between the models. Overlapping boxes do not tell whether the models collide, so the node keeps its
+    // state until the end of the build marks it dirty again.
+    double bounds[2][6];
+    for ( int i = 0; i < 2; i++ )
+    {
+      bodies[i]->GetBounds( bounds[i] );
+    }
+    double boundsDistance = vtkInternal::GetBoundsDistance( request, bounds );
+    pipeline->CachedPoseValid = false;
+    pipeline->AppliedResult = vtkInternal::CollisionResult();
+    if ( boundsDistance <= 0 )
+    {
+      pipeline->AppliedResult.Distance = bwNode->GetClosestDistanceToModelFromToolTip();
+      pipeline->AppliedResult.Collision = bwNode->GetCollision();
+      return false;
+    }
+    pipeline->AppliedResult.Distance = boundsDistance;
+    bwNode->SetClosestDistanceToModelFromToolTip( boundsDistance );
+    bwNode->SetCollision( false );
+    return true;
+  }
 
-    triangleFilter0->SetInputData(bodyToRasFilter->GetOutput());
-    triangleFilter0->Update();
-    collisionDetectionFilter->SetInputData(0, triangleFilter0->GetOutput() );
+  // Trackers report slightly different poses while a tool does not move. The result of the last evaluation, applied
+  // to the node or still being computed, stays valid as long as the models and their relative pose do not change.
+  bool linear = ( request.BodyToRasTransform[0] == NULL && request.BodyToRasTransform[1] == NULL );
+  double secondBodyToFirstBodyMatrix[16];
+  if ( linear )
+  {
+    double rasToFirstBodyMatrix[16];
+    vtkMatrix4x4::Invert( request.BodyToRasMatrix[0], rasToFirstBodyMatrix );
+    vtkMatrix4x4::Multiply4x4( rasToFirstBodyMatrix, request.BodyToRasMatrix[1], secondBodyToFirstBodyMatrix );
   }
-  else
+  if ( linear && pipeline->CachedPoseValid && this->PoseTranslationTolerance >= 0 && this->PoseRotationTolerance >= 0 )
+  {
+    bool sameInputs = ( pipeline->CachedMaximumDistance == request.MaximumDistance );
+    for ( int i = 0; i < 2; i++ )
+    {
+      sameInputs = sameInputs && pipeline->CachedModel[i] == pipeline->Model[i]
+        && pipeline->CachedBodyMTime[i] == trianglesMTime[i];
+    }
+    if ( sameInputs && vtkInternal::IsPoseUnchanged( pipeline->CachedSecondBodyToFirstBodyMatrix,
+      secondBodyToFirstBodyMatrix, this->PoseTranslationTolerance, this->PoseRotationTolerance ) )
+    {
+      this->NumberOfReusedResults++;
+      return false;
+    }
+  }
+  // The pose is compared to the last evaluation, so that slow motions add up until they exceed the tolerances
+  pipeline->CachedPoseValid = linear;
+  if ( linear )
   {
-    triangleFilter0->SetInputData(body);
-    triangleFilter0->Update();
-    collisionDetectionFilter->SetInputData(0, triangleFilter0->GetOutput() ); // no idea how expensive
-  } // don't care about expensive now, jut want this to work
+    std::copy( secondBodyToFirstBodyMatrix, secondBodyToFirstBodyMatrix + 16, pipeline->CachedSecondBodyToFirstBodyMatrix );
+    pipeline->CachedMaximumDistance = request.MaximumDistance;
+    for ( int i = 0; i < 2; i++ )
+    {
+      pipeline->CachedModel[i] = pipeline->Model[i];
+      pipeline->CachedBodyMTime[i] = trianglesMTime[i];
+    }
+  }
 
+  // The result is applied to the node by a later UpdateFrame. It is computed here if no worker thread is available.
+  if ( this->AsynchronousUpdate && this->Internal->PostRequest( pipeline, request ) )
+  {
+    return false;
+  }
 
-// second model ----------------------------------
-  vtkMRMLTransformNode* secondBodyParentTransform = secondModelNode->GetParentTransformNode();
-  if ( secondBodyParentTransform != NULL )
+  this->Internal->WaitForPipeline( pipeline );
+  // On the main thread, the filter traverses in parallel unless workers or builds already run on the cores
+  vtkInternal::ComputeCollision( pipeline, request, !this->Internal->HasRunningJobs(), pipeline->AppliedResult );
+  bwNode->SetClosestDistanceToModelFromToolTip( pipeline->AppliedResult.Distance );
+  bwNode->SetCollision( pipeline->AppliedResult.Collision );
+  return true;
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::UpdateFrame()
+{
+  std::vector< vtkMRMLCollisionWarningNode* > updatedNodes;
+
+  this->Internal->CollectFinishedBuilds();
+  // Post the requests of all the dirty nodes before waiting for anything, so that the workers evaluate them
+  // concurrently. Copy the set first, updating the nodes invokes events that may modify it.
+  std::vector< vtkMRMLNode* > dirtyNodes( this->Internal->DirtyNodes.begin(), this->Internal->DirtyNodes.end() );
+  this->Internal->DirtyNodes.clear();
+  double now = vtkTimerLog::GetUniversalTime();
+  for ( size_t i = 0; i < dirtyNodes.size(); i++ )
   {
-    vtkSmartPointer< vtkGeneralTransform > secondBodyToRasTransform = vtkSmartPointer< vtkGeneralTransform >::New();
-    secondBodyParentTransform->GetTransformToWorld( secondBodyToRasTransform );
+    // Nodes that have been removed from the scene are not dirty anymore. A node without a pipeline, because it had
+    // no model to watch, gets a new one from UpdateToolState.
+    vtkInternal::CollisionPipelineMapType::iterator pipeline = this->Internal->CollisionPipelines.find( dirtyNodes[i] );
+    if ( pipeline != this->Internal->CollisionPipelines.end() )
+    {
+      if ( now - pipeline->second.LastUpdateTime < this->MinimumUpdateInterval )
+      {
+        // Evaluated by a later frame, the events until then are merged into that evaluation
+        this->Internal->DirtyNodes.insert( dirtyNodes[i] );
+        continue;
+      }
+      pipeline->second.LastUpdateTime = now;
+    }
+    vtkMRMLCollisionWarningNode* bwNode = vtkMRMLCollisionWarningNode::SafeDownCast( dirtyNodes[i] );
+    if ( this->UpdateToolState( bwNode ) )
+    {
+      // Updated synchronously, e.g. with the bounding boxes while the hierarchies are built
+      updatedNodes.push_back( bwNode );
+    }
+  }
 
-    vtkSmartPointer< vtkTransformPolyDataFilter > secondBodyToRasFilter = vtkSmartPointer< vtkTransformPolyDataFilter >::New();
-#if (VTK_MAJOR_VERSION <= 5)
-    secondBodyToRasFilter->SetInput( secondBody );
-#else
-    secondBodyToRasFilter->SetInputData( secondBody );
-#endif
-    secondBodyToRasFilter->SetTransform( secondBodyToRasTransform );
-    secondBodyToRasFilter->Update();
+  this->ApplyCollisionResults( updatedNodes );
+  this->UpdateWarningStates( updatedNodes );
+}
 
-    triangleFilter1->SetInputData(secondBodyToRasFilter->GetOutput());
-    triangleFilter1->Update();
-    collisionDetectionFilter->SetInputData(1, triangleFilter1->GetOutput() );
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::ApplyCollisionResults( std::vector< vtkMRMLCollisionWarningNode* >& updatedNodes )
+{
+  if ( !this->Internal->ResultsPending.Load() )
+  {
+    return;
   }
-  else
+
+  // Collect the results first, applying them invokes events that may add or remove pipelines
+  std::vector< vtkMRMLNode* > resultNodes;
+  this->Internal->ResultsPending.Store( 0 );
+  for ( vtkInternal::CollisionPipelineMapType::iterator pipeline = this->Internal->CollisionPipelines.begin();
+    pipeline != this->Internal->CollisionPipelines.end(); ++pipeline )
   {
-    triangleFilter1->SetInputData(secondBody);
-    triangleFilter1->Update();
-    collisionDetectionFilter->SetInputData(1, triangleFilter1->GetOutput() ); // no idea how expensive
+    if ( pipeline->second.Results->Read( pipeline->second.AppliedVersion, pipeline->second.AppliedResult ) )
+    {
+      resultNodes.push_back( pipeline->first );
+    }
   }
-// end transform second model
 
-//vtkCollisionDetectionFilter only accepts triangles, hope it works this way
-//triangleFilters are set
+  for ( size_t i = 0; i < resultNodes.size(); i++ )
+  {
+    vtkInternal::CollisionPipelineMapType::iterator pipeline = this->Internal->CollisionPipelines.find( resultNodes[i] );
+    vtkMRMLCollisionWarningNode* bwNode = vtkMRMLCollisionWarningNode::SafeDownCast( resultNodes[i] );
+    if ( pipeline == this->Internal->CollisionPipelines.end() || bwNode == NULL )
+    {
+      continue;
+    }
+    bwNode->SetClosestDistanceToModelFromToolTip( pipeline->second.AppliedResult.Distance );
+    bwNode->SetCollision( pipeline->second.AppliedResult.Collision );
+    updatedNodes.push_back( bwNode );
+  }
+}
 
+//------------------------------------------------------------------------------
+bool vtkSlicerCollisionWarningLogic::HasPendingUpdates()
+{
+  return !this->Internal->DirtyNodes.empty() || this->Internal->HasRunningJobs();
+}
 
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::InvokePendingUpdatesEvent()
+{
+  if ( this->HasPendingUpdates() )
+  {
+    this->InvokeEvent( PendingUpdatesEvent );
+  }
+}
 
+//------------------------------------------------------------------------------
+unsigned long vtkSlicerCollisionWarningLogic::GetNumberOfRefittedModels()
+{
+  return this->Internal->NumberOfRefittedModels;
+}
 
-  triangleFilter1->SetInputData(secondBody);
+//------------------------------------------------------------------------------
+unsigned long vtkSlicerCollisionWarningLogic::GetNumberOfDroppedRequests()
+{
+  this->Internal->WorkerMutex->Lock();
+  unsigned long numberOfDroppedRequests = this->Internal->NumberOfDroppedRequests;
+  this->Internal->WorkerMutex->Unlock();
+  return numberOfDroppedRequests;
+}
 
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::ResetEventCounters()
+{
+  this->NumberOfMergedEvents = 0;
+  this->NumberOfReusedResults = 0;
+  this->Internal->NumberOfRefittedModels = 0;
+  this->Internal->WorkerMutex->Lock();
+  this->Internal->NumberOfDroppedRequests = 0;
+  this->Internal->WorkerMutex->Unlock();
+}
 
-  vtkSmartPointer<vtkMatrix4x4> matrix0 = vtkSmartPointer<vtkMatrix4x4>::New();
-  vtkSmartPointer<vtkMatrix4x4> matrix1 = vtkSmartPointer<vtkMatrix4x4>::New();
-  collisionDetectionFilter->SetMatrix(0, matrix0);
-  collisionDetectionFilter->SetMatrix(1, matrix1);
-  collisionDetectionFilter->GenerateScalarsOff();
-  collisionDetectionFilter->Update();
+//------------------------------------------------------------------------------
+int vtkSlicerCollisionWarningLogic::GetNumberOfContacts( vtkMRMLCollisionWarningNode* bwNode )
+{
+  vtkInternal::CollisionPipelineMapType::iterator pipeline = this->Internal->CollisionPipelines.find( bwNode );
+  if ( pipeline == this->Internal->CollisionPipelines.end() )
+  {
+    return 0;
+  }
+  return pipeline->second.AppliedResult.NumberOfContacts;
+}
 
-  if (collisionDetectionFilter->GetNumberOfContacts() > 0)
+//------------------------------------------------------------------------------
+bool vtkSlicerCollisionWarningLogic::GetClosestPoints( vtkMRMLCollisionWarningNode* bwNode, double closestPoints[6] )
+{
+  vtkInternal::CollisionPipelineMapType::iterator pipeline = this->Internal->CollisionPipelines.find( bwNode );
+  if ( pipeline == this->Internal->CollisionPipelines.end() || !pipeline->second.AppliedResult.HasClosestPoints )
   {
-     bwNode->SetCollision(true);
+    return false;
   }
-     else
+  // The points are relative to the first model, which may have moved since they were computed
+  for ( int i = 0; i < 2; i++ )
   {
-     bwNode->SetCollision(false);
+    double point[4] = { 0, 0, 0, 1 };
+    double rasPoint[4];
+    std::copy( pipeline->second.AppliedResult.ClosestPoints + 3 * i, pipeline->second.AppliedResult.ClosestPoints + 3 * i + 3,
+      point );
+    vtkMatrix4x4::MultiplyPoint( pipeline->second.FirstBodyToRasMatrix, point, rasPoint );
+    std::copy( rasPoint, rasPoint + 3, closestPoints + 3 * i );
   }
+  return true;
+}
 
-
-
-  // Note: Performance could be improved by
-  // - keeping the filter in memory for all the observed nodes.
-  // - in case of linear transform of model and tooltip: transform only the tooltip (with the tooltip to model transform),
-  //   and not transform the model at all
-  //   --> not valid for collision detection
-
-
-
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::RemoveCollisionPipeline( vtkMRMLNode* bwNode )
+{
+  this->Internal->DirtyNodes.erase( bwNode );
+  vtkInternal::CollisionPipelineMapType::iterator pipeline = this->Internal->CollisionPipelines.find( bwNode );
+  if ( pipeline == this->Internal->CollisionPipelines.end() )
+  {
+    return;
+  }
+  this->Internal->WaitForPipeline( &pipeline->second );
+  this->Internal->ReleasePipelineModels( &pipeline->second );
+  delete pipeline->second.Results;
+  this->Internal->CollisionPipelines.erase( pipeline );
 }
 
 
@@ -332,6 +1546,18 @@ void vtkSlicerCollisionWarningLogic::OnMRMLSceneNodeAdded( vtkMRMLNode* node )
     events->InsertNextValue( vtkCommand::ModifiedEvent );
     events->InsertNextValue( vtkMRMLCollisionWarningNode::InputDataModifiedEvent );
     vtkObserveMRMLNodeEventsMacro( bwNode, events.GetPointer() );
+
+    // Start building the hierarchies of the models in the background, so that they are ready for the first update
+    vtkInternal::CollisionPipeline* pipeline = this->Internal->GetCollisionPipeline( bwNode );
+    vtkMRMLModelNode* modelNodes[2] = { bwNode->GetWatchedModelNode(), bwNode->GetSecondModelNode() };
+    for ( int i = 0; i < 2; i++ )
+    {
+      if ( modelNodes[i] != NULL && modelNodes[i]->GetPolyData() != NULL )
+      {
+        this->Internal->SetPipelineModel( pipeline, i, modelNodes[i]->GetPolyData() );
+      }
+    }
+    this->InvokePendingUpdatesEvent();
     if(bwNode->GetPlayWarningSound() && bwNode->IsToolTipInsideModel())
     {
       // Add to list of playing nodes (if not there already)
@@ -370,6 +1596,7 @@ void vtkSlicerCollisionWarningLogic::OnMRMLSceneNodeRemoved( vtkMRMLNode* node )
   {
     vtkDebugMacro( "OnMRMLSceneNodeRemoved" );
     vtkUnObserveMRMLNodeMacro( node );
+    this->RemoveCollisionPipeline( node );
     for (std::deque< vtkWeakPointer< vtkMRMLCollisionWarningNode > >::iterator it=this->WarningSoundPlayingNodes.begin(); it!=this->WarningSoundPlayingNodes.end(); ++it)
     {
       if (it->GetPointer()==node)
@@ -528,7 +1755,47 @@ void vtkSlicerCollisionWarningLogic::ProcessMRMLNodesEvents( vtkObject* caller,
   {
     // only recompute output if the input is changed
     // (for example we do not recompute the distance if the computed distance is changed)
-    this->UpdateToolState(bwNode);
+    if ( this->Internal->DirtyNodes.count( bwNode ) > 0 )
+    {
+      // A tracker update through a transform hierarchy fires several events, they are merged into one evaluation
+      this->NumberOfMergedEvents++;
+      return;
+    }
+    vtkInternal::CollisionPipelineMapType::iterator pipeline = this->Internal->CollisionPipelines.find( bwNode );
+    double now = vtkTimerLog::GetUniversalTime();
+    if ( this->AsynchronousUpdate
+      || ( pipeline != this->Internal->CollisionPipelines.end()
+      && now - pipeline->second.LastUpdateTime < this->MinimumUpdateInterval ) )
+    {
+      // Evaluated with the other modified nodes by the next UpdateFrame that is at least the minimum interval after
+      // the last evaluation of the node
+      this->Internal->DirtyNodes.insert( bwNode );
+      this->InvokeEvent( PendingUpdatesEvent );
+      return;
+    }
+    if ( pipeline != this->Internal->CollisionPipelines.end() )
+    {
+      pipeline->second.LastUpdateTime = now;
+    }
+    if ( this->UpdateToolState(bwNode) )
+    {
+      this->UpdateWarningStates( std::vector< vtkMRMLCollisionWarningNode* >( 1, bwNode ) );
+    }
+    // The frames collect the hierarchies whose build has been started
+    this->InvokePendingUpdatesEvent();
+  }
+}
+
+//------------------------------------------------------------------------------
+void vtkSlicerCollisionWarningLogic::UpdateWarningStates( const std::vector< vtkMRMLCollisionWarningNode* >& bwNodes )
+{
+  if ( bwNodes.empty() )
+  {
+    return;
+  }
+  for ( size_t i = 0; i < bwNodes.size(); i++ )
+  {
+    vtkMRMLCollisionWarningNode* bwNode = bwNodes[i];
     if(bwNode->GetDisplayWarningColor())
     {
       this->UpdateModelColor(bwNode);
@@ -558,6 +1825,7 @@ void vtkSlicerCollisionWarningLogic::ProcessMRMLNodesEvents( vtkObject* caller,
         this->WarningSoundPlayingNodes.erase(foundPlayingNodeIt);
       }
     }
-    this->SetWarningSoundPlaying(!this->WarningSoundPlayingNodes.empty());
   }
+  // The sound state is only updated once for the whole batch
+  this->SetWarningSoundPlaying(!this->WarningSoundPlayingNodes.empty());
 }
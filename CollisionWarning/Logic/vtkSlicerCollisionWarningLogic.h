@@ -26,8 +26,10 @@
 
 #include <string>
 #include <deque>
+#include <vector>
 
 // VTK includes
+#include "vtkCommand.h"
 #include "vtkWeakPointer.h"
 
 // Slicer includes
@@ -62,6 +64,14 @@ public:
   vtkTypeMacro(vtkSlicerCollisionWarningLogic,vtkSlicerModuleLogic);
   void PrintSelf(ostream& os, vtkIndent indent);
 
+  enum Events
+  {
+    /// Invoked when UpdateFrame has work to do: module nodes to evaluate, results of the worker threads to apply or
+    /// model hierarchies being built. Until HasPendingUpdates returns false, UpdateFrame has to be called periodically.
+    // vtkCommand::UserEvent + 556 follows the InputDataModifiedEvent of vtkMRMLCollisionWarningNode
+    PendingUpdatesEvent = vtkCommand::UserEvent + 556
+  };
+
   /// Changes the watched model node, making sure the original color of the previously selected model node is restored
   void SetWatchedModelNode( vtkMRMLModelNode* newModel, vtkMRMLCollisionWarningNode* moduleNode );
   void SetSecondModelNode( vtkMRMLModelNode* newModel, vtkMRMLCollisionWarningNode* moduleNode );
@@ -72,6 +82,69 @@ public:
   vtkGetMacro(WarningSoundPlaying, bool);
   vtkSetMacro(WarningSoundPlaying, bool);
 
+  /// If enabled, the collisions are computed on a pool of worker threads instead of in the event handlers of the main
+  /// thread. The module nodes modified by the events are evaluated by the next UpdateFrame. Enabled by default.
+  vtkGetMacro(AsynchronousUpdate, bool);
+  vtkSetMacro(AsynchronousUpdate, bool);
+  vtkBooleanMacro(AsynchronousUpdate, bool);
+
+  /// Minimum time between two evaluations of a module node, in seconds. The input modified events of a node that
+  /// arrive earlier are merged and the node is evaluated by the first UpdateFrame after the interval, with its latest
+  /// inputs. 0 evaluates each modified node once per frame, or on each event if the update is not asynchronous.
+  /// Default is 0.
+  vtkGetMacro(MinimumUpdateInterval, double);
+  vtkSetClampMacro(MinimumUpdateInterval, double, 0.0, VTK_DOUBLE_MAX);
+
+  /// Number of input modified events that have been merged into the pending evaluation of their module node
+  vtkGetMacro(NumberOfMergedEvents, unsigned long);
+
+  /// Number of evaluations that have been dropped because a newer pose of the module node was posted to the worker
+  /// threads before any of them started it
+  unsigned long GetNumberOfDroppedRequests();
+
+  /// Tolerances of the motion of the second model relative to the first one, below which the result of the last
+  /// evaluation of a module node is reused instead of computing it again, as long as the polydata of the models have
+  /// not been modified either. The translation is in mm and the rotation in degrees. Only used if both model
+  /// transforms are linear. A negative tolerance always computes. Defaults are 0.001.
+  vtkGetMacro(PoseTranslationTolerance, double);
+  vtkSetMacro(PoseTranslationTolerance, double);
+  vtkGetMacro(PoseRotationTolerance, double);
+  vtkSetMacro(PoseRotationTolerance, double);
+
+  /// Number of evaluations that have been skipped because the relative pose of the models had not changed
+  vtkGetMacro(NumberOfReusedResults, unsigned long);
+
+  /// Number of model modifications that only moved the points of the model, for which the collision hierarchy of the
+  /// model has been refitted to the moved points instead of being built again
+  unsigned long GetNumberOfRefittedModels();
+
+  /// Largest distance between the models that is computed exactly, in mm. Models farther apart are rejected from
+  /// their bounding boxes without searching their closest points, and the distance reported for them is a lower
+  /// bound, at least the maximum distance. VTK_DOUBLE_MAX always computes the distance. Default is 100.
+  vtkGetMacro(MaximumDistance, double);
+  vtkSetClampMacro(MaximumDistance, double, 0.0, VTK_DOUBLE_MAX);
+
+  /// Resets the numbers of merged events, dropped requests, reused results and refitted models to 0
+  void ResetEventCounters();
+
+  /// Frame of the asynchronous update, has to be called periodically on the main thread while HasPendingUpdates.
+  /// Posts a snapshot of the poses of every module node modified since the last frame, or whose models have been
+  /// rebuilt since, to the worker threads, which evaluate the nodes concurrently and only compute the latest snapshot
+  /// of each node. Then applies the results computed since the last frame to the module nodes, and updates the model
+  /// colors and the warning sound in one batch.
+  void UpdateFrame();
+
+  /// Returns true if UpdateFrame has work to do, see PendingUpdatesEvent
+  bool HasPendingUpdates();
+
+  /// Returns the number of contacts found by the last collision computation of the module node that has been applied,
+  /// 0 if the models do not touch
+  int GetNumberOfContacts( vtkMRMLCollisionWarningNode* bwNode );
+
+  /// Gets the closest points of the two models in RAS found by the last collision computation of the module node
+  /// that has been applied. They move with the first model. Returns false if there is none.
+  bool GetClosestPoints( vtkMRMLCollisionWarningNode* bwNode, double closestPoints[6] );
+
 protected:
   vtkSlicerCollisionWarningLogic();
   virtual ~vtkSlicerCollisionWarningLogic();
@@ -83,15 +156,41 @@ protected:
   virtual void OnMRMLSceneNodeAdded(vtkMRMLNode* node);
   virtual void OnMRMLSceneNodeRemoved(vtkMRMLNode* node);
 
-  void UpdateToolState( vtkMRMLCollisionWarningNode* bwNode );
+  /// Computes the collision state of the module node, or posts it to the worker threads if the update is
+  /// asynchronous. Returns true if the state of the node has been updated.
+  bool UpdateToolState( vtkMRMLCollisionWarningNode* bwNode );
   void UpdateModelColor( vtkMRMLCollisionWarningNode* bwNode );
 
+  /// Applies the results that the worker threads have computed since the last call to the module nodes, and appends
+  /// the updated nodes to updatedNodes
+  void ApplyCollisionResults( std::vector< vtkMRMLCollisionWarningNode* >& updatedNodes );
+
+  /// Updates the model colors and the list of nodes playing the warning sound from the computed collision states of
+  /// the module nodes, then the warning sound once
+  void UpdateWarningStates( const std::vector< vtkMRMLCollisionWarningNode* >& bwNodes );
+
+  /// Release the collision detection pipeline that is kept for the module node, and cancel its pending evaluation
+  void RemoveCollisionPipeline( vtkMRMLNode* bwNode );
+
+  /// Invokes PendingUpdatesEvent if UpdateFrame has work to do
+  void InvokePendingUpdatesEvent();
+
 private:
   vtkSlicerCollisionWarningLogic(const vtkSlicerCollisionWarningLogic&); // Not implemented
   void operator=(const vtkSlicerCollisionWarningLogic&);               // Not implemented
 
   std::deque< vtkWeakPointer< vtkMRMLCollisionWarningNode > > WarningSoundPlayingNodes;
   bool WarningSoundPlaying;
+  bool AsynchronousUpdate;
+  double MinimumUpdateInterval;
+  unsigned long NumberOfMergedEvents;
+  double PoseTranslationTolerance;
+  double PoseRotationTolerance;
+  unsigned long NumberOfReusedResults;
+  double MaximumDistance;
+
+  class vtkInternal;
+  vtkInternal* Internal;
 };
 
 #endif
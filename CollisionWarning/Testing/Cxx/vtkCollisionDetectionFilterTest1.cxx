@@ -0,0 +1,339 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// Checks the intersections found by vtkCollisionDetectionFilter against a brute force test of all the pairs of
+// triangles of the models with IntersectPolygonWithPolygon: first the triangle tests of vtkCollisionTriangleKernel,
+// then the contacting cells found in VTK_ALL_CONTACTS and VTK_FIRST_CONTACT modes, with each instruction set that
+// the processor supports
+
+// CollisionWarning includes
+#include "vtkCollisionDetectionFilter.h"
+#include "vtkCollisionHierarchy.h"
+#include "vtkCollisionTriangleKernel.h"
+
+// VTK includes
+#include <vtkIdTypeArray.h>
+#include <vtkMath.h>
+#include <vtkMatrix4x4.h>
+#include <vtkNew.h>
+#include <vtkPoints.h>
+#include <vtkPolyData.h>
+#include <vtkSphereSource.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+typedef std::set< std::pair< vtkIdType, vtkIdType > > CellPairSet;
+
+//------------------------------------------------------------------------------
+// Sets the matrix to a random rotation followed by a translation to a random point at the distance from the center
+void SetRandomPose( vtkMatrix4x4* matrix, const double center[3], double distance )
+{
+  double angleX = vtkMath::Random( 0.0, 2.0 * vtkMath::Pi() );
+  double angleY = vtkMath::Random( 0.0, 2.0 * vtkMath::Pi() );
+  double cx = cos( angleX ), sx = sin( angleX ), cy = cos( angleY ), sy = sin( angleY );
+  double rotation[3][3] = { { cy, 0, sy }, { sx * sy, cx, -sx * cy }, { -cx * sy, sx, cx * cy } };
+  double direction[3] = { vtkMath::Random( -1.0, 1.0 ), vtkMath::Random( -1.0, 1.0 ), vtkMath::Random( -1.0, 1.0 ) };
+  vtkMath::Normalize( direction );
+  matrix->Identity();
+  for ( int i = 0; i < 3; i++ )
+  {
+    for ( int j = 0; j < 3; j++ )
+    {
+      matrix->SetElement( i, j, rotation[i][j] );
+    }
+    matrix->SetElement( i, 3, center[i] + distance * direction[i] );
+  }
+}
+
+//------------------------------------------------------------------------------
+// Gets the vertices of a triangle of the polydata transformed by the matrix and their bounds
+void GetTriangle( vtkPolyData* polyData, vtkIdType cellId, vtkMatrix4x4* matrix, double points[9], double bounds[6] )
+{
+  vtkIdType numberOfPoints = 0;
+  vtkIdType* pointIds = NULL;
+  polyData->GetCellPoints( cellId, numberOfPoints, pointIds );
+  for ( int axis = 0; axis < 3; axis++ )
+  {
+    bounds[ 2 * axis ] = VTK_DOUBLE_MAX;
+    bounds[ 2 * axis + 1 ] = -VTK_DOUBLE_MAX;
+  }
+  for ( int k = 0; k < 3; k++ )
+  {
+    double point[4] = { 0, 0, 0, 1 };
+    double transformedPoint[4];
+    polyData->GetPoints()->GetPoint( pointIds[k], point );
+    matrix->MultiplyPoint( point, transformedPoint );
+    for ( int axis = 0; axis < 3; axis++ )
+    {
+      points[ 3 * k + axis ] = transformedPoint[axis];
+      bounds[ 2 * axis ] = std::min( bounds[ 2 * axis ], transformedPoint[axis] );
+      bounds[ 2 * axis + 1 ] = std::max( bounds[ 2 * axis + 1 ], transformedPoint[axis] );
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Gets the plane of the triangle, unit normal and offset
+void GetTrianglePlane( const double points[9], double plane[4] )
+{
+  double u[3];
+  double v[3];
+  vtkMath::Subtract( points + 3, points, u );
+  vtkMath::Subtract( points + 6, points, v );
+  vtkMath::Cross( u, v, plane );
+  vtkMath::Normalize( plane );
+  plane[3] = -vtkMath::Dot( plane, points );
+}
+
+//------------------------------------------------------------------------------
+// Pairs of cells of the models that intersect, from all the pairs of triangles, in the coordinate system of the
+// first model
+CellPairSet FindIntersectingCells( vtkCollisionDetectionFilter* filter, vtkPolyData* first, vtkPolyData* second,
+  vtkMatrix4x4* secondToFirst )
+{
+  vtkNew<vtkMatrix4x4> identity;
+  std::vector< double > secondPoints( 9 * second->GetNumberOfCells() );
+  std::vector< double > secondBounds( 6 * second->GetNumberOfCells() );
+  for ( vtkIdType j = 0; j < second->GetNumberOfCells(); j++ )
+  {
+    GetTriangle( second, j, secondToFirst, &secondPoints[ 9 * j ], &secondBounds[ 6 * j ] );
+  }
+  CellPairSet intersectingCells;
+  for ( vtkIdType i = 0; i < first->GetNumberOfCells(); i++ )
+  {
+    double points[9];
+    double bounds[6];
+    GetTriangle( first, i, identity.GetPointer(), points, bounds );
+    for ( vtkIdType j = 0; j < second->GetNumberOfCells(); j++ )
+    {
+      double x1[3];
+      double x2[3];
+      if ( filter->IntersectPolygonWithPolygon( 3, points, bounds, 3, &secondPoints[ 9 * j ], &secondBounds[ 6 * j ],
+        0.0, x1, x2, vtkCollisionDetectionFilter::VTK_ALL_CONTACTS ) )
+      {
+        intersectingCells.insert( std::make_pair( i, j ) );
+      }
+    }
+  }
+  return intersectingCells;
+}
+
+//------------------------------------------------------------------------------
+// Tests each triangle of the first model against the triangle table of the hierarchy of the second one, which are
+// in the same coordinate system: the candidates of each instruction set must be the same and include all the
+// triangles that intersect it, and IntersectTriangles must agree with IntersectPolygonWithPolygon.
+// Returns the number of intersecting pairs, -1 on error.
+int CheckTriangleKernel( vtkCollisionDetectionFilter* filter, vtkPolyData* first, vtkCollisionHierarchy* hierarchy )
+{
+  vtkNew<vtkMatrix4x4> identity;
+  const vtkCollisionHierarchy::TriangleTable& table = hierarchy->GetTriangles();
+  vtkIdType count = hierarchy->GetDataSet()->GetNumberOfCells();
+  std::vector< vtkIdType > candidates( count );
+  int numberOfIntersections = 0;
+  for ( vtkIdType i = 0; i < first->GetNumberOfCells(); i++ )
+  {
+    double points[9];
+    double bounds[6];
+    double plane[4];
+    GetTriangle( first, i, identity.GetPointer(), points, bounds );
+    GetTrianglePlane( points, plane );
+
+    std::vector< vtkIdType > scalarCandidates;
+    for ( int instructionSet = vtkCollisionTriangleKernel::SCALAR;
+      instructionSet <= vtkCollisionTriangleKernel::GetSupportedInstructionSet(); instructionSet++ )
+    {
+      vtkIdType numberOfCandidates = vtkCollisionTriangleKernel::FindCandidates( points, bounds, plane, table, 0,
+        count, 0.0, &candidates[0], instructionSet );
+      std::vector< vtkIdType > sortedCandidates( candidates.begin(), candidates.begin() + numberOfCandidates );
+      std::sort( sortedCandidates.begin(), sortedCandidates.end() );
+      if ( instructionSet == vtkCollisionTriangleKernel::SCALAR )
+      {
+        scalarCandidates = sortedCandidates;
+      }
+      else if ( sortedCandidates != scalarCandidates )
+      {
+        std::cerr << "Triangle " << i << ": instruction set " << instructionSet << " finds " << numberOfCandidates
+          << " candidates, the scalar instructions " << scalarCandidates.size() << std::endl;
+        return -1;
+      }
+    }
+
+    for ( vtkIdType k = 0; k < count; k++ )
+    {
+      double tablePoints[9];
+      double tableBounds[6];
+      double tablePlane[4];
+      for ( int c = 0; c < 9; c++ )
+      {
+        tablePoints[c] = table.Points[c][k];
+      }
+      for ( int c = 0; c < 6; c++ )
+      {
+        tableBounds[c] = table.Bounds[c][k];
+      }
+      for ( int c = 0; c < 4; c++ )
+      {
+        tablePlane[c] = table.Plane[c][k];
+      }
+      double x1[3];
+      double x2[3];
+      int intersect = filter->IntersectPolygonWithPolygon( 3, points, bounds, 3, tablePoints, tableBounds, 0.0, x1, x2,
+        vtkCollisionDetectionFilter::VTK_ALL_CONTACTS );
+      int kernelIntersect = vtkCollisionTriangleKernel::IntersectTriangles( points, plane, tablePoints, tablePlane, 0.0,
+        x1, x2 );
+      if ( intersect != kernelIntersect )
+      {
+        std::cerr << "Triangles " << i << " and " << hierarchy->GetCellIds()[k] << ": IntersectTriangles returns "
+          << kernelIntersect << ", IntersectPolygonWithPolygon " << intersect << std::endl;
+        return -1;
+      }
+      if ( intersect && !std::binary_search( scalarCandidates.begin(), scalarCandidates.end(), k ) )
+      {
+        std::cerr << "Triangles " << i << " and " << hierarchy->GetCellIds()[k]
+          << " intersect, but the second one is not a candidate" << std::endl;
+        return -1;
+      }
+      numberOfIntersections += intersect;
+    }
+  }
+  return numberOfIntersections;
+}
+
+} // end of anonymous namespace
+
+//------------------------------------------------------------------------------
+int vtkCollisionDetectionFilterTest1( int vtkNotUsed(argc), char* vtkNotUsed(argv)[] )
+{
+  vtkMath::RandomSeed( 1 );
+
+  vtkNew<vtkSphereSource> firstSphere;
+  firstSphere->SetRadius( 1.0 );
+  firstSphere->SetThetaResolution( 16 );
+  firstSphere->SetPhiResolution( 16 );
+  firstSphere->Update();
+  vtkPolyData* first = firstSphere->GetOutput();
+
+  vtkNew<vtkCollisionDetectionFilter> filter;
+
+  // Triangle tests, with the second sphere moved along x through the first one
+  for ( int step = 0; step < 3; step++ )
+  {
+    vtkNew<vtkSphereSource> secondSphere;
+    secondSphere->SetRadius( 0.8 );
+    secondSphere->SetThetaResolution( 12 );
+    secondSphere->SetPhiResolution( 14 );
+    secondSphere->SetCenter( 1.4 + 0.2 * step, 0.1, 0.05 );
+    secondSphere->Update();
+    vtkNew<vtkCollisionHierarchy> hierarchy;
+    hierarchy->SetDataSet( secondSphere->GetOutput() );
+    hierarchy->BuildHierarchy();
+    int numberOfIntersections = CheckTriangleKernel( filter.GetPointer(), first, hierarchy.GetPointer() );
+    if ( numberOfIntersections < 0 )
+    {
+      std::cerr << "Line " << __LINE__ << ": the triangle tests differ at step " << step << std::endl;
+      return EXIT_FAILURE;
+    }
+    if ( step == 0 && numberOfIntersections == 0 )
+    {
+      std::cerr << "Line " << __LINE__ << ": the spheres do not intersect, nothing has been tested" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Contacts of the models in random poses around the touching distance of the spheres
+  vtkNew<vtkSphereSource> secondSphere;
+  secondSphere->SetRadius( 0.8 );
+  secondSphere->SetThetaResolution( 12 );
+  secondSphere->SetPhiResolution( 14 );
+  secondSphere->Update();
+  vtkPolyData* second = secondSphere->GetOutput();
+
+  vtkNew<vtkMatrix4x4> firstToWorld;
+  vtkNew<vtkMatrix4x4> secondToWorld;
+  vtkNew<vtkMatrix4x4> worldToFirst;
+  vtkNew<vtkMatrix4x4> secondToFirst;
+  filter->SetInputData( 0, first );
+  filter->SetInputData( 1, second );
+  filter->SetMatrix( 0, firstToWorld.GetPointer() );
+  filter->SetMatrix( 1, secondToWorld.GetPointer() );
+
+  int numberOfCollisions = 0;
+  int numberOfPoses = 12;
+  for ( int pose = 0; pose < numberOfPoses; pose++ )
+  {
+    // The spheres are centered on their origins, their centers are 1.3 to 2 apart and their radii add up to 1.8
+    double origin[3] = { 0, 0, 0 };
+    SetRandomPose( firstToWorld.GetPointer(), origin, vtkMath::Random( 0.0, 1.0 ) );
+    double firstCenter[3] = { firstToWorld->GetElement( 0, 3 ), firstToWorld->GetElement( 1, 3 ),
+      firstToWorld->GetElement( 2, 3 ) };
+    SetRandomPose( secondToWorld.GetPointer(), firstCenter, vtkMath::Random( 1.3, 2.0 ) );
+    vtkMatrix4x4::Invert( firstToWorld.GetPointer(), worldToFirst.GetPointer() );
+    vtkMatrix4x4::Multiply4x4( worldToFirst.GetPointer(), secondToWorld.GetPointer(), secondToFirst.GetPointer() );
+    CellPairSet expectedCells = FindIntersectingCells( filter.GetPointer(), first, second, secondToFirst.GetPointer() );
+    numberOfCollisions += ( expectedCells.empty() ? 0 : 1 );
+
+    for ( int instructionSet = vtkCollisionTriangleKernel::SCALAR;
+      instructionSet <= vtkCollisionTriangleKernel::GetSupportedInstructionSet(); instructionSet++ )
+    {
+      filter->SetInstructionSet( instructionSet );
+      filter->SetCollisionModeToAllContacts();
+      filter->Update();
+      vtkIdTypeArray* contactCells[2] = { filter->GetContactCells( 0 ), filter->GetContactCells( 1 ) };
+      CellPairSet cells;
+      for ( vtkIdType i = 0; i < contactCells[0]->GetNumberOfTuples(); i++ )
+      {
+        cells.insert( std::make_pair( contactCells[0]->GetValue( i ), contactCells[1]->GetValue( i ) ) );
+      }
+      if ( cells != expectedCells || filter->GetNumberOfContacts() != static_cast< int >( expectedCells.size() )
+        || contactCells[0]->GetNumberOfTuples() != static_cast< vtkIdType >( expectedCells.size() ) )
+      {
+        std::cerr << "Line " << __LINE__ << ": pose " << pose << " instruction set " << instructionSet << ": "
+          << filter->GetNumberOfContacts() << " contacts, " << expectedCells.size() << " intersecting cells"
+          << std::endl;
+        return EXIT_FAILURE;
+      }
+
+      filter->SetCollisionModeToFirstContact();
+      filter->Update();
+      if ( filter->GetNumberOfContacts() != ( expectedCells.empty() ? 0 : 1 ) || ( filter->GetNumberOfContacts() > 0
+        && expectedCells.count( std::make_pair( filter->GetContactCells( 0 )->GetValue( 0 ),
+        filter->GetContactCells( 1 )->GetValue( 0 ) ) ) == 0 ) )
+      {
+        std::cerr << "Line " << __LINE__ << ": pose " << pose << " instruction set " << instructionSet
+          << ": the first contact is not one of the " << expectedCells.size() << " intersecting cells" << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  if ( numberOfCollisions == 0 || numberOfCollisions == numberOfPoses )
+  {
+    std::cerr << "Line " << __LINE__ << ": " << numberOfCollisions << " of the " << numberOfPoses
+      << " poses collide, both cases have to be tested" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
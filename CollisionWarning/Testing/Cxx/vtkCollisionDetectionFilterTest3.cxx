@@ -0,0 +1,210 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// Checks the proximity query of vtkCollisionDetectionFilter against the smallest distance between all the pairs of
+// triangles of the models: VTK_WITHIN_DISTANCE mode finds one pair of cells within a proximity distance just above
+// the distance, whose closest points are within it, and none within a proximity distance just below
+
+// CollisionWarning includes
+#include "vtkCollisionDetectionFilter.h"
+#include "vtkCollisionTriangleKernel.h"
+
+// VTK includes
+#include <vtkMath.h>
+#include <vtkMatrix4x4.h>
+#include <vtkNew.h>
+#include <vtkPoints.h>
+#include <vtkPolyData.h>
+#include <vtkSphereSource.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+
+//------------------------------------------------------------------------------
+// Sets the matrix to a random rotation followed by a translation to a random point at the distance from the center
+void SetRandomPose( vtkMatrix4x4* matrix, const double center[3], double distance )
+{
+  double angleX = vtkMath::Random( 0.0, 2.0 * vtkMath::Pi() );
+  double angleY = vtkMath::Random( 0.0, 2.0 * vtkMath::Pi() );
+  double cx = cos( angleX ), sx = sin( angleX ), cy = cos( angleY ), sy = sin( angleY );
+  double rotation[3][3] = { { cy, 0, sy }, { sx * sy, cx, -sx * cy }, { -cx * sy, sx, cx * cy } };
+  double direction[3] = { vtkMath::Random( -1.0, 1.0 ), vtkMath::Random( -1.0, 1.0 ), vtkMath::Random( -1.0, 1.0 ) };
+  vtkMath::Normalize( direction );
+  matrix->Identity();
+  for ( int i = 0; i < 3; i++ )
+  {
+    for ( int j = 0; j < 3; j++ )
+    {
+      matrix->SetElement( i, j, rotation[i][j] );
+    }
+    matrix->SetElement( i, 3, center[i] + distance * direction[i] );
+  }
+}
+
+//------------------------------------------------------------------------------
+// Gets the vertices of the triangles of the polydata transformed by the matrix, and their planes
+void GetTriangles( vtkPolyData* polyData, vtkMatrix4x4* matrix, std::vector< double >& points,
+  std::vector< double >& planes )
+{
+  points.resize( 9 * polyData->GetNumberOfCells() );
+  planes.resize( 4 * polyData->GetNumberOfCells() );
+  for ( vtkIdType cellId = 0; cellId < polyData->GetNumberOfCells(); cellId++ )
+  {
+    vtkIdType numberOfPoints = 0;
+    vtkIdType* pointIds = NULL;
+    polyData->GetCellPoints( cellId, numberOfPoints, pointIds );
+    double* triangle = &points[ 9 * cellId ];
+    for ( int k = 0; k < 3; k++ )
+    {
+      double point[4] = { 0, 0, 0, 1 };
+      double transformedPoint[4];
+      polyData->GetPoints()->GetPoint( pointIds[k], point );
+      matrix->MultiplyPoint( point, transformedPoint );
+      std::copy( transformedPoint, transformedPoint + 3, triangle + 3 * k );
+    }
+    double* plane = &planes[ 4 * cellId ];
+    double u[3];
+    double v[3];
+    vtkMath::Subtract( triangle + 3, triangle, u );
+    vtkMath::Subtract( triangle + 6, triangle, v );
+    vtkMath::Cross( u, v, plane );
+    vtkMath::Normalize( plane );
+    plane[3] = -vtkMath::Dot( plane, triangle );
+  }
+}
+
+//------------------------------------------------------------------------------
+// Smallest distance between the triangles of the models in world coordinates, from all the pairs of triangles
+double ComputeDistance( vtkPolyData* first, vtkMatrix4x4* firstToWorld, vtkPolyData* second,
+  vtkMatrix4x4* secondToWorld )
+{
+  std::vector< double > firstPoints;
+  std::vector< double > firstPlanes;
+  std::vector< double > secondPoints;
+  std::vector< double > secondPlanes;
+  GetTriangles( first, firstToWorld, firstPoints, firstPlanes );
+  GetTriangles( second, secondToWorld, secondPoints, secondPlanes );
+  double distance = VTK_DOUBLE_MAX;
+  for ( vtkIdType i = 0; i < first->GetNumberOfCells(); i++ )
+  {
+    for ( vtkIdType j = 0; j < second->GetNumberOfCells(); j++ )
+    {
+      double closestFirst[3];
+      double closestSecond[3];
+      distance = std::min( distance, vtkCollisionTriangleKernel::DistanceBetweenTriangles( &firstPoints[ 9 * i ],
+        &firstPlanes[ 4 * i ], &secondPoints[ 9 * j ], &secondPlanes[ 4 * j ], closestFirst, closestSecond ) );
+    }
+  }
+  return distance;
+}
+
+//------------------------------------------------------------------------------
+// Distance between the two points of the contacts output of the filter, -1 if there are not two points
+double GetClosestPointsDistance( vtkCollisionDetectionFilter* filter )
+{
+  vtkPoints* points = filter->GetContactsOutput()->GetPoints();
+  if ( points == NULL || points->GetNumberOfPoints() != 2 )
+  {
+    return -1.0;
+  }
+  double firstPoint[3];
+  double secondPoint[3];
+  points->GetPoint( 0, firstPoint );
+  points->GetPoint( 1, secondPoint );
+  return sqrt( vtkMath::Distance2BetweenPoints( firstPoint, secondPoint ) );
+}
+
+} // end of anonymous namespace
+
+//------------------------------------------------------------------------------
+int vtkCollisionDetectionFilterTest3( int vtkNotUsed(argc), char* vtkNotUsed(argv)[] )
+{
+  vtkMath::RandomSeed( 3 );
+
+  vtkNew<vtkSphereSource> firstSphere;
+  firstSphere->SetRadius( 1.0 );
+  firstSphere->SetThetaResolution( 16 );
+  firstSphere->SetPhiResolution( 16 );
+  firstSphere->Update();
+  vtkPolyData* first = firstSphere->GetOutput();
+
+  vtkNew<vtkSphereSource> secondSphere;
+  secondSphere->SetRadius( 0.8 );
+  secondSphere->SetThetaResolution( 12 );
+  secondSphere->SetPhiResolution( 14 );
+  secondSphere->Update();
+  vtkPolyData* second = secondSphere->GetOutput();
+
+  vtkNew<vtkMatrix4x4> firstToWorld;
+  vtkNew<vtkMatrix4x4> secondToWorld;
+  vtkNew<vtkCollisionDetectionFilter> filter;
+  filter->SetInputData( 0, first );
+  filter->SetInputData( 1, second );
+  filter->SetMatrix( 0, firstToWorld.GetPointer() );
+  filter->SetMatrix( 1, secondToWorld.GetPointer() );
+
+  int numberOfCollisions = 0;
+  int numberOfPoses = 16;
+  for ( int pose = 0; pose < numberOfPoses; pose++ )
+  {
+    // The spheres are centered on their origins and their radii add up to 1.8: from intersecting to 3 apart
+    double origin[3] = { 0, 0, 0 };
+    SetRandomPose( firstToWorld.GetPointer(), origin, vtkMath::Random( 0.0, 1.0 ) );
+    double firstCenter[3] = { firstToWorld->GetElement( 0, 3 ), firstToWorld->GetElement( 1, 3 ),
+      firstToWorld->GetElement( 2, 3 ) };
+    SetRandomPose( secondToWorld.GetPointer(), firstCenter, vtkMath::Random( 1.4, 4.8 ) );
+    double expectedDistance = ComputeDistance( first, firstToWorld.GetPointer(), second, secondToWorld.GetPointer() );
+    numberOfCollisions += ( expectedDistance == 0.0 ? 1 : 0 );
+
+    // A pair of cells within the proximity distance is found if and only if the models are closer than it
+    filter->SetCollisionModeToWithinDistance();
+    filter->SetProximityDistance( expectedDistance * 1.001 + 1e-6 );
+    filter->Update();
+    if ( filter->GetNumberOfContacts() != 1
+      || GetClosestPointsDistance( filter.GetPointer() ) > expectedDistance * 1.001 + 1e-6 )
+    {
+      std::cerr << "Line " << __LINE__ << ": pose " << pose << ": " << filter->GetNumberOfContacts()
+        << " contacts within distance " << filter->GetProximityDistance() << ", expected 1" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if ( expectedDistance > 0 )
+    {
+      filter->SetProximityDistance( expectedDistance * 0.999 );
+      filter->Update();
+      if ( filter->GetNumberOfContacts() != 0 )
+      {
+        std::cerr << "Line " << __LINE__ << ": pose " << pose << ": " << filter->GetNumberOfContacts()
+          << " contacts within distance " << filter->GetProximityDistance() << ", expected 0" << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  if ( numberOfCollisions == 0 || numberOfCollisions == numberOfPoses )
+  {
+    std::cerr << "Line " << __LINE__ << ": " << numberOfCollisions << " of the " << numberOfPoses
+      << " poses collide, both cases have to be tested" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,230 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// Checks the structure of the flattened vtkCollisionHierarchy: the children of each node split its cells, each cell
+// is in one leaf, the boxes contain their triangles, the triangle table follows the reordered cell ids, and the
+// hierarchy is only built again when its inputs are modified
+
+// CollisionWarning includes
+#include "vtkCollisionHierarchy.h"
+
+// VTK includes
+#include <vtkMath.h>
+#include <vtkNew.h>
+#include <vtkPoints.h>
+#include <vtkPolyData.h>
+#include <vtkSphereSource.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+
+//------------------------------------------------------------------------------
+// Returns true if the nodes of the hierarchy are consistent with the cells of its data set, prints the first error
+// otherwise
+bool CheckHierarchy( vtkCollisionHierarchy* hierarchy )
+{
+  vtkPolyData* polyData = hierarchy->GetDataSet();
+  const vtkCollisionHierarchy::Node* nodes = hierarchy->GetNodes();
+  const vtkCollisionHierarchy::TriangleTable& table = hierarchy->GetTriangles();
+  const vtkIdType* cellIds = hierarchy->GetCellIds();
+  vtkIdType numberOfCells = polyData->GetNumberOfCells();
+  if ( hierarchy->GetNumberOfNodes() == 0 || nodes[0].Parent != -1 || nodes[0].First != 0
+    || nodes[0].Count != numberOfCells )
+  {
+    std::cerr << "The root does not contain the " << numberOfCells << " cells" << std::endl;
+    return false;
+  }
+
+  std::vector< int > numberOfLeaves( numberOfCells, 0 );
+  std::vector< int > levels( hierarchy->GetNumberOfNodes(), 0 );
+  int depth = 0;
+  for ( vtkIdType i = 0; i < hierarchy->GetNumberOfNodes(); i++ )
+  {
+    const vtkCollisionHierarchy::Node& node = nodes[i];
+    if ( i > 0 )
+    {
+      levels[i] = levels[ node.Parent ] + 1;
+      depth = std::max( depth, levels[i] );
+    }
+    if ( node.Child >= 0 )
+    {
+      const vtkCollisionHierarchy::Node& left = nodes[ node.Child ];
+      const vtkCollisionHierarchy::Node& right = nodes[ node.Child + 1 ];
+      if ( node.Child <= i || left.Parent != i || right.Parent != i || left.First != node.First
+        || right.First != left.First + left.Count || left.Count + right.Count != node.Count || left.Count == 0
+        || right.Count == 0 )
+      {
+        std::cerr << "The children of node " << i << " do not split its cells" << std::endl;
+        return false;
+      }
+    }
+    else
+    {
+      if ( node.Count > hierarchy->GetNumberOfCellsPerNode() && levels[i] < hierarchy->GetMaxLevel() )
+      {
+        std::cerr << "Leaf " << i << " has " << node.Count << " cells" << std::endl;
+        return false;
+      }
+      for ( vtkIdType k = node.First; k < node.First + node.Count; k++ )
+      {
+        numberOfLeaves[ cellIds[k] ]++;
+      }
+    }
+
+    for ( vtkIdType k = node.First; k < node.First + node.Count; k++ )
+    {
+      for ( int vertex = 0; vertex < 3; vertex++ )
+      {
+        double point[3];
+        for ( int axis = 0; axis < 3; axis++ )
+        {
+          point[axis] = table.Points[ 3 * vertex + axis ][k] - node.Center[axis];
+        }
+        for ( int axis = 0; axis < 3; axis++ )
+        {
+          if ( fabs( vtkMath::Dot( point, node.Axes[axis] ) ) > node.HalfExtents[axis] + 1e-9 )
+          {
+            std::cerr << "The box of node " << i << " does not contain its triangle " << k << std::endl;
+            return false;
+          }
+        }
+      }
+    }
+  }
+  if ( depth != hierarchy->GetLevel() )
+  {
+    std::cerr << "The hierarchy has " << depth << " levels instead of " << hierarchy->GetLevel() << std::endl;
+    return false;
+  }
+  for ( vtkIdType cellId = 0; cellId < numberOfCells; cellId++ )
+  {
+    if ( numberOfLeaves[cellId] != 1 )
+    {
+      std::cerr << "Cell " << cellId << " is in " << numberOfLeaves[cellId] << " leaves" << std::endl;
+      return false;
+    }
+  }
+
+  // The triangle table is in the order of the reordered cell ids
+  for ( vtkIdType k = 0; k < numberOfCells; k++ )
+  {
+    vtkIdType numberOfPoints = 0;
+    vtkIdType* pointIds = NULL;
+    polyData->GetCellPoints( cellIds[k], numberOfPoints, pointIds );
+    for ( int vertex = 0; vertex < 3; vertex++ )
+    {
+      double point[3];
+      polyData->GetPoints()->GetPoint( pointIds[vertex], point );
+      for ( int axis = 0; axis < 3; axis++ )
+      {
+        if ( table.Points[ 3 * vertex + axis ][k] != point[axis] )
+        {
+          std::cerr << "Row " << k << " of the triangle table is not cell " << cellIds[k] << std::endl;
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+} // end of anonymous namespace
+
+//------------------------------------------------------------------------------
+int vtkCollisionHierarchyTest1( int vtkNotUsed(argc), char* vtkNotUsed(argv)[] )
+{
+  vtkNew<vtkPolyData> body;
+  vtkNew<vtkCollisionHierarchy> hierarchy;
+  hierarchy->SetDataSet( body.GetPointer() );
+
+  // An empty data set has no node
+  hierarchy->BuildHierarchy();
+  if ( hierarchy->GetNumberOfNodes() != 0 || hierarchy->GetNodes() != NULL )
+  {
+    std::cerr << "Line " << __LINE__ << ": the hierarchy of an empty data set has "
+      << hierarchy->GetNumberOfNodes() << " nodes" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  int resolutions[3] = { 4, 12, 60 };
+  int cellsPerNode[3] = { 1, 2, 5 };
+  for ( int i = 0; i < 3; i++ )
+  {
+    vtkNew<vtkSphereSource> sphere;
+    sphere->SetRadius( 1.0 + i );
+    sphere->SetThetaResolution( resolutions[i] );
+    sphere->SetPhiResolution( resolutions[i] + 2 );
+    sphere->Update();
+    body->DeepCopy( sphere->GetOutput() );
+    for ( int j = 0; j < 3; j++ )
+    {
+      hierarchy->SetNumberOfCellsPerNode( cellsPerNode[j] );
+      hierarchy->BuildHierarchy();
+      if ( !CheckHierarchy( hierarchy.GetPointer() ) )
+      {
+        std::cerr << "Line " << __LINE__ << ": invalid hierarchy of " << body->GetNumberOfCells() << " cells with "
+          << cellsPerNode[j] << " cells per leaf" << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  // The depth is limited by MaxLevel, the deepest nodes are leaves with more cells
+  hierarchy->SetMaxLevel( 3 );
+  hierarchy->BuildHierarchy();
+  if ( hierarchy->GetLevel() != 3 || !CheckHierarchy( hierarchy.GetPointer() ) )
+  {
+    std::cerr << "Line " << __LINE__ << ": invalid hierarchy of " << hierarchy->GetLevel()
+      << " levels with a maximum of 3" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // The hierarchy is only built again when its data set or its parameters are modified
+  unsigned long buildTime = hierarchy->GetBuildTime();
+  hierarchy->BuildHierarchy();
+  if ( hierarchy->GetBuildTime() != buildTime )
+  {
+    std::cerr << "Line " << __LINE__ << ": the hierarchy has been built again without modification" << std::endl;
+    return EXIT_FAILURE;
+  }
+  hierarchy->SetMaxLevel( 64 );
+  hierarchy->BuildHierarchy();
+  if ( hierarchy->GetBuildTime() == buildTime || hierarchy->GetLevel() <= 3 )
+  {
+    std::cerr << "Line " << __LINE__ << ": the hierarchy has not been built again for a new maximum level"
+      << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  vtkNew<vtkSphereSource> coarseSphere;
+  coarseSphere->Update();
+  body->DeepCopy( coarseSphere->GetOutput() );
+  hierarchy->BuildHierarchy();
+  if ( !CheckHierarchy( hierarchy.GetPointer() ) )
+  {
+    std::cerr << "Line " << __LINE__ << ": the hierarchy has not been built again for new cells" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,174 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// Checks that the parallel build of vtkCollisionHierarchy gives the same hierarchy as the sequential build, for
+// oriented and axis aligned boxes
+
+// CollisionWarning includes
+#include "vtkCollisionHierarchy.h"
+
+// VTK includes
+#include <vtkMath.h>
+#include <vtkNew.h>
+#include <vtkPolyData.h>
+#include <vtkSphereSource.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+// Boxes of the nodes of a hierarchy by the range of their cells, which does not depend on the order of the nodes
+typedef std::map< std::pair< vtkIdType, vtkIdType >, std::vector< double > > NodeBoxMapType;
+
+//------------------------------------------------------------------------------
+// Gets the boxes of the nodes of the hierarchy, and checks that the children of each node split its cells, that
+// each cell is in one leaf and that the box of each node contains its triangles. Returns false on error.
+bool GetNodeBoxes( vtkCollisionHierarchy* hierarchy, NodeBoxMapType& boxes )
+{
+  const vtkCollisionHierarchy::Node* nodes = hierarchy->GetNodes();
+  const vtkCollisionHierarchy::TriangleTable& table = hierarchy->GetTriangles();
+  std::vector< int > numberOfLeaves( hierarchy->GetDataSet()->GetNumberOfCells(), 0 );
+  boxes.clear();
+  for ( vtkIdType i = 0; i < hierarchy->GetNumberOfNodes(); i++ )
+  {
+    const vtkCollisionHierarchy::Node& node = nodes[i];
+    if ( node.Child >= 0 )
+    {
+      const vtkCollisionHierarchy::Node& left = nodes[ node.Child ];
+      const vtkCollisionHierarchy::Node& right = nodes[ node.Child + 1 ];
+      if ( left.Parent != i || right.Parent != i || left.First != node.First || right.First != left.First + left.Count
+        || left.Count + right.Count != node.Count )
+      {
+        std::cerr << "The children of node " << i << " do not split its cells" << std::endl;
+        return false;
+      }
+    }
+    else
+    {
+      for ( vtkIdType k = node.First; k < node.First + node.Count; k++ )
+      {
+        numberOfLeaves[ hierarchy->GetCellIds()[k] ]++;
+      }
+    }
+    for ( vtkIdType k = node.First; k < node.First + node.Count; k++ )
+    {
+      for ( int vertex = 0; vertex < 3; vertex++ )
+      {
+        double point[3];
+        for ( int axis = 0; axis < 3; axis++ )
+        {
+          point[axis] = table.Points[ 3 * vertex + axis ][k] - node.Center[axis];
+        }
+        for ( int axis = 0; axis < 3; axis++ )
+        {
+          if ( fabs( vtkMath::Dot( point, node.Axes[axis] ) ) > node.HalfExtents[axis] + 1e-9 )
+          {
+            std::cerr << "The box of node " << i << " does not contain its triangle " << k << std::endl;
+            return false;
+          }
+        }
+      }
+    }
+    std::vector< double > box( node.Center, node.Center + 3 );
+    box.insert( box.end(), &node.Axes[0][0], &node.Axes[0][0] + 9 );
+    box.insert( box.end(), node.HalfExtents, node.HalfExtents + 3 );
+    box.push_back( node.Child < 0 ? 1.0 : 0.0 );
+    boxes[ std::make_pair( node.First, node.Count ) ] = box;
+  }
+  for ( size_t cellId = 0; cellId < numberOfLeaves.size(); cellId++ )
+  {
+    if ( numberOfLeaves[cellId] != 1 )
+    {
+      std::cerr << "Cell " << cellId << " is in " << numberOfLeaves[cellId] << " leaves" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Builds the hierarchy of the polydata sequentially and in parallel, returns true if both are valid and the same
+bool CheckParallelBuild( vtkPolyData* polyData, int hierarchyType )
+{
+  vtkNew<vtkCollisionHierarchy> sequentialHierarchy;
+  sequentialHierarchy->SetDataSet( polyData );
+  sequentialHierarchy->SetHierarchyType( hierarchyType );
+  sequentialHierarchy->ParallelBuildOff();
+  sequentialHierarchy->BuildHierarchy();
+  NodeBoxMapType sequentialBoxes;
+  if ( !GetNodeBoxes( sequentialHierarchy.GetPointer(), sequentialBoxes ) )
+  {
+    return false;
+  }
+
+  vtkNew<vtkCollisionHierarchy> parallelHierarchy;
+  parallelHierarchy->SetDataSet( polyData );
+  parallelHierarchy->SetHierarchyType( hierarchyType );
+  parallelHierarchy->ParallelBuildOn();
+  parallelHierarchy->BuildHierarchy();
+  NodeBoxMapType parallelBoxes;
+  if ( !GetNodeBoxes( parallelHierarchy.GetPointer(), parallelBoxes ) )
+  {
+    return false;
+  }
+
+  vtkIdType numberOfCells = polyData->GetNumberOfCells();
+  if ( parallelHierarchy->GetNumberOfNodes() != sequentialHierarchy->GetNumberOfNodes()
+    || parallelHierarchy->GetLevel() != sequentialHierarchy->GetLevel()
+    || !std::equal( parallelHierarchy->GetCellIds(), parallelHierarchy->GetCellIds() + numberOfCells,
+    sequentialHierarchy->GetCellIds() ) || parallelBoxes != sequentialBoxes )
+  {
+    std::cerr << sequentialHierarchy->GetHierarchyTypeAsString() << " hierarchy: the parallel build has "
+      << parallelHierarchy->GetNumberOfNodes() << " nodes and " << parallelHierarchy->GetLevel()
+      << " levels, the sequential build " << sequentialHierarchy->GetNumberOfNodes() << " nodes and "
+      << sequentialHierarchy->GetLevel() << " levels" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+} // end of anonymous namespace
+
+//------------------------------------------------------------------------------
+int vtkCollisionHierarchyTest2( int vtkNotUsed(argc), char* vtkNotUsed(argv)[] )
+{
+  // Enough cells for the top levels to be split in parallel
+  vtkNew<vtkSphereSource> sphere;
+  sphere->SetRadius( 1.0 );
+  sphere->SetThetaResolution( 160 );
+  sphere->SetPhiResolution( 120 );
+  sphere->Update();
+
+  int hierarchyTypes[2] = { vtkCollisionHierarchy::VTK_OBB_HIERARCHY, vtkCollisionHierarchy::VTK_AABB_HIERARCHY };
+  for ( int type = 0; type < 2; type++ )
+  {
+    if ( !CheckParallelBuild( sphere->GetOutput(), hierarchyTypes[type] ) )
+    {
+      std::cerr << "Line " << __LINE__ << ": the parallel build differs from the sequential build" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,231 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// Checks that the hierarchy of vtkCollisionHierarchy is refitted when only the points of its data set move, and that
+// the refitted hierarchy gives the same collisions as a hierarchy built from scratch for the moved points
+
+// CollisionWarning includes
+#include "vtkCollisionDetectionFilter.h"
+#include "vtkCollisionHierarchy.h"
+
+// VTK includes
+#include <vtkIdTypeArray.h>
+#include <vtkMath.h>
+#include <vtkMatrix4x4.h>
+#include <vtkNew.h>
+#include <vtkPoints.h>
+#include <vtkPolyData.h>
+#include <vtkSphereSource.h>
+
+// STD includes
+#include <cmath>
+#include <iostream>
+#include <set>
+#include <utility>
+
+namespace
+{
+
+typedef std::set< std::pair< vtkIdType, vtkIdType > > CellPairSet;
+
+//------------------------------------------------------------------------------
+// Returns true if the box of each node of the hierarchy contains the triangles of the node
+bool CheckBoxes( vtkCollisionHierarchy* hierarchy )
+{
+  const vtkCollisionHierarchy::Node* nodes = hierarchy->GetNodes();
+  const vtkCollisionHierarchy::TriangleTable& table = hierarchy->GetTriangles();
+  for ( vtkIdType i = 0; i < hierarchy->GetNumberOfNodes(); i++ )
+  {
+    const vtkCollisionHierarchy::Node& node = nodes[i];
+    for ( vtkIdType k = node.First; k < node.First + node.Count; k++ )
+    {
+      for ( int vertex = 0; vertex < 3; vertex++ )
+      {
+        double point[3];
+        for ( int axis = 0; axis < 3; axis++ )
+        {
+          point[axis] = table.Points[ 3 * vertex + axis ][k] - node.Center[axis];
+        }
+        for ( int axis = 0; axis < 3; axis++ )
+        {
+          if ( fabs( vtkMath::Dot( point, node.Axes[axis] ) ) > node.HalfExtents[axis] + 1e-9 )
+          {
+            std::cerr << "The box of node " << i << " does not contain its triangle " << k << std::endl;
+            return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Contacting cells found by the filter
+CellPairSet GetContactCells( vtkCollisionDetectionFilter* filter )
+{
+  CellPairSet cells;
+  vtkIdTypeArray* contactCells[2] = { filter->GetContactCells( 0 ), filter->GetContactCells( 1 ) };
+  for ( vtkIdType i = 0; i < contactCells[0]->GetNumberOfTuples(); i++ )
+  {
+    cells.insert( std::make_pair( contactCells[0]->GetValue( i ), contactCells[1]->GetValue( i ) ) );
+  }
+  return cells;
+}
+
+} // end of anonymous namespace
+
+//------------------------------------------------------------------------------
+int vtkCollisionHierarchyTest3( int vtkNotUsed(argc), char* vtkNotUsed(argv)[] )
+{
+  vtkNew<vtkSphereSource> sphere;
+  sphere->SetRadius( 1.0 );
+  sphere->SetThetaResolution( 48 );
+  sphere->SetPhiResolution( 40 );
+  sphere->Update();
+  vtkNew<vtkPolyData> body;
+  int hierarchyTypes[2] = { vtkCollisionHierarchy::VTK_OBB_HIERARCHY, vtkCollisionHierarchy::VTK_AABB_HIERARCHY };
+
+  // The hierarchy of the body is refitted when its points move, and gives the same collisions with a second model as
+  // a filter that builds the hierarchy of a copy of the moved body
+  vtkNew<vtkSphereSource> secondSphere;
+  secondSphere->SetRadius( 0.5 );
+  secondSphere->SetThetaResolution( 24 );
+  secondSphere->SetPhiResolution( 20 );
+  secondSphere->Update();
+
+  vtkNew<vtkMatrix4x4> bodyToWorld;
+  vtkNew<vtkMatrix4x4> secondToWorld;
+  for ( int type = 0; type < 2; type++ )
+  {
+    body->DeepCopy( sphere->GetOutput() );
+    vtkNew<vtkCollisionHierarchy> hierarchy;
+    hierarchy->SetDataSet( body.GetPointer() );
+    hierarchy->SetHierarchyType( hierarchyTypes[type] );
+    hierarchy->BuildHierarchy();
+
+    vtkNew<vtkCollisionDetectionFilter> refitFilter;
+    refitFilter->SetInputData( 0, body.GetPointer() );
+    refitFilter->SetHierarchy( 0, hierarchy.GetPointer() );
+    vtkNew<vtkPolyData> rebuiltBody;
+    vtkNew<vtkCollisionDetectionFilter> rebuildFilter;
+    rebuildFilter->SetInputData( 0, rebuiltBody.GetPointer() );
+    vtkCollisionDetectionFilter* filters[2] = { refitFilter.GetPointer(), rebuildFilter.GetPointer() };
+    for ( int i = 0; i < 2; i++ )
+    {
+      filters[i]->SetInputData( 1, secondSphere->GetOutput() );
+      filters[i]->SetMatrix( 0, bodyToWorld.GetPointer() );
+      filters[i]->SetMatrix( 1, secondToWorld.GetPointer() );
+      filters[i]->SetHierarchyType( hierarchyTypes[type] );
+    }
+
+    for ( int frame = 1; frame <= 6; frame++ )
+    {
+      // The body breathes and twists a little more at each frame
+      vtkPoints* points = body->GetPoints();
+      vtkPoints* originalPoints = sphere->GetOutput()->GetPoints();
+      for ( vtkIdType i = 0; i < points->GetNumberOfPoints(); i++ )
+      {
+        double point[3];
+        originalPoints->GetPoint( i, point );
+        double scale = 1.0 + 0.02 * frame * sin( 3.0 * point[2] );
+        double angle = 0.05 * frame * point[2];
+        points->SetPoint( i, scale * ( point[0] * cos( angle ) - point[1] * sin( angle ) ),
+          scale * ( point[0] * sin( angle ) + point[1] * cos( angle ) ), point[2] );
+      }
+      points->Modified();
+      unsigned long topologyTime = hierarchy->GetTopologyTime();
+      unsigned long buildTime = hierarchy->GetBuildTime();
+      hierarchy->BuildHierarchy();
+      if ( hierarchy->GetTopologyTime() != topologyTime || hierarchy->GetBuildTime() == buildTime
+        || !CheckBoxes( hierarchy.GetPointer() ) )
+      {
+        std::cerr << "Line " << __LINE__ << ": " << hierarchy->GetHierarchyTypeAsString() << " hierarchy, frame "
+          << frame << ": the hierarchy has not been refitted to the moved points" << std::endl;
+        return EXIT_FAILURE;
+      }
+      rebuiltBody->DeepCopy( body.GetPointer() );
+
+      // The second sphere crosses the surface of the body
+      secondToWorld->SetElement( 0, 3, 0.6 + 0.1 * frame );
+      secondToWorld->SetElement( 1, 3, 0.1 * frame );
+      for ( int i = 0; i < 2; i++ )
+      {
+        filters[i]->SetCollisionModeToAllContacts();
+        filters[i]->Update();
+      }
+      CellPairSet refitCells = GetContactCells( refitFilter.GetPointer() );
+      if ( refitCells.empty() || refitCells != GetContactCells( rebuildFilter.GetPointer() ) )
+      {
+        std::cerr << "Line " << __LINE__ << ": " << hierarchy->GetHierarchyTypeAsString() << " hierarchy, frame "
+          << frame << ": " << refitFilter->GetNumberOfContacts() << " contacts with the refitted hierarchy, "
+          << rebuildFilter->GetNumberOfContacts() << " with the rebuilt one" << std::endl;
+        return EXIT_FAILURE;
+      }
+
+      secondToWorld->SetElement( 0, 3, 1.8 + 0.1 * frame );
+      for ( int i = 0; i < 2; i++ )
+      {
+        filters[i]->SetCollisionModeToMinimumDistance();
+        filters[i]->Update();
+      }
+      if ( fabs( refitFilter->GetMinimumDistance() - rebuildFilter->GetMinimumDistance() ) > 1e-9
+        || refitFilter->GetMinimumDistance() <= 0 )
+      {
+        std::cerr << "Line " << __LINE__ << ": " << hierarchy->GetHierarchyTypeAsString() << " hierarchy, frame "
+          << frame << ": distance " << refitFilter->GetMinimumDistance() << " with the refitted hierarchy, "
+          << rebuildFilter->GetMinimumDistance() << " with the rebuilt one" << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    // A copy of the hierarchy is refitted to a copy of the body whose points have moved again, the original keeps the
+    // boxes fitted to the body
+    vtkNew<vtkPoints> movedPoints;
+    movedPoints->DeepCopy( body->GetPoints() );
+    for ( vtkIdType i = 0; i < movedPoints->GetNumberOfPoints(); i++ )
+    {
+      double point[3];
+      movedPoints->GetPoint( i, point );
+      movedPoints->SetPoint( i, 1.1 * point[0], point[1], 0.9 * point[2] );
+    }
+    vtkNew<vtkPolyData> movedBody;
+    movedBody->ShallowCopy( body.GetPointer() );
+    movedBody->SetPoints( movedPoints.GetPointer() );
+    vtkNew<vtkCollisionHierarchy> copy;
+    copy->SetDataSet( movedBody.GetPointer() );
+    copy->DeepCopy( hierarchy.GetPointer() );
+    unsigned long buildTime = hierarchy->GetBuildTime();
+    unsigned long copyTopologyTime = copy->GetTopologyTime();
+    copy->BuildHierarchy();
+    hierarchy->BuildHierarchy();
+    bool sameCells = ( copy->GetNumberOfNodes() == hierarchy->GetNumberOfNodes() );
+    for ( vtkIdType k = 0; sameCells && k < body->GetNumberOfCells(); k++ )
+    {
+      sameCells = ( copy->GetCellIds()[k] == hierarchy->GetCellIds()[k] );
+    }
+    if ( !sameCells || copy->GetTopologyTime() != copyTopologyTime || !CheckBoxes( copy.GetPointer() )
+      || hierarchy->GetBuildTime() != buildTime )
+    {
+      std::cerr << "Line " << __LINE__ << ": " << hierarchy->GetHierarchyTypeAsString()
+        << " hierarchy: the copy has not been refitted to the moved points" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
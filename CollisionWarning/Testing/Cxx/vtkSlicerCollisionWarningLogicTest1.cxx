@@ -0,0 +1,184 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// Checks that a model whose points move is refitted by the logic instead of being built again, and that the
+// distance computed with the refitted hierarchy is the one of the moved model
+
+// CollisionWarning includes
+#include "vtkCollisionDetectionFilter.h"
+#include "vtkMRMLCollisionWarningNode.h"
+#include "vtkSlicerCollisionWarningLogic.h"
+
+// MRML includes
+#include "vtkMRMLLinearTransformNode.h"
+#include "vtkMRMLModelNode.h"
+#include "vtkMRMLScene.h"
+
+// VTK includes
+#include <vtkMatrix4x4.h>
+#include <vtkNew.h>
+#include <vtkPoints.h>
+#include <vtkPolyData.h>
+#include <vtkSphereSource.h>
+
+// VTKSYS includes
+#include <vtksys/SystemTools.hxx>
+
+// STD includes
+#include <cmath>
+#include <iostream>
+
+namespace
+{
+
+//------------------------------------------------------------------------------
+// Distance between the models computed from scratch, without the logic
+double ComputeDistance( vtkPolyData* first, vtkPolyData* second, vtkMatrix4x4* secondToRas )
+{
+  vtkNew<vtkMatrix4x4> identity;
+  vtkNew<vtkCollisionDetectionFilter> filter;
+  filter->SetInputData( 0, first );
+  filter->SetInputData( 1, second );
+  filter->SetMatrix( 0, identity.GetPointer() );
+  filter->SetMatrix( 1, secondToRas );
+  filter->SetCollisionModeToMinimumDistance();
+  filter->Update();
+  return filter->GetMinimumDistance();
+}
+
+//------------------------------------------------------------------------------
+// Runs the frames of the logic until the distance of the node is the expected one, as the hierarchies are built in
+// the background
+bool WaitForDistance( vtkSlicerCollisionWarningLogic* logic, vtkMRMLCollisionWarningNode* node, double distance )
+{
+  for ( int i = 0; i < 1000; i++ )
+  {
+    logic->UpdateFrame();
+    double closestPoints[6];
+    if ( logic->GetClosestPoints( node, closestPoints )
+      && fabs( node->GetClosestDistanceToModelFromToolTip() - distance ) < 1e-6 )
+    {
+      return true;
+    }
+    vtksys::SystemTools::Delay( 10 );
+  }
+  std::cerr << "Distance " << node->GetClosestDistanceToModelFromToolTip() << " expected " << distance << std::endl;
+  return false;
+}
+
+} // end of anonymous namespace
+
+//------------------------------------------------------------------------------
+int vtkSlicerCollisionWarningLogicTest1( int vtkNotUsed(argc), char* vtkNotUsed(argv)[] )
+{
+  vtkNew<vtkMRMLScene> scene;
+  vtkNew<vtkSlicerCollisionWarningLogic> logic;
+  logic->SetMRMLScene( scene.GetPointer() );
+  // Evaluate the node in the event handlers, so that each modification is evaluated once
+  logic->AsynchronousUpdateOff();
+
+  vtkNew<vtkSphereSource> firstSphere;
+  firstSphere->SetRadius( 1.0 );
+  firstSphere->SetThetaResolution( 24 );
+  firstSphere->SetPhiResolution( 32 );
+  firstSphere->Update();
+  vtkNew<vtkPolyData> firstBody;
+  firstBody->DeepCopy( firstSphere->GetOutput() );
+
+  vtkNew<vtkSphereSource> secondSphere;
+  secondSphere->SetRadius( 0.8 );
+  secondSphere->Update();
+
+  vtkNew<vtkMRMLModelNode> firstModelNode;
+  firstModelNode->SetAndObservePolyData( firstBody.GetPointer() );
+  scene->AddNode( firstModelNode.GetPointer() );
+
+  vtkNew<vtkMRMLLinearTransformNode> secondToRasNode;
+  scene->AddNode( secondToRasNode.GetPointer() );
+  vtkNew<vtkMatrix4x4> secondToRas;
+  secondToRas->SetElement( 0, 3, 2.5 );
+  secondToRasNode->SetMatrixTransformToParent( secondToRas.GetPointer() );
+
+  vtkNew<vtkMRMLModelNode> secondModelNode;
+  secondModelNode->SetAndObservePolyData( secondSphere->GetOutput() );
+  secondModelNode->SetAndObserveTransformNodeID( secondToRasNode->GetID() );
+  scene->AddNode( secondModelNode.GetPointer() );
+
+  vtkNew<vtkMRMLCollisionWarningNode> collisionNode;
+  scene->AddNode( collisionNode.GetPointer() );
+  logic->SetWatchedModelNode( firstModelNode.GetPointer(), collisionNode.GetPointer() );
+  logic->SetSecondModelNode( secondModelNode.GetPointer(), collisionNode.GetPointer() );
+
+  if ( !WaitForDistance( logic.GetPointer(), collisionNode.GetPointer(),
+    ComputeDistance( firstBody.GetPointer(), secondSphere->GetOutput(), secondToRas.GetPointer() ) ) )
+  {
+    std::cerr << "Line " << __LINE__ << ": the first build did not give the distance of the models" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if ( logic->GetNumberOfRefittedModels() != 0 )
+  {
+    std::cerr << "Line " << __LINE__ << ": a model has been refitted before it was modified" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Only move the points of the first model: a copy of the hierarchy is refitted in the background, and the distance
+  // is the one of the moved model once it has finished
+  vtkPoints* points = firstBody->GetPoints();
+  for ( vtkIdType i = 0; i < points->GetNumberOfPoints(); i++ )
+  {
+    double point[3];
+    points->GetPoint( i, point );
+    points->SetPoint( i, 1.2 * point[0], 1.1 * point[1], point[2] );
+  }
+  points->Modified();
+  firstBody->Modified();
+  firstModelNode->Modified();
+
+  double movedDistance = ComputeDistance( firstBody.GetPointer(), secondSphere->GetOutput(), secondToRas.GetPointer() );
+  if ( logic->GetNumberOfRefittedModels() != 1 )
+  {
+    std::cerr << "Line " << __LINE__ << ": moving the points refitted " << logic->GetNumberOfRefittedModels()
+      << " models instead of 1" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if ( !WaitForDistance( logic.GetPointer(), collisionNode.GetPointer(), movedDistance ) )
+  {
+    std::cerr << "Line " << __LINE__ << ": the refit did not give the distance of the moved model" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Changing the cells cannot be refitted, the model is built again in the background
+  vtkNew<vtkSphereSource> coarseSphere;
+  coarseSphere->SetRadius( 1.1 );
+  coarseSphere->Update();
+  firstBody->DeepCopy( coarseSphere->GetOutput() );
+  firstModelNode->Modified();
+
+  if ( !WaitForDistance( logic.GetPointer(), collisionNode.GetPointer(),
+    ComputeDistance( firstBody.GetPointer(), secondSphere->GetOutput(), secondToRas.GetPointer() ) ) )
+  {
+    std::cerr << "Line " << __LINE__ << ": the rebuild did not give the distance of the new model" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if ( logic->GetNumberOfRefittedModels() != 1 )
+  {
+    std::cerr << "Line " << __LINE__ << ": a model with new cells has been refitted" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// Checks that the asynchronous update of the logic ends in the same state of the module node as the update in the
+// event handlers, for models apart, touching, penetrating and beyond the maximum distance, and when a model is cleared
+
+// CollisionWarning includes
+#include "vtkMRMLCollisionWarningNode.h"
+#include "vtkSlicerCollisionWarningLogic.h"
+
+// MRML includes
+#include "vtkMRMLLinearTransformNode.h"
+#include "vtkMRMLModelNode.h"
+#include "vtkMRMLScene.h"
+
+// VTK includes
+#include <vtkMatrix4x4.h>
+#include <vtkNew.h>
+#include <vtkPolyData.h>
+#include <vtkSphereSource.h>
+
+// VTKSYS includes
+#include <vtksys/SystemTools.hxx>
+
+// STD includes
+#include <cmath>
+#include <iostream>
+
+namespace
+{
+
+//------------------------------------------------------------------------------
+// Scene with two sphere models watched by a module node, whose second model is moved by a transform node
+class CollisionScene
+{
+public:
+  CollisionScene( bool asynchronousUpdate, vtkPolyData* first, vtkPolyData* second )
+  {
+    this->Logic->SetMRMLScene( this->Scene.GetPointer() );
+    this->Logic->SetAsynchronousUpdate( asynchronousUpdate );
+    this->Logic->SetMaximumDistance( 5.0 );
+
+    this->FirstModelNode->SetAndObservePolyData( first );
+    this->Scene->AddNode( this->FirstModelNode.GetPointer() );
+    this->Scene->AddNode( this->SecondToRasNode.GetPointer() );
+    this->SecondModelNode->SetAndObservePolyData( second );
+    this->SecondModelNode->SetAndObserveTransformNodeID( this->SecondToRasNode->GetID() );
+    this->Scene->AddNode( this->SecondModelNode.GetPointer() );
+    this->Scene->AddNode( this->CollisionNode.GetPointer() );
+    this->Logic->SetWatchedModelNode( this->FirstModelNode.GetPointer(), this->CollisionNode.GetPointer() );
+    this->Logic->SetSecondModelNode( this->SecondModelNode.GetPointer(), this->CollisionNode.GetPointer() );
+  }
+
+  // Runs the frames of the logic until it has no pending update, returns false if it never gets idle
+  bool WaitForUpdates()
+  {
+    for ( int i = 0; i < 1000; i++ )
+    {
+      this->Logic->UpdateFrame();
+      if ( !this->Logic->HasPendingUpdates() )
+      {
+        return true;
+      }
+      vtksys::SystemTools::Delay( 10 );
+    }
+    return false;
+  }
+
+  vtkNew<vtkMRMLScene> Scene;
+  vtkNew<vtkSlicerCollisionWarningLogic> Logic;
+  vtkNew<vtkMRMLModelNode> FirstModelNode;
+  vtkNew<vtkMRMLModelNode> SecondModelNode;
+  vtkNew<vtkMRMLLinearTransformNode> SecondToRasNode;
+  vtkNew<vtkMRMLCollisionWarningNode> CollisionNode;
+};
+
+//------------------------------------------------------------------------------
+// Returns true if the module nodes of the scenes are in the same state, prints the difference otherwise
+bool CompareStates( CollisionScene& asynchronousScene, CollisionScene& synchronousScene )
+{
+  vtkMRMLCollisionWarningNode* asynchronousNode = asynchronousScene.CollisionNode.GetPointer();
+  vtkMRMLCollisionWarningNode* synchronousNode = synchronousScene.CollisionNode.GetPointer();
+  if ( fabs( asynchronousNode->GetClosestDistanceToModelFromToolTip()
+    - synchronousNode->GetClosestDistanceToModelFromToolTip() ) > 1e-9
+    || asynchronousNode->GetCollision() != synchronousNode->GetCollision() )
+  {
+    std::cerr << "Asynchronous distance " << asynchronousNode->GetClosestDistanceToModelFromToolTip() << " collision "
+      << asynchronousNode->GetCollision() << ", synchronous distance "
+      << synchronousNode->GetClosestDistanceToModelFromToolTip() << " collision " << synchronousNode->GetCollision()
+      << std::endl;
+    return false;
+  }
+  int asynchronousContacts = asynchronousScene.Logic->GetNumberOfContacts( asynchronousNode );
+  int synchronousContacts = synchronousScene.Logic->GetNumberOfContacts( synchronousNode );
+  if ( asynchronousContacts != synchronousContacts )
+  {
+    std::cerr << "Asynchronous contacts " << asynchronousContacts << ", synchronous contacts " << synchronousContacts
+      << std::endl;
+    return false;
+  }
+  double asynchronousPoints[6];
+  double synchronousPoints[6];
+  bool asynchronousFound = asynchronousScene.Logic->GetClosestPoints( asynchronousNode, asynchronousPoints );
+  bool synchronousFound = synchronousScene.Logic->GetClosestPoints( synchronousNode, synchronousPoints );
+  if ( asynchronousFound != synchronousFound )
+  {
+    std::cerr << "Closest points found by the asynchronous update " << asynchronousFound << ", by the synchronous update "
+      << synchronousFound << std::endl;
+    return false;
+  }
+  for ( int i = 0; asynchronousFound && i < 6; i++ )
+  {
+    if ( fabs( asynchronousPoints[i] - synchronousPoints[i] ) > 1e-9 )
+    {
+      std::cerr << "Closest point coordinate " << i << ": asynchronous " << asynchronousPoints[i] << ", synchronous "
+        << synchronousPoints[i] << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+} // end of anonymous namespace
+
+//------------------------------------------------------------------------------
+int vtkSlicerCollisionWarningLogicTest2( int vtkNotUsed(argc), char* vtkNotUsed(argv)[] )
+{
+  vtkNew<vtkSphereSource> firstSphere;
+  firstSphere->SetRadius( 1.0 );
+  firstSphere->SetThetaResolution( 24 );
+  firstSphere->SetPhiResolution( 32 );
+  firstSphere->Update();
+
+  vtkNew<vtkSphereSource> secondSphere;
+  secondSphere->SetRadius( 0.8 );
+  secondSphere->SetThetaResolution( 16 );
+  secondSphere->SetPhiResolution( 12 );
+  secondSphere->Update();
+
+  CollisionScene asynchronousScene( true, firstSphere->GetOutput(), secondSphere->GetOutput() );
+  CollisionScene synchronousScene( false, firstSphere->GetOutput(), secondSphere->GetOutput() );
+
+  // Apart, touching, penetrating, concentric, beyond the maximum distance and back
+  const int numberOfPoses = 7;
+  double translations[numberOfPoses] = { 3.0, 1.8, 1.2, 0.0, 9.0, 1.5, 3.5 };
+  vtkNew<vtkMatrix4x4> secondToRas;
+  for ( int pose = 0; pose < numberOfPoses; pose++ )
+  {
+    secondToRas->SetElement( 0, 3, translations[pose] );
+    secondToRas->SetElement( 1, 3, 0.1 * pose );
+    asynchronousScene.SecondToRasNode->SetMatrixTransformToParent( secondToRas.GetPointer() );
+    synchronousScene.SecondToRasNode->SetMatrixTransformToParent( secondToRas.GetPointer() );
+    if ( !asynchronousScene.WaitForUpdates() || !synchronousScene.WaitForUpdates() )
+    {
+      std::cerr << "Line " << __LINE__ << ": pose " << pose << ": the updates of the logic never end" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if ( !CompareStates( asynchronousScene, synchronousScene ) )
+    {
+      std::cerr << "Line " << __LINE__ << ": pose " << pose << ": the asynchronous update differs" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Clearing a model resets the state of the module node
+  asynchronousScene.Logic->SetSecondModelNode( NULL, asynchronousScene.CollisionNode.GetPointer() );
+  synchronousScene.Logic->SetSecondModelNode( NULL, synchronousScene.CollisionNode.GetPointer() );
+  if ( !asynchronousScene.WaitForUpdates() || !synchronousScene.WaitForUpdates() )
+  {
+    std::cerr << "Line " << __LINE__ << ": the updates of the logic never end after clearing a model" << std::endl;
+    return EXIT_FAILURE;
+  }
+  CollisionScene* scenes[2] = { &asynchronousScene, &synchronousScene };
+  for ( int i = 0; i < 2; i++ )
+  {
+    vtkMRMLCollisionWarningNode* node = scenes[i]->CollisionNode.GetPointer();
+    if ( node->GetClosestDistanceToModelFromToolTip() != 0.0 || node->GetCollision() )
+    {
+      std::cerr << "Line " << __LINE__ << ": distance " << node->GetClosestDistanceToModelFromToolTip()
+        << " collision " << node->GetCollision() << " after clearing a model" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Selecting the model again computes the same state as before
+  asynchronousScene.Logic->SetSecondModelNode( asynchronousScene.SecondModelNode.GetPointer(),
+    asynchronousScene.CollisionNode.GetPointer() );
+  synchronousScene.Logic->SetSecondModelNode( synchronousScene.SecondModelNode.GetPointer(),
+    synchronousScene.CollisionNode.GetPointer() );
+  if ( !asynchronousScene.WaitForUpdates() || !synchronousScene.WaitForUpdates() )
+  {
+    std::cerr << "Line " << __LINE__ << ": the updates of the logic never end after selecting a model" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if ( !CompareStates( asynchronousScene, synchronousScene )
+    || asynchronousScene.CollisionNode->GetClosestDistanceToModelFromToolTip() <= 0.0 )
+  {
+    std::cerr << "Line " << __LINE__ << ": the state differs after selecting the model again" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
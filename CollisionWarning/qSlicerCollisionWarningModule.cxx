@@ -44,6 +44,7 @@ public:
 
   vtkSlicerCollisionWarningLogic* ObservedLogic; // should be the same as logic(), it is used for adding/removing observer safely
   QTimer UpdateWarningSoundTimer;
+  QTimer UpdateFrameTimer;
   QPointer<QSound> WarningSound;
   double WarningSoundPeriodSec;
 };
@@ -90,7 +91,10 @@ qSlicerCollisionWarningModule::~qSlicerCollisionWarningModule()
     d->WarningSound->stop();
   }
   disconnect(&d->UpdateWarningSoundTimer, SIGNAL(timeout()), this, SLOT(updateWarningSound()));
+  d->UpdateFrameTimer.stop();
+  disconnect(&d->UpdateFrameTimer, SIGNAL(timeout()), this, SLOT(updateFrame()));
   this->qvtkReconnect(d->ObservedLogic, NULL, vtkCommand::ModifiedEvent, this, SLOT(updateWarningSound()));
+  this->qvtkReconnect(d->ObservedLogic, NULL, vtkSlicerCollisionWarningLogic::PendingUpdatesEvent, this, SLOT(startFrameTimer()));
   d->ObservedLogic = NULL;
 }
 
@@ -141,10 +145,16 @@ void qSlicerCollisionWarningModule::setup()
   }
 
   this->qvtkReconnect(d->ObservedLogic, moduleLogic, vtkCommand::ModifiedEvent, this, SLOT(updateWarningSound()));
+  this->qvtkReconnect(d->ObservedLogic, moduleLogic, vtkSlicerCollisionWarningLogic::PendingUpdatesEvent, this, SLOT(startFrameTimer()));
   d->ObservedLogic = moduleLogic;
 
   d->UpdateWarningSoundTimer.setSingleShot(true);
   connect(&d->UpdateWarningSoundTimer, SIGNAL(timeout()), this, SLOT(updateWarningSound()));
+
+  // The logic computes the collisions on a worker thread, their results are applied to the nodes on the main thread.
+  // The timer only runs while the logic has work to do, it is started by its PendingUpdatesEvent.
+  d->UpdateFrameTimer.setInterval(10);
+  connect(&d->UpdateFrameTimer, SIGNAL(timeout()), this, SLOT(updateFrame()));
 }
 
 //-----------------------------------------------------------------------------
@@ -187,6 +197,31 @@ void qSlicerCollisionWarningModule::updateWarningSound()
 }
 
 
+//------------------------------------------------------------------------------
+void qSlicerCollisionWarningModule::updateFrame()
+{
+  Q_D(qSlicerCollisionWarningModule);
+  if (d->ObservedLogic==NULL)
+  {
+    return;
+  }
+  d->ObservedLogic->UpdateFrame();
+  if (!d->ObservedLogic->HasPendingUpdates())
+  {
+    d->UpdateFrameTimer.stop();
+  }
+}
+
+//------------------------------------------------------------------------------
+void qSlicerCollisionWarningModule::startFrameTimer()
+{
+  Q_D(qSlicerCollisionWarningModule);
+  if (!d->UpdateFrameTimer.isActive())
+  {
+    d->UpdateFrameTimer.start();
+  }
+}
+
 //------------------------------------------------------------------------------
 void qSlicerCollisionWarningModule::stopSound()
 {
@@ -77,6 +77,10 @@ public slots:
 */
   void updateWarningSound();
   void stopSound();
+  /// Runs a frame of the asynchronous collision update of the logic
+  void updateFrame();
+  /// Runs the frames of the logic until it has no more work to do
+  void startFrameTimer();
 
 protected:
 